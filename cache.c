@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "cache.h"
+
+//
+// The cache is split into CACHE_SHARDS shards by key hash, each with its own
+// mutex, so concurrent queries rarely wait on each other. A shard is a
+// chained hash table for lookups plus a CLOCK ring for eviction: a hit sets
+// the entry's reference bit, and the hand sweeping the ring for room clears
+// set bits and evicts the first entry it finds without one. Each shard gets
+// an equal share of the byte budget, and results bigger than a quarter of a
+// share are not cached at all.
+//
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024
+#define CACHE_SLOTS 4096
+
+typedef struct cache_entry_s {
+  struct cache_entry_s * next;
+  unsigned int hash;
+  int slot;
+  int referenced;
+  uint64_t generation;
+  size_t length;
+  char * result;
+  char key[1];
+} cache_entry_t;
+
+typedef struct cache_shard_s {
+  pthread_mutex_t lock;
+  cache_entry_t * buckets[CACHE_BUCKETS];
+  cache_entry_t * ring[CACHE_SLOTS];
+  int hand;
+  size_t bytes;
+  size_t max_bytes;
+} cache_shard_t;
+
+struct query_cache_s {
+  cache_shard_t shards[CACHE_SHARDS];
+};
+
+static unsigned int cache_hash(const char * key)
+{
+  unsigned int hash = 5381;
+  int c;
+
+  while ((c = (unsigned char) *key++)) {
+    hash = ((hash << 5) + hash) + c;
+  }
+  return(hash);
+}
+
+static inline cache_shard_t * cache_shard(query_cache_t * cache, unsigned int hash)
+{
+  return &cache->shards[hash % CACHE_SHARDS];
+}
+
+static inline size_t entry_size(const cache_entry_t * entry)
+{
+  return sizeof(cache_entry_t) + strlen(entry->key) + entry->length;
+}
+
+static cache_entry_t ** find_entry(cache_shard_t * shard, const char * key, unsigned int hash)
+{
+  cache_entry_t ** link = &shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+
+  while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->key, key))) {
+    link = &(*link)->next;
+  }
+  return(link);
+}
+
+// Unlinks and frees an entry. Caller holds the shard lock.
+static void evict_entry(cache_shard_t * shard, cache_entry_t * entry)
+{
+  cache_entry_t ** link = find_entry(shard, entry->key, entry->hash);
+
+  *link = entry->next;
+  shard->ring[entry->slot] = NULL;
+  shard->bytes -= entry_size(entry);
+  free(entry->result);
+  free(entry);
+}
+
+// Sweeps the CLOCK hand until there are size bytes and a slot to spare.
+// Returns the free slot. Caller holds the shard lock.
+static int make_room(cache_shard_t * shard, size_t size)
+{
+  for (;;) {
+    cache_entry_t * entry = shard->ring[shard->hand];
+    int slot = shard->hand;
+
+    shard->hand = (shard->hand + 1) % CACHE_SLOTS;
+    if (entry == NULL) {
+      if (shard->bytes + size <= shard->max_bytes) {
+        return(slot);
+      }
+    } else if (entry->referenced) {
+      entry->referenced = 0;
+    } else {
+      evict_entry(shard, entry);
+      if (shard->bytes + size <= shard->max_bytes) {
+        return(slot);
+      }
+    }
+  }
+}
+
+query_cache_t * create_query_cache(size_t max_bytes)
+{
+  query_cache_t * cache;
+  int i;
+
+  cache = (query_cache_t *) calloc(1, sizeof(query_cache_t));
+  if (cache == NULL) {
+    return(NULL);
+  }
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    if (pthread_mutex_init(&cache->shards[i].lock, NULL)) {
+      perror("pthread_mutex_init");
+      free(cache);
+      return(NULL);
+    }
+    cache->shards[i].max_bytes = max_bytes / CACHE_SHARDS;
+  }
+  return(cache);
+}
+
+//
+// Looks up the result for key computed at generation. On a hit, returns 0
+// with a malloc'ed copy of the result (which the caller frees) in result.
+// Returns -1 on a miss, including an entry from another generation.
+//
+int query_cache_get(query_cache_t * cache, const char * key, uint64_t generation,
+                    char ** result, size_t * length)
+{
+  unsigned int hash = cache_hash(key);
+  cache_shard_t * shard = cache_shard(cache, hash);
+  cache_entry_t * entry;
+  int error = -1;
+
+  pthread_mutex_lock(&shard->lock);
+  entry = *find_entry(shard, key, hash);
+  if (entry != NULL && entry->generation == generation) {
+    *result = (char *) malloc(entry->length + 1);
+    if (*result != NULL) {
+      memcpy(*result, entry->result, entry->length);
+      (*result)[entry->length] = '\0';
+      *length = entry->length;
+      entry->referenced = 1;
+      error = 0;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return(error);
+}
+
+//
+// Stores the result for key as computed at generation, replacing whatever
+// was there for it. Silently does nothing if the result does not fit or
+// there is no memory for it; the cache is only ever a shortcut.
+//
+void query_cache_put(query_cache_t * cache, const char * key, uint64_t generation,
+                     const char * result, size_t length)
+{
+  unsigned int hash = cache_hash(key);
+  cache_shard_t * shard = cache_shard(cache, hash);
+  size_t key_length = strlen(key);
+  cache_entry_t * entry, * old;
+  int slot;
+
+  if (sizeof(cache_entry_t) + key_length + length > shard->max_bytes / 4) {
+    return;
+  }
+  entry = (cache_entry_t *) malloc(sizeof(cache_entry_t) + key_length);
+  if (entry == NULL) {
+    return;
+  }
+  entry->result = (char *) malloc(length ? length : 1);
+  if (entry->result == NULL) {
+    free(entry);
+    return;
+  }
+  memcpy(entry->key, key, key_length + 1);
+  memcpy(entry->result, result, length);
+  entry->length = length;
+  entry->hash = hash;
+  entry->generation = generation;
+  entry->referenced = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  old = *find_entry(shard, key, hash);
+  if (old != NULL) {
+    // A newer generation always wins, an older one is of no use
+    if (old->generation > generation) {
+      pthread_mutex_unlock(&shard->lock);
+      free(entry->result);
+      free(entry);
+      return;
+    }
+    evict_entry(shard, old);
+  }
+  slot = make_room(shard, entry_size(entry));
+  entry->slot = slot;
+  shard->ring[slot] = entry;
+  shard->bytes += entry_size(entry);
+  entry->next = shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+  shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS] = entry;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void destroy_query_cache(query_cache_t * cache)
+{
+  int i, j;
+
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    for (j = 0; j < CACHE_SLOTS; j++) {
+      if (cache->shards[i].ring[j] != NULL) {
+        free(cache->shards[i].ring[j]->result);
+        free(cache->shards[i].ring[j]);
+      }
+    }
+    pthread_mutex_destroy(&cache->shards[i].lock);
+  }
+  free(cache);
+}
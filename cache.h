@@ -0,0 +1,22 @@
+#ifndef __CACHE_H_537__
+#define __CACHE_H_537__
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Bounded cache of query results, keyed by the normalized query text. Every
+// entry carries the index generation it was computed at, and is only served
+// to a lookup made at that same generation; anything older is a miss. Safe
+// to use from any number of threads.
+//
+typedef struct query_cache_s query_cache_t;
+
+query_cache_t * create_query_cache(size_t max_bytes);
+int query_cache_get(query_cache_t * cache, const char * key, uint64_t generation,
+                    char ** result, size_t * length);
+void query_cache_put(query_cache_t * cache, const char * key, uint64_t generation,
+                     const char * result, size_t length);
+void destroy_query_cache(query_cache_t * cache);
+
+#endif // __CACHE_H_537__
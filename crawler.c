@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "crawler.h"
+
+//
+// Directories waiting to be read are kept on one stack shared by all the
+// workers, by path rather than by descriptor so a wide tree cannot run the
+// process out of them. A worker pushes the subdirectories it finds after
+// every getdents64 call, which keeps the others busy while it is still in
+// a big directory. The walk is over when the stack is empty and nobody is
+// in the middle of a directory that could add to it.
+//
+#define DIRENT_BUFFER (64 * 1024)
+
+// As returned by getdents64, which glibc only wraps in recent versions
+typedef struct linux_dirent64_s {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+} linux_dirent64_t;
+
+typedef struct crawl_dir_s {
+  struct crawl_dir_s * next;
+  char path[];
+} crawl_dir_t;
+
+typedef struct crawl_s {
+  const crawl_options_t * options;
+  crawl_sink_t sink;
+  void * arg;
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  crawl_dir_t * pending;
+  int busy;
+  int error;
+} crawl_t;
+
+typedef struct crawl_worker_s {
+  crawl_t * crawl;
+  int id;
+  pthread_t thread;
+  char * buffer;
+} crawl_worker_t;
+
+static const char * vcs_dirs[] = { ".svn", ".git", ".hg", ".bzr", "CVS" };
+
+static int matches_any(const char ** globs, int num_globs, const char * path,
+                       const char * name)
+{
+  int i;
+
+  for (i = 0; i < num_globs; i++) {
+    const char * subject = strchr(globs[i], '/') ? path : name;
+    if (fnmatch(globs[i], subject, 0) == 0) {
+      return(1);
+    }
+  }
+  return(0);
+}
+
+static int wanted_dir(const crawl_options_t * options, const char * path,
+                      const char * name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(vcs_dirs) / sizeof(vcs_dirs[0]); i++) {
+    if (!strcmp(name, vcs_dirs[i])) {
+      return(0);
+    }
+  }
+  return(!matches_any(options->exclude, options->num_exclude, path, name));
+}
+
+static int wanted_file(const crawl_options_t * options, const char * path,
+                       const char * name)
+{
+  if (matches_any(options->exclude, options->num_exclude, path, name)) {
+    return(0);
+  }
+  return(options->num_include == 0 ||
+         matches_any(options->include, options->num_include, path, name));
+}
+
+static crawl_dir_t * new_dir(const char * path, size_t length)
+{
+  crawl_dir_t * dir = (crawl_dir_t *) malloc(sizeof(crawl_dir_t) + length + 1);
+
+  if (dir != NULL) {
+    memcpy(dir->path, path, length);
+    dir->path[length] = '\0';
+  }
+  return(dir);
+}
+
+// Hands a list of directories to whoever is waiting for one
+static void push_dirs(crawl_t * crawl, crawl_dir_t * first, crawl_dir_t * last)
+{
+  pthread_mutex_lock(&crawl->lock);
+  last->next = crawl->pending;
+  crawl->pending = first;
+  pthread_cond_broadcast(&crawl->more);
+  pthread_mutex_unlock(&crawl->lock);
+}
+
+//
+// Reports the files in one directory and queues its subdirectories. A
+// directory that cannot be read is reported on stderr and skipped, as
+// find(1) does; only running out of memory or the sink stopping the crawl
+// is an error.
+//
+static int read_dir(crawl_worker_t * worker, const char * path)
+{
+  crawl_t * crawl = worker->crawl;
+  size_t path_length = strlen(path);
+  const char * separator = path[path_length - 1] == '/' ? "" : "/";
+  char child[PATH_MAX];
+  int fd, error = 0;
+
+  fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return(0);
+  }
+
+  while (error == 0) {
+    crawl_dir_t * first = NULL, * last = NULL;
+    long n = syscall(SYS_getdents64, fd, worker->buffer, DIRENT_BUFFER);
+    long offset;
+
+    if (n <= 0) {
+      if (n < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      }
+      break;
+    }
+    for (offset = 0; offset < n && error == 0; ) {
+      linux_dirent64_t * entry = (linux_dirent64_t *) (worker->buffer + offset);
+      const char * name = entry->d_name;
+      int type = entry->d_type, length;
+      struct stat st;
+
+      offset += entry->d_reclen;
+      if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        continue;
+      }
+      if (type == DT_UNKNOWN) {
+        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+          continue;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+      }
+      if (type != DT_DIR && type != DT_REG) {
+        continue;
+      }
+
+      length = snprintf(child, sizeof(child), "%s%s%s", path, separator, name);
+      if (length >= (int) sizeof(child)) {
+        fprintf(stderr, "%s%s%s: %s\n", path, separator, name, strerror(ENAMETOOLONG));
+        continue;
+      }
+      if (type == DT_REG) {
+        if (wanted_file(crawl->options, child, name)) {
+          error = crawl->sink(crawl->arg, worker->id, child);
+        }
+        continue;
+      }
+      if (wanted_dir(crawl->options, child, name)) {
+        crawl_dir_t * dir = new_dir(child, length);
+        if (dir == NULL) {
+          error = -ENOMEM;
+          break;
+        }
+        dir->next = NULL;
+        if (last == NULL) {
+          first = dir;
+        } else {
+          last->next = dir;
+        }
+        last = dir;
+      }
+    }
+    if (first != NULL) {
+      push_dirs(crawl, first, last);
+    }
+  }
+  close(fd);
+  return(error);
+}
+
+static void * crawl_worker(void * data)
+{
+  crawl_worker_t * worker = (crawl_worker_t *) data;
+  crawl_t * crawl = worker->crawl;
+  int error;
+
+  pthread_mutex_lock(&crawl->lock);
+  for (;;) {
+    crawl_dir_t * dir;
+
+    while (crawl->pending == NULL && crawl->busy > 0 && crawl->error == 0) {
+      pthread_cond_wait(&crawl->more, &crawl->lock);
+    }
+    if (crawl->pending == NULL || crawl->error != 0) {
+      break;
+    }
+    dir = crawl->pending;
+    crawl->pending = dir->next;
+    crawl->busy++;
+    pthread_mutex_unlock(&crawl->lock);
+
+    error = read_dir(worker, dir->path);
+    free(dir);
+
+    pthread_mutex_lock(&crawl->lock);
+    crawl->busy--;
+    if (error != 0 && crawl->error == 0) {
+      crawl->error = error;
+    }
+    // The last one out, or a failure, lets the waiting workers go
+    if (crawl->busy == 0 || crawl->error != 0) {
+      pthread_cond_broadcast(&crawl->more);
+    }
+  }
+  pthread_mutex_unlock(&crawl->lock);
+
+  error = crawl->sink(crawl->arg, worker->id, NULL);
+  if (error != 0) {
+    pthread_mutex_lock(&crawl->lock);
+    if (crawl->error == 0) {
+      crawl->error = error;
+    }
+    pthread_mutex_unlock(&crawl->lock);
+  }
+  return(NULL);
+}
+
+int crawl_directories(const char ** roots, int num_roots, int num_threads,
+                      const crawl_options_t * options, crawl_sink_t sink, void * arg)
+{
+  crawl_t crawl;
+  crawl_worker_t * workers;
+  crawl_dir_t * dir;
+  int i, started = 0, error = 0;
+
+  memset(&crawl, 0, sizeof(crawl));
+  crawl.options = options;
+  crawl.sink = sink;
+  crawl.arg = arg;
+
+  // Roots are checked up front so a typo is an error rather than nothing
+  for (i = num_roots - 1; i >= 0; i--) {
+    size_t length = strlen(roots[i]);
+    struct stat st;
+
+    if (stat(roots[i], &st)) {
+      error = -errno;
+      goto Cleanup;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      error = -ENOTDIR;
+      goto Cleanup;
+    }
+    while (length > 1 && roots[i][length - 1] == '/') {
+      length--;
+    }
+    if ((dir = new_dir(roots[i], length)) == NULL) {
+      error = -ENOMEM;
+      goto Cleanup;
+    }
+    dir->next = crawl.pending;
+    crawl.pending = dir;
+  }
+
+  workers = (crawl_worker_t *) calloc(num_threads, sizeof(crawl_worker_t));
+  if (workers == NULL) {
+    error = -ENOMEM;
+    goto Cleanup;
+  }
+  pthread_mutex_init(&crawl.lock, NULL);
+  pthread_cond_init(&crawl.more, NULL);
+
+  // The calling thread is worker 0, and the crawl makes do with however
+  // many of the others could be started
+  for (i = 0; i < num_threads; i++) {
+    workers[i].crawl = &crawl;
+    workers[i].id = i;
+    if ((workers[i].buffer = (char *) malloc(DIRENT_BUFFER)) == NULL) {
+      break;
+    }
+    if (i > 0 && pthread_create(&workers[i].thread, NULL, crawl_worker, &workers[i])) {
+      free(workers[i].buffer);
+      break;
+    }
+    started++;
+  }
+  if (started > 0) {
+    crawl_worker(&workers[0]);
+  }
+  for (i = 1; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  // Only now, as the others may fail as late as when they say they are done
+  error = (started > 0) ? crawl.error : -ENOMEM;
+  for (i = 0; i < started; i++) {
+    free(workers[i].buffer);
+  }
+
+  pthread_cond_destroy(&crawl.more);
+  pthread_mutex_destroy(&crawl.lock);
+  free(workers);
+
+ Cleanup:
+  while ((dir = crawl.pending) != NULL) {
+    crawl.pending = dir->next;
+    free(dir);
+  }
+  return(error);
+}
@@ -0,0 +1,38 @@
+#ifndef __CRAWLER_H_537__
+#define __CRAWLER_H_537__
+
+//
+// Walks directory trees with several threads and reports every regular
+// file under them as it is found, so whoever consumes the paths can get
+// going before the walk is over. Directories are read with getdents64 on
+// a descriptor from openat, and entries whose type the file system does
+// not report are looked up with fstatat relative to it. Symbolic links
+// are not followed, and VCS directories (.svn, .git, .hg, .bzr, CVS) are
+// never entered.
+//
+// Paths are the root joined with the entries below it, the way find(1)
+// prints them. A glob with a '/' in it is matched against the whole path,
+// any other glob against the last component only. A directory matching an
+// exclude glob is skipped entirely; a file is reported if it matches none
+// of the exclude globs and, when there are include globs, one of those.
+//
+typedef struct crawl_options_s {
+  const char ** include;
+  int num_include;
+  const char ** exclude;
+  int num_exclude;
+} crawl_options_t;
+
+//
+// Called with each file found by the worker thread that found it, numbered
+// from 0 to num_threads - 1, so per-thread state can be kept without locks.
+// Each worker calls it once more with a NULL path when it is done. A
+// negative return stops the crawl and is returned.
+//
+typedef int (*crawl_sink_t)(void * arg, int worker, const char * path);
+
+// Returns once every root is walked: 0, or a negative errno
+int crawl_directories(const char ** roots, int num_roots, int num_threads,
+                      const crawl_options_t * options, crawl_sink_t sink, void * arg);
+
+#endif // __CRAWLER_H_537__
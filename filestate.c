@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "filestate.h"
+
+//
+// Entries are split into FILE_STATE_SHARDS shards by path hash, each a
+// chained hash table with its own mutex that doubles its buckets as it
+// fills up. A search waiting for a file that is not done yet puts a waiter
+// with its own condition variable on the file's entry (making one for a
+// path nobody has listed yet, which goes again when its last waiter does)
+// and sleeps on it; whoever moves the file to a final state takes the
+// waiters off and signals each of them. A queued file gets promoted when
+// its first waiter turns up, or when it is queued if somebody is already
+// waiting.
+//
+#define FILE_STATE_SHARDS 16
+#define FILE_STATE_BUCKETS 64
+
+typedef struct file_waiter_s {
+  struct file_waiter_s * next;
+  pthread_cond_t wake;
+  int woken;
+} file_waiter_t;
+
+typedef struct file_entry_s {
+  struct file_entry_s * next;
+  unsigned int hash;
+  file_state_t state;
+  int promoted;
+  file_waiter_t * waiters;
+  char name[1];
+} file_entry_t;
+
+typedef struct file_shard_s {
+  pthread_mutex_t lock;
+  file_entry_t ** buckets;
+  unsigned int num_buckets;
+  unsigned int num_entries;
+} file_shard_t;
+
+struct file_states_s {
+  file_shard_t shards[FILE_STATE_SHARDS];
+  file_promote_t promote;
+  volatile int listing_closed;
+  volatile int finished;
+};
+
+static unsigned int file_hash(const char * name)
+{
+  unsigned int hash = 5381;
+  int c;
+
+  while ((c = (unsigned char) *name++)) {
+    hash = ((hash << 5) + hash) + c;
+  }
+  return(hash);
+}
+
+static inline file_shard_t * file_shard(file_states_t * states, unsigned int hash)
+{
+  return &states->shards[hash % FILE_STATE_SHARDS];
+}
+
+static file_entry_t ** find_entry(file_shard_t * shard, const char * name, unsigned int hash)
+{
+  file_entry_t ** link = &shard->buckets[(hash / FILE_STATE_SHARDS) % shard->num_buckets];
+
+  while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->name, name))) {
+    link = &(*link)->next;
+  }
+  return(link);
+}
+
+// Doubles the buckets once there are twice as many entries. Caller holds
+// the shard lock. Failing to grow only makes the chains longer.
+static void grow_shard(file_shard_t * shard)
+{
+  unsigned int num_buckets = 2 * shard->num_buckets, i;
+  file_entry_t ** buckets;
+
+  buckets = (file_entry_t **) calloc(num_buckets, sizeof(file_entry_t *));
+  if (buckets == NULL) {
+    return;
+  }
+  for (i = 0; i < shard->num_buckets; i++) {
+    file_entry_t * entry = shard->buckets[i], * next;
+    for (; entry != NULL; entry = next) {
+      file_entry_t ** head = &buckets[(entry->hash / FILE_STATE_SHARDS) % num_buckets];
+      next = entry->next;
+      entry->next = *head;
+      *head = entry;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->num_buckets = num_buckets;
+}
+
+// Finds the entry for name, adding an unlisted one if there is none.
+// Caller holds the shard lock.
+static file_entry_t * get_entry(file_shard_t * shard, const char * name, unsigned int hash)
+{
+  file_entry_t ** link = find_entry(shard, name, hash);
+  file_entry_t * entry = *link;
+  size_t length;
+
+  if (entry != NULL) {
+    return(entry);
+  }
+  length = strlen(name);
+  entry = (file_entry_t *) malloc(sizeof(file_entry_t) + length);
+  if (entry == NULL) {
+    return(NULL);
+  }
+  memcpy(entry->name, name, length + 1);
+  entry->hash = hash;
+  entry->state = FILE_UNLISTED;
+  entry->promoted = 0;
+  entry->waiters = NULL;
+  entry->next = NULL;
+  *link = entry;
+  if (++shard->num_entries > 2 * shard->num_buckets) {
+    grow_shard(shard);
+  }
+  return(entry);
+}
+
+// Drops the entry of a path that was only ever waited on, once nobody
+// waits on it any more, so unknown paths do not pile up. Caller holds the
+// shard lock.
+static void forget_entry(file_shard_t * shard, file_entry_t * entry)
+{
+  file_entry_t ** link;
+
+  if (entry->state != FILE_UNLISTED || entry->waiters != NULL) {
+    return;
+  }
+  link = find_entry(shard, entry->name, entry->hash);
+  *link = entry->next;
+  shard->num_entries--;
+  free(entry);
+}
+
+// Caller holds the shard lock
+static void wake_waiters(file_entry_t * entry)
+{
+  file_waiter_t * waiter = entry->waiters, * next;
+
+  for (; waiter != NULL; waiter = next) {
+    next = waiter->next;
+    waiter->woken = 1;
+    pthread_cond_signal(&waiter->wake);
+  }
+  entry->waiters = NULL;
+}
+
+file_states_t * create_file_states(file_promote_t promote)
+{
+  file_states_t * states;
+  int i;
+
+  states = (file_states_t *) calloc(1, sizeof(file_states_t));
+  if (states == NULL) {
+    return(NULL);
+  }
+  states->promote = promote;
+  for (i = 0; i < FILE_STATE_SHARDS; i++) {
+    file_shard_t * shard = &states->shards[i];
+
+    shard->num_buckets = FILE_STATE_BUCKETS;
+    shard->buckets = (file_entry_t **) calloc(FILE_STATE_BUCKETS, sizeof(file_entry_t *));
+    if (shard->buckets == NULL || pthread_mutex_init(&shard->lock, NULL)) {
+      free(shard->buckets);
+      while (--i >= 0) {
+        pthread_mutex_destroy(&states->shards[i].lock);
+        free(states->shards[i].buckets);
+      }
+      free(states);
+      return(NULL);
+    }
+  }
+  return(states);
+}
+
+void destroy_file_states(file_states_t * states)
+{
+  unsigned int i, j;
+
+  for (i = 0; i < FILE_STATE_SHARDS; i++) {
+    file_shard_t * shard = &states->shards[i];
+
+    for (j = 0; j < shard->num_buckets; j++) {
+      file_entry_t * entry = shard->buckets[j], * next;
+      for (; entry != NULL; entry = next) {
+        next = entry->next;
+        free(entry);
+      }
+    }
+    free(shard->buckets);
+    pthread_mutex_destroy(&shard->lock);
+  }
+  free(states);
+}
+
+int set_file_state(file_states_t * states, const char * name, file_state_t state)
+{
+  unsigned int hash = file_hash(name);
+  file_shard_t * shard = file_shard(states, hash);
+  file_entry_t * entry;
+  int promote = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  entry = get_entry(shard, name, hash);
+  if (entry == NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    return(-ENOMEM);
+  }
+  entry->state = state;
+  if (state == FILE_QUEUED) {
+    promote = entry->promoted = (entry->waiters != NULL);
+  }
+  if (state == FILE_INDEXED || state == FILE_FAILED) {
+    wake_waiters(entry);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  if (promote && states->promote != NULL) {
+    states->promote(name);
+  }
+  return(0);
+}
+
+file_state_t get_file_state(file_states_t * states, const char * name)
+{
+  unsigned int hash = file_hash(name);
+  file_shard_t * shard = file_shard(states, hash);
+  file_entry_t * entry;
+  file_state_t state;
+
+  pthread_mutex_lock(&shard->lock);
+  entry = *find_entry(shard, name, hash);
+  state = entry != NULL ? entry->state : FILE_UNLISTED;
+  pthread_mutex_unlock(&shard->lock);
+  return(state);
+}
+
+int claim_file(file_states_t * states, const char * name)
+{
+  unsigned int hash = file_hash(name);
+  file_shard_t * shard = file_shard(states, hash);
+  file_entry_t * entry;
+  int result = -1;
+
+  pthread_mutex_lock(&shard->lock);
+  entry = *find_entry(shard, name, hash);
+  if (entry != NULL && entry->state == FILE_QUEUED) {
+    entry->state = FILE_INDEXING;
+    result = 0;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return(result);
+}
+
+int wait_for_file(file_states_t * states, const char * name)
+{
+  unsigned int hash = file_hash(name);
+  file_shard_t * shard = file_shard(states, hash);
+  file_entry_t * entry;
+  file_waiter_t waiter;
+  int result = -1;
+
+  pthread_mutex_lock(&shard->lock);
+  for (;;) {
+    entry = *find_entry(shard, name, hash);
+    if (entry != NULL && entry->state == FILE_INDEXED) {
+      result = 0;
+      break;
+    }
+    if (entry != NULL && entry->state == FILE_FAILED) {
+      break;
+    }
+    if (states->finished ||
+        (states->listing_closed && (entry == NULL || entry->state == FILE_UNLISTED))) {
+      if (entry != NULL) {
+        forget_entry(shard, entry);
+      }
+      break;
+    }
+    if (entry == NULL && (entry = get_entry(shard, name, hash)) == NULL) {
+      break;
+    }
+    if (entry->state == FILE_QUEUED && !entry->promoted && states->promote != NULL) {
+      entry->promoted = 1;
+      pthread_mutex_unlock(&shard->lock);
+      states->promote(name);
+      pthread_mutex_lock(&shard->lock);
+      continue;
+    }
+
+    // Only an unlisted entry without waiters is removed, so ours is still
+    // there when woken
+    pthread_cond_init(&waiter.wake, NULL);
+    waiter.woken = 0;
+    waiter.next = entry->waiters;
+    entry->waiters = &waiter;
+    while (!waiter.woken) {
+      pthread_cond_wait(&waiter.wake, &shard->lock);
+    }
+    pthread_cond_destroy(&waiter.wake);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return(result);
+}
+
+// Wakes the waiters on every entry that is still short of a final state
+// and, unless everything is over, not listed either
+static void wake_stragglers(file_states_t * states, int unlisted_only)
+{
+  unsigned int i, j;
+
+  for (i = 0; i < FILE_STATE_SHARDS; i++) {
+    file_shard_t * shard = &states->shards[i];
+
+    pthread_mutex_lock(&shard->lock);
+    for (j = 0; j < shard->num_buckets; j++) {
+      file_entry_t * entry = shard->buckets[j];
+      for (; entry != NULL; entry = entry->next) {
+        if (!unlisted_only || entry->state == FILE_UNLISTED) {
+          wake_waiters(entry);
+        }
+      }
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void close_file_listing(file_states_t * states)
+{
+  states->listing_closed = 1;
+  wake_stragglers(states, 1);
+}
+
+void finish_file_states(file_states_t * states)
+{
+  states->listing_closed = 1;
+  states->finished = 1;
+  wake_stragglers(states, 0);
+}
+
+int count_file_states(file_states_t * states)
+{
+  int i, count = 0;
+
+  for (i = 0; i < FILE_STATE_SHARDS; i++) {
+    pthread_mutex_lock(&states->shards[i].lock);
+    count += states->shards[i].num_entries;
+    pthread_mutex_unlock(&states->shards[i].lock);
+  }
+  return(count);
+}
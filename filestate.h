@@ -0,0 +1,49 @@
+#ifndef __FILESTATE_H_537__
+#define __FILESTATE_H_537__
+
+//
+// Where each file stands with the indexers, keyed by path, for searches
+// that have to wait for a particular file. A search blocks on the file's
+// own entry and is woken only when that file is done, so any number of
+// them can wait on different files at once. Safe to use from any number
+// of threads.
+//
+typedef enum file_state_e {
+  FILE_UNLISTED,   // Not seen by the scanner (yet)
+  FILE_QUEUED,
+  FILE_INDEXING,
+  FILE_INDEXED,
+  FILE_FAILED
+} file_state_t;
+
+typedef struct file_states_s file_states_t;
+
+//
+// Called (without any lock held) the first time a file is both queued and
+// waited on, to have it indexed ahead of its turn
+//
+typedef void (*file_promote_t)(const char * name);
+
+file_states_t * create_file_states(file_promote_t promote);
+void destroy_file_states(file_states_t * states);
+
+// Returns 0, or -ENOMEM if a new entry could not be added
+int set_file_state(file_states_t * states, const char * name, file_state_t state);
+file_state_t get_file_state(file_states_t * states, const char * name);
+// Moves a queued file on to indexing. Returns 0, or -1 if it is not queued
+// (somebody else claimed it first), so a file that was promoted as well as
+// queued is indexed once.
+int claim_file(file_states_t * states, const char * name);
+
+// Waits until the file is indexed (returns 0) or never will be (returns -1)
+int wait_for_file(file_states_t * states, const char * name);
+
+// No more files will be listed, so waiting on an unlisted one is pointless
+void close_file_listing(file_states_t * states);
+// No more files will be indexed either
+void finish_file_states(file_states_t * states);
+
+// How many paths have an entry, listed or waited on, for tests
+int count_file_states(file_states_t * states);
+
+#endif // __FILESTATE_H_537__
@@ -4,11 +4,18 @@
 #include <sys/errno.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fnmatch.h>
 #include "index.h"
 
 // #define DEBUG
 // #define LOCK
 // #define GLOBAL
+// #define OPEN_ADDRESSING
 
 void rwlock_rdlock(pthread_rwlock_t *lock) {
     if (pthread_rwlock_rdlock(lock)) {
@@ -204,6 +211,19 @@ valuetype * fnname (struct hashtable *h, keytype *k) \
 unsigned int
 hashtable_count(struct hashtable *h);
 
+/*****************************************************************************
+ * hashtable_foreach
+   
+ * @name        hashtable_foreach
+ * @param   h   the hashtable
+ * @param   fn  called once for every key/value pair, in no particular order
+ * @param   arg passed through to fn
+ *
+ * The table must not be modified while it is being walked.
+ */
+void
+hashtable_foreach(struct hashtable *h, void (*fn) (void*,void*,void*), void *arg);
+
 
 /*****************************************************************************
  * hashtable_destroy
@@ -216,6 +236,8 @@ hashtable_count(struct hashtable *h);
 void
 hashtable_destroy(struct hashtable *h, int free_values);
 
+#ifndef OPEN_ADDRESSING
+
 /* Copyright (C) 2002, 2004 Christopher Clark <firstname.lastname@cl.cam.ac.uk> */
 
 
@@ -228,9 +250,34 @@ struct entry
 };
 
 
+/*
+ * Resizing is incremental: hashtable_expand only allocates the bigger table
+ * and parks the current one in oldtable. From then on every insert, search
+ * and remove moves a few buckets across (see hashtable_migrate) until the old
+ * table is empty and can be freed. Lookups check the old bucket first and then
+ * the new one, inserts always go to the new table.
+ *
+ * Locking: globallock is held for reading by every operation and for writing
+ * only while tables are swapped in or freed, which is constant work. Each
+ * table has its own array of bucket locks, striped over at most
+ * MAX_BUCKET_LOCKS locks, and the array is replaced together with the table.
+ * When two bucket locks are held at once it is always old before new.
+ */
+#define MAX_BUCKET_LOCKS 4096
+#define MIGRATE_INSERT_STEP 8
+#define MIGRATE_SEARCH_STEP 2
+
 struct hashtable {
     unsigned int tablelength;
     struct entry **table;
+    pthread_rwlock_t *locks;
+    unsigned int num_locks;
+    struct entry **oldtable;
+    unsigned int oldtablelength;
+    pthread_rwlock_t *oldlocks;
+    unsigned int oldnum_locks;
+    unsigned int migrateindex;
+    unsigned int migrated;
     unsigned int entrycount;
     unsigned int loadlimit;
     unsigned int primeindex;
@@ -238,8 +285,6 @@ struct hashtable {
     int (*eqfn) (void *k1, void *k2);
     pthread_rwlock_t globallock;
     pthread_rwlock_t entrycountlock;
-    pthread_rwlock_t *locks;
-    unsigned int num_locks;
 };
 
 /*****************************************************************************/
@@ -261,6 +306,13 @@ indexFor(unsigned int tablelength, unsigned int hashvalue)
 }
 */
 
+/*****************************************************************************/
+/* lockFor */
+static inline pthread_rwlock_t *
+lockFor(pthread_rwlock_t *locks, unsigned int num_locks, unsigned int index) {
+    return &locks[index % num_locks];
+}
+
 /*****************************************************************************/
 #define freekey(X) free(X)
 /*define freekey(X) ; */
@@ -287,6 +339,37 @@ static const unsigned int primes[] = {
 const unsigned int prime_table_length = sizeof(primes)/sizeof(primes[0]);
 const float max_load_factor = 0.65;
 
+/*****************************************************************************/
+static pthread_rwlock_t *
+create_locks(unsigned int size, unsigned int *num_locks)
+{
+    pthread_rwlock_t *locks;
+    unsigned int i, n = (size < MAX_BUCKET_LOCKS) ? size : MAX_BUCKET_LOCKS;
+
+    locks = (pthread_rwlock_t *) malloc(sizeof(pthread_rwlock_t) * n);
+    if (NULL == locks) return NULL; /*oom*/
+    for (i = 0; i < n; ++i) {
+        if (pthread_rwlock_init(&locks[i], NULL)) {
+            perror("pthread_rwlock_init");
+            exit(1);
+        }
+    }
+    *num_locks = n;
+    return locks;
+}
+
+static void
+destroy_locks(pthread_rwlock_t *locks, unsigned int num_locks)
+{
+    unsigned int i;
+    for (i = 0; i < num_locks; ++i) {
+        if (pthread_rwlock_destroy(&locks[i])) {
+            perror("pthread_rwlock_destroy");
+        }
+    }
+    free(locks);
+}
+
 /*****************************************************************************/
 struct hashtable *
 create_hashtable(unsigned int minsize,
@@ -301,11 +384,10 @@ create_hashtable(unsigned int minsize,
     for (pindex=0; pindex < prime_table_length; pindex++) {
         if (primes[pindex] > minsize) { size = primes[pindex]; break; }
     }
-    h = (struct hashtable *)malloc(sizeof(struct hashtable));
+    h = (struct hashtable *)calloc(1, sizeof(struct hashtable));
     if (NULL == h) return NULL; /*oom*/
-    h->table = (struct entry **)malloc(sizeof(struct entry*) * size);
+    h->table = (struct entry **)calloc(size, sizeof(struct entry*));
     if (NULL == h->table) { free(h); return NULL; } /*oom*/
-    memset(h->table, 0, size * sizeof(struct entry *));
     h->tablelength  = size;
     h->primeindex   = pindex;
     h->entrycount   = 0;
@@ -313,8 +395,8 @@ create_hashtable(unsigned int minsize,
     h->eqfn         = eqf;
     h->loadlimit    = (unsigned int) ceil(size * max_load_factor);
     // Allocate space for fine-grained locks
-    h->locks        = (pthread_rwlock_t *) malloc(sizeof(pthread_rwlock_t) * size);
-    h->num_locks    = size;
+    h->locks        = create_locks(size, &h->num_locks);
+    if (NULL == h->locks) { free(h->table); free(h); return NULL; } /*oom*/
 
     // Initialize locks
     if (pthread_rwlock_init(&h->globallock, NULL)) {
@@ -324,12 +406,6 @@ create_hashtable(unsigned int minsize,
     if (pthread_rwlock_init(&h->entrycountlock, NULL)) {
         perror("pthread_rwlock_init");
         return NULL;
-    }
-    for(int i = 0; i < size; ++i) {
-        if (pthread_rwlock_init(&h->locks[i], NULL)) {
-            perror("pthread_rwlock_init");
-            return NULL;
-        }
     }
 	return h;
 }
@@ -349,86 +425,111 @@ hash(struct hashtable *h, void *k)
 }
 
 /*****************************************************************************/
+/* Must be called with globallock held for reading. Moves up to 'steps' old
+ * buckets into the new table and returns non-zero once the caller should
+ * try to retire the old table. */
 static int
-hashtable_expand(struct hashtable *h)
+hashtable_migrate(struct hashtable *h, unsigned int steps)
+{
+    struct entry *e;
+    unsigned int i, index;
+    pthread_rwlock_t *oldlock, *newlock;
+
+    if (NULL == h->oldtable) return 0;
+
+    while (steps--) {
+        i = __sync_fetch_and_add(&h->migrateindex, 1);
+        if (i >= h->oldtablelength) break;
+
+        oldlock = lockFor(h->oldlocks, h->oldnum_locks, i);
+        rwlock_wrlock(oldlock);
+        while (NULL != (e = h->oldtable[i])) {
+            index = indexFor(h->tablelength, e->h);
+            newlock = lockFor(h->locks, h->num_locks, index);
+            rwlock_wrlock(newlock);
+            h->oldtable[i] = e->next;
+            e->next = h->table[index];
+            h->table[index] = e;
+            rwlock_wrunlock(newlock);
+        }
+        rwlock_wrunlock(oldlock);
+
+        if (__sync_add_and_fetch(&h->migrated, 1) == h->oldtablelength)
+            return -1;
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+/* Frees the old table once every bucket has been moved out of it. Must be
+ * called without holding globallock. */
+static void
+hashtable_retire(struct hashtable *h)
 {
-    // Acquire global write lock for entire function
     rwlock_wrlock(&h->globallock);
+    if (NULL != h->oldtable && h->migrated == h->oldtablelength) {
+#ifdef DEBUG
+        printf("retiring old table of %d buckets.\n", h->oldtablelength);
+#endif
+        free(h->oldtable);
+        destroy_locks(h->oldlocks, h->oldnum_locks);
+        h->oldtable = NULL;
+        h->oldlocks = NULL;
+        h->oldtablelength = 0;
+        h->oldnum_locks = 0;
+    }
+    rwlock_wrunlock(&h->globallock);
+}
 
+/*****************************************************************************/
+static int
+hashtable_expand(struct hashtable *h)
+{
     /* Double the size of the table to accomodate more entries */
     struct entry **newtable;
-    struct entry *e;
-    struct entry **pE;
-    unsigned int newsize, i, index;
-    /* Check we're not hitting max capacity */
-    if (h->primeindex == (prime_table_length - 1)) {
+    pthread_rwlock_t *newlocks;
+    unsigned int newsize, newnum_locks;
+
+    // Acquire global write lock to swap the tables, the entries themselves
+    // are moved later on by hashtable_migrate
+    rwlock_wrlock(&h->globallock);
+
+    /* Check we're not hitting max capacity, or already resizing */
+    if (h->primeindex == (prime_table_length - 1) || NULL != h->oldtable ||
+        hashtable_count(h) <= h->loadlimit) {
         // Release global write lock for early return
         rwlock_wrunlock(&h->globallock);
         return 0;
     }
-    newsize = primes[++(h->primeindex)];
+    newsize = primes[h->primeindex + 1];
 
-    newtable = (struct entry **)malloc(sizeof(struct entry*) * newsize);
-    if (NULL != newtable)
-    {
-        memset(newtable, 0, newsize * sizeof(struct entry *));
-        /* This algorithm is not 'stable'. ie. it reverses the list
-         * when it transfers entries between the tables */
-        for (i = 0; i < h->tablelength; i++) {
-            while (NULL != (e = h->table[i])) {
-                h->table[i] = e->next;
-                index = indexFor(newsize,e->h);
-                e->next = newtable[index];
-                newtable[index] = e;
-            }
-        }
-        free(h->table);
-        h->table = newtable;
-    }
-    /* Plan B: realloc instead */
-    else 
-    {
-        newtable = (struct entry **)
-                   realloc(h->table, newsize * sizeof(struct entry *));
-        if (NULL == newtable) {
-            (h->primeindex)--;
-            // Release global write lock for early return
-            rwlock_wrunlock(&h->globallock);
-            return 0;
-        }
-        h->table = newtable;
-        memset(newtable[h->tablelength], 0, newsize - h->tablelength);
-        for (i = 0; i < h->tablelength; i++) {
-            for (pE = &(newtable[i]), e = *pE; e != NULL; e = *pE) {
-                index = indexFor(newsize,e->h);
-                if (index == i)
-                {
-                    pE = &(e->next);
-                }
-                else
-                {
-                    *pE = e->next;
-                    e->next = newtable[index];
-                    newtable[index] = e;
-                }
-            }
-        }
+    newtable = (struct entry **)calloc(newsize, sizeof(struct entry*));
+    if (NULL == newtable) {
+        rwlock_wrunlock(&h->globallock);
+        return 0;
     }
-
 #ifdef DEBUG
-    printf("resizing fine-grained rwlock array to %d locks.\n", newsize);
+    printf("resizing table to %d buckets, %d rwlocks.\n", newsize, newsize < MAX_BUCKET_LOCKS ? newsize : MAX_BUCKET_LOCKS);
 #endif
-    // Realloc more rwlocks for newly resized table
-    h->locks = (pthread_rwlock_t *) realloc(h->locks, sizeof(pthread_rwlock_t) * newsize);
-    for(unsigned int i = h->num_locks; i < newsize; ++i) {
-        if (pthread_rwlock_init(&h->locks[i], NULL)) {
-            perror("pthread_rwlock_init");
-            exit(1);
-        }
+    newlocks = create_locks(newsize, &newnum_locks);
+    if (NULL == newlocks) {
+        free(newtable);
+        rwlock_wrunlock(&h->globallock);
+        return 0;
     }
-    h->num_locks = newsize;
 
+    h->oldtable       = h->table;
+    h->oldtablelength = h->tablelength;
+    h->oldlocks       = h->locks;
+    h->oldnum_locks   = h->num_locks;
+    h->migrateindex   = 0;
+    h->migrated       = 0;
+
+    h->table       = newtable;
     h->tablelength = newsize;
+    h->locks       = newlocks;
+    h->num_locks   = newnum_locks;
+    h->primeindex++;
     h->loadlimit   = (unsigned int) ceil(newsize * max_load_factor);
 
     // Release global write lock
@@ -455,6 +556,8 @@ hashtable_insert(struct hashtable *h, void *k, void *v)
     /* This method allows duplicate keys - but they shouldn't be used */
     unsigned int index;
     struct entry *e;
+    pthread_rwlock_t *lock;
+    int retire;
 
     // Use write lock for entry count increment 
     rwlock_wrlock(&h->entrycountlock);
@@ -479,65 +582,109 @@ hashtable_insert(struct hashtable *h, void *k, void *v)
         rwlock_wrunlock(&h->entrycountlock);
         return 0;
     } /*oom*/
-
-    // Use global read lock for hashing/index calculations
-    rwlock_rdlock(&h->globallock);
     e->h = hash(h,k);
-    index = indexFor(h->tablelength,e->h);
     e->k = k;
     e->v = v;
-    rwlock_rdunlock(&h->globallock);
 
-    // Use global write lock for list insertion
-    // TODO: internal lock causes problems, figure out why, using global instead
-    //rwlock_wrlock(&h->locks[index]);
-    rwlock_wrlock(&h->globallock);
+    // Global read lock keeps the table from being swapped underneath us,
+    // the bucket write lock protects the list insertion itself
+    rwlock_rdlock(&h->globallock);
+    index = indexFor(h->tablelength,e->h);
+    lock = lockFor(h->locks, h->num_locks, index);
+    rwlock_wrlock(lock);
 #ifdef DEBUG 
     printf("[%.8x indexer] inserting '%s' into index[%d]...\n", pthread_self(), k, index);
 #endif 
     e->next = h->table[index];
     h->table[index] = e;
-    rwlock_wrunlock(&h->globallock);
-    // TODO: internal lock causes problems, figure out why, using global instead
-    //rwlock_wrunlock(&h->locks[index]);
+    rwlock_wrunlock(lock);
+
+    retire = hashtable_migrate(h, MIGRATE_INSERT_STEP);
+    rwlock_rdunlock(&h->globallock);
+    if (retire) hashtable_retire(h);
 
     return -1;
 }
 
+/*****************************************************************************/
+/* Searches one bucket under its read lock */
+static struct entry *
+search_bucket(struct hashtable *h, struct entry **table, pthread_rwlock_t *lock,
+              unsigned int index, unsigned int hashvalue, void *k)
+{
+    struct entry *e;
+
+    rwlock_rdlock(lock);
+    e = table[index];
+    while (NULL != e)
+    {
+        /* Check hash value to short circuit heavier comparison */
+        if ((hashvalue == e->h) && (h->eqfn(k, e->k))) break;
+        e = e->next;
+    }
+    rwlock_rdunlock(lock);
+    return e;
+}
+
 /*****************************************************************************/
 void * /* returns value associated with key */
 hashtable_search(struct hashtable *h, void *k)
 {
-    struct entry *e;
+    struct entry *e = NULL;
     unsigned int hashvalue, index;
+    int retire;
 
-    // Use global read lock for hashing/indexing
-    rwlock_rdlock(&h->globallock);
     hashvalue = hash(h,k);
-    index = indexFor(h->tablelength,hashvalue);
+
+    // Use global read lock for the whole lookup, local read locks per bucket
+    rwlock_rdlock(&h->globallock);
+    if (NULL != h->oldtable) {
+        index = indexFor(h->oldtablelength,hashvalue);
+        e = search_bucket(h, h->oldtable,
+                          lockFor(h->oldlocks, h->oldnum_locks, index),
+                          index, hashvalue, k);
+    }
+    if (NULL == e) {
+        index = indexFor(h->tablelength,hashvalue);
+        e = search_bucket(h, h->table,
+                          lockFor(h->locks, h->num_locks, index),
+                          index, hashvalue, k);
+    }
+    retire = hashtable_migrate(h, MIGRATE_SEARCH_STEP);
     rwlock_rdunlock(&h->globallock);
+    if (retire) hashtable_retire(h);
+
+    return (NULL != e) ? e->v : NULL;
+}
+
+/*****************************************************************************/
+/* Unlinks the entry for k from one bucket under its write lock */
+static struct entry *
+remove_from_bucket(struct hashtable *h, struct entry **table,
+                   pthread_rwlock_t *lock, unsigned int index,
+                   unsigned int hashvalue, void *k)
+{
+    struct entry *e;
+    struct entry **pE;
 
-    // Use local read lock for searching
-    rwlock_rdlock(&h->locks[index]);
-    e = h->table[index];
+    rwlock_wrlock(lock);
+    pE = &(table[index]);
+    e = *pE;
     while (NULL != e)
     {
         /* Check hash value to short circuit heavier comparison */
-        if ((hashvalue == e->h) && (h->eqfn(k, e->k))) {
-            // Release local read lock for early return (key found)
-            rwlock_rdunlock(&h->locks[index]);
-            return e->v;
+        if ((hashvalue == e->h) && (h->eqfn(k, e->k)))
+        {
+            *pE = e->next;
+            break;
         }
+        pE = &(e->next);
         e = e->next;
     }
-    // Release local read lock for late return (key not found)
-    rwlock_rdunlock(&h->locks[index]);
-
-    return NULL;
+    rwlock_wrunlock(lock);
+    return e;
 }
 
-
-
 /*****************************************************************************/
 void * /* returns value associated with key */
 hashtable_remove(struct hashtable *h, void *k)
@@ -545,76 +692,98 @@ hashtable_remove(struct hashtable *h, void *k)
     /* TODO: consider compacting the table when the load factor drops enough,
      *       or provide a 'compact' method. */
 
-    struct entry *e;
-    struct entry **pE;
+    struct entry *e = NULL;
     void *v;
     unsigned int hashvalue, index;
+    int retire;
 
-    // Use global read lock for hashing/indexing
-    rwlock_rdlock(&h->globallock);
     hashvalue = hash(h,k);
-    index = indexFor(h->tablelength,hash(h,k));
+
+    // Use global read lock for the whole removal, local write locks per bucket
+    rwlock_rdlock(&h->globallock);
+    if (NULL != h->oldtable) {
+        index = indexFor(h->oldtablelength,hashvalue);
+        e = remove_from_bucket(h, h->oldtable,
+                               lockFor(h->oldlocks, h->oldnum_locks, index),
+                               index, hashvalue, k);
+    }
+    if (NULL == e) {
+        index = indexFor(h->tablelength,hashvalue);
+        e = remove_from_bucket(h, h->table,
+                               lockFor(h->locks, h->num_locks, index),
+                               index, hashvalue, k);
+    }
+    retire = hashtable_migrate(h, MIGRATE_SEARCH_STEP);
     rwlock_rdunlock(&h->globallock);
+    if (retire) hashtable_retire(h);
 
-    // Use local write lock for removal
-    rwlock_wrlock(&h->locks[index]);
-    pE = &(h->table[index]);
-    e = *pE;
-    while (NULL != e)
-    {
-        /* Check hash value to short circuit heavier comparison */
-        if ((hashvalue == e->h) && (h->eqfn(k, e->k)))
-        {
-            *pE = e->next;
+    if (NULL == e) return NULL;
 
-            // Use write lock for entry count decrement
-            rwlock_wrlock(&h->entrycountlock);
-            h->entrycount--;
-            rwlock_wrunlock(&h->entrycountlock);
+    // Use write lock for entry count decrement
+    rwlock_wrlock(&h->entrycountlock);
+    h->entrycount--;
+    rwlock_wrunlock(&h->entrycountlock);
 
-            v = e->v;
-            freekey(e->k);
-            free(e);
+    v = e->v;
+    freekey(e->k);
+    free(e);
+    return v;
+}
 
-            rwlock_wrunlock(&h->locks[index]);
-            return v;
-        }
-        pE = &(e->next);
-        e = e->next;
+/*****************************************************************************/
+static void
+foreach_in_table(struct entry **table, unsigned int tablelength,
+                 void (*fn) (void*,void*,void*), void *arg)
+{
+    unsigned int i;
+    struct entry *e;
+    for (i = 0; i < tablelength; i++)
+    {
+        for (e = table[i]; NULL != e; e = e->next) fn(e->k, e->v, arg);
     }
-    rwlock_wrunlock(&h->locks[index]);
-
-    return NULL;
 }
 
-struct hashtable * global_index;
+void
+hashtable_foreach(struct hashtable *h, void (*fn) (void*,void*,void*), void *arg)
+{
+    // Searches migrate buckets under the global read lock, so take it for
+    // writing to keep entries from moving between tables mid-walk
+    rwlock_wrlock(&h->globallock);
+    if (NULL != h->oldtable)
+        foreach_in_table(h->oldtable, h->oldtablelength, fn, arg);
+    foreach_in_table(h->table, h->tablelength, fn, arg);
+    rwlock_wrunlock(&h->globallock);
+}
 
 /*****************************************************************************/
 /* destroy */
-void
-hashtable_destroy(struct hashtable *h, int free_values)
+static void
+destroy_table(struct entry **table, unsigned int tablelength, int free_values)
 {
     unsigned int i;
     struct entry *e, *f;
-    struct entry **table = h->table;
-    if (free_values)
+    for (i = 0; i < tablelength; i++)
     {
-        for (i = 0; i < h->tablelength; i++)
+        e = table[i];
+        while (NULL != e)
         {
-            e = table[i];
-            while (NULL != e)
-            { f = e; e = e->next; freekey(f->k); free(f->v); free(f); }
+            f = e; e = e->next; freekey(f->k);
+            if (free_values) free(f->v);
+            free(f);
         }
     }
-    else
-    {
-        for (i = 0; i < h->tablelength; i++)
-        {
-            e = table[i];
-            while (NULL != e)
-            { f = e; e = e->next; freekey(f->k); free(f); }
-        }
+    free(table);
+}
+
+void
+hashtable_destroy(struct hashtable *h, int free_values)
+{
+    if (NULL != h->oldtable) {
+        destroy_table(h->oldtable, h->oldtablelength, free_values);
+        destroy_locks(h->oldlocks, h->oldnum_locks);
     }
+    destroy_table(h->table, h->tablelength, free_values);
+    destroy_locks(h->locks, h->num_locks);
 
     // Destroy locks
     if (pthread_rwlock_destroy(&h->globallock)) {
@@ -623,96 +792,489 @@ hashtable_destroy(struct hashtable *h, int free_values)
     if (pthread_rwlock_destroy(&h->entrycountlock)) {
         perror("pthread_rwlock_destroy");
     }
-    for(int i = 0; i < h->tablelength; ++i) {
-        if (pthread_rwlock_destroy(&h->locks[i])) {
-            perror("pthread_rwlock_destroy");
-        }
-    }
-    free(h->locks);
-    free(h->table);
     free(h);
 }
 
+#else /* OPEN_ADDRESSING */
+
+/*****************************************************************************/
 /*
- * Copyright (c) 2002, Christopher Clark
- * All rights reserved.
- * 
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 
- * * Redistributions of source code must retain the above copyright
- * notice, this list of conditions and the following disclaimer.
- * 
- * * Redistributions in binary form must reproduce the above copyright
- * notice, this list of conditions and the following disclaimer in the
- * documentation and/or other materials provided with the distribution.
- * 
- * * Neither the name of the original author; nor the names of any contributors
- * may be used to endorse or promote products derived from this software
- * without specific prior written permission.
- * 
- * 
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
- * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
- * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
- * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER
- * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
- * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
- * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
- * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
- * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
-*/
+ * Open addressing engine, selected with -DOPEN_ADDRESSING (make
+ * HASHTABLE=open). Same interface as the chained table above, different
+ * layout: slots live in one flat array, split into groups of OA_GROUP, with
+ * a parallel array of control bytes. A control byte is OA_EMPTY, OA_DELETED
+ * or the low 7 bits of the key's hash, so a probe compares a whole group of
+ * control bytes at once (one SSE2 compare when available) and only touches
+ * a slot whose hash bits match. The full hash is kept in the slot as well.
+ *
+ * Keys are assumed to be NUL-terminated strings, which is true for every
+ * table in this program. Keys shorter than OA_INLINE_KEY are copied into the
+ * slot and the caller's copy is freed right away, so a probe never has to
+ * chase a pointer for them.
+ *
+ * Writers take globallock for writing and readers take it for reading.
+ * Growing is incremental like the chained table: the old table is kept
+ * around and each insert or remove moves OA_MIGRATE_STEP groups out of it.
+ * Searches look in the old table first and never migrate, since they only
+ * hold the lock for reading.
+ */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+#define OA_GROUP 16
+#define OA_EMPTY ((signed char) -128)
+#define OA_DELETED ((signed char) -2)
+#define OA_INLINE_KEY 16
+#define OA_MIGRATE_STEP 4
 
-/*
- * Copyright (c) 2002, Christopher Clark
- * All rights reserved.
- * 
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 
- * * Redistributions of source code must retain the above copyright
- * notice, this list of conditions and the following disclaimer.
- * 
- * * Redistributions in binary form must reproduce the above copyright
- * notice, this list of conditions and the following disclaimer in the
- * documentation and/or other materials provided with the distribution.
- * 
- * * Neither the name of the original author; nor the names of any contributors
- * may be used to endorse or promote products derived from this software
- * without specific prior written permission.
- * 
- * 
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
- * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
- * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
- * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER
- * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
- * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
- * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
- * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
- * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
- * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
- * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
-*/
+struct slot {
+    unsigned int h;
+    unsigned int inlined;
+    union {
+        char bytes[OA_INLINE_KEY];
+        void *ptr;
+    } k;
+    void *v;
+};
 
-struct list_head {
-	struct list_head *next, *prev;
+struct oatable {
+    signed char *ctrl;
+    struct slot *slots;
+    unsigned int numgroups;
+    unsigned int used;      /* full + deleted slots */
 };
-#define LIST_POISON1  ((void *) 0x00100100)
-#define LIST_POISON2  ((void *) 0x00200200)
 
-#define LIST_HEAD_INIT(name) { &(name), &(name) }
+struct hashtable {
+    struct oatable table;
+    struct oatable oldtable;  /* numgroups == 0 unless resizing */
+    unsigned int migrategroup;
+    unsigned int entrycount;
+    unsigned int (*hashfn) (void *k);
+    int (*eqfn) (void *k1, void *k2);
+    pthread_rwlock_t globallock;
+};
 
-#define LIST_HEAD(name) \
-	struct list_head name = LIST_HEAD_INIT(name)
+#define freekey(X) free(X)
 
-#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
-/**
+/*****************************************************************************/
+unsigned int
+hash(struct hashtable *h, void *k)
+{
+    /* Aim to protect against poor hash functions by adding logic here
+     * - logic taken from java 1.4 hashtable source */
+    unsigned int i = h->hashfn(k);
+    i += ~(i << 9);
+    i ^=  ((i >> 14) | (i << 18)); /* >>> */
+    i +=  (i << 4);
+    i ^=  ((i >> 10) | (i << 22)); /* >>> */
+    return i;
+}
+
+static inline signed char
+ctrlFor(unsigned int hashvalue) {
+    return (signed char) (hashvalue & 0x7f);
+}
+
+static inline void *
+slotKey(struct slot *s) {
+    return s->inlined ? (void *) s->k.bytes : s->k.ptr;
+}
+
+/* Bit i set if control byte i of the group equals c */
+static inline unsigned int
+groupMatch(const signed char *ctrl, signed char c) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+    unsigned int i, mask = 0;
+    for (i = 0; i < OA_GROUP; i++)
+        if (ctrl[i] == c) mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/* Bit i set if slot i of the group is empty or deleted */
+static inline unsigned int
+groupFree(const signed char *ctrl) {
+#ifdef __SSE2__
+    return (unsigned int) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else
+    unsigned int i, mask = 0;
+    for (i = 0; i < OA_GROUP; i++)
+        if (ctrl[i] < 0) mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/*****************************************************************************/
+static int
+oatable_init(struct oatable *t, unsigned int numgroups)
+{
+    t->ctrl = (signed char *) malloc(numgroups * OA_GROUP);
+    t->slots = (struct slot *) malloc(sizeof(struct slot) * numgroups * OA_GROUP);
+    if (NULL == t->ctrl || NULL == t->slots) {
+        free(t->ctrl);
+        free(t->slots);
+        return 0;
+    }
+    memset(t->ctrl, OA_EMPTY, numgroups * OA_GROUP);
+    t->numgroups = numgroups;
+    t->used = 0;
+    return -1;
+}
+
+static void
+oatable_free(struct oatable *t)
+{
+    free(t->ctrl);
+    free(t->slots);
+    memset(t, 0, sizeof(struct oatable));
+}
+
+/* Triangular probing over groups; visits every group as numgroups is 2^N */
+static struct slot *
+oatable_find(struct hashtable *h, struct oatable *t, unsigned int hashvalue,
+             void *k)
+{
+    unsigned int mask = t->numgroups - 1;
+    unsigned int g = (hashvalue >> 7) & mask;
+    unsigned int step = 0, match, i;
+    signed char c = ctrlFor(hashvalue);
+    struct slot *s;
+
+    if (0 == t->numgroups) return NULL;
+    for (;;) {
+        match = groupMatch(t->ctrl + g * OA_GROUP, c);
+        while (match) {
+            i = __builtin_ctz(match);
+            s = &t->slots[g * OA_GROUP + i];
+            if (s->h == hashvalue && h->eqfn(k, slotKey(s))) return s;
+            match &= match - 1;
+        }
+        if (groupMatch(t->ctrl + g * OA_GROUP, OA_EMPTY)) return NULL;
+        if (++step > mask) return NULL;
+        g = (g + step) & mask;
+    }
+}
+
+/* Claims a free slot for hashvalue; the table must not be full */
+static struct slot *
+oatable_claim(struct oatable *t, unsigned int hashvalue)
+{
+    unsigned int mask = t->numgroups - 1;
+    unsigned int g = (hashvalue >> 7) & mask;
+    unsigned int step = 0, free_slots, i;
+
+    for (;;) {
+        free_slots = groupFree(t->ctrl + g * OA_GROUP);
+        if (free_slots) {
+            i = g * OA_GROUP + __builtin_ctz(free_slots);
+            if (t->ctrl[i] == OA_EMPTY) t->used++;
+            t->ctrl[i] = ctrlFor(hashvalue);
+            t->slots[i].h = hashvalue;
+            return &t->slots[i];
+        }
+        g = (g + ++step) & mask;
+    }
+}
+
+static inline int
+oatable_full(struct oatable *t)
+{
+    /* Keep at most 7/8 of the slots in use, counting tombstones */
+    return (t->used + 1) * 8 > t->numgroups * OA_GROUP * 7;
+}
+
+/*****************************************************************************/
+/* Moves up to 'steps' groups out of the old table. Caller holds the write
+ * lock. */
+static void
+hashtable_migrate(struct hashtable *h, unsigned int steps)
+{
+    struct oatable *old = &h->oldtable;
+    struct slot *s, *d;
+    unsigned int i;
+
+    while (old->numgroups && steps--) {
+        for (i = h->migrategroup * OA_GROUP;
+             i < (h->migrategroup + 1) * OA_GROUP; i++) {
+            if (old->ctrl[i] < 0) continue;
+            s = &old->slots[i];
+            d = oatable_claim(&h->table, s->h);
+            d->inlined = s->inlined;
+            d->k = s->k;
+            d->v = s->v;
+            old->ctrl[i] = OA_DELETED;
+        }
+        if (++h->migrategroup == old->numgroups) {
+#ifdef DEBUG
+            printf("retiring old table of %d groups.\n", old->numgroups);
+#endif
+            oatable_free(old);
+        }
+    }
+}
+
+static int
+hashtable_expand(struct hashtable *h)
+{
+    struct oatable newtable;
+
+    /* Finish any resize still in flight before starting another one */
+    hashtable_migrate(h, h->oldtable.numgroups);
+    if (!oatable_init(&newtable, 2 * h->table.numgroups)) return 0;
+#ifdef DEBUG
+    printf("resizing table to %d groups.\n", newtable.numgroups);
+#endif
+    h->oldtable = h->table;
+    h->table = newtable;
+    h->migrategroup = 0;
+    return -1;
+}
+
+/*****************************************************************************/
+struct hashtable *
+create_hashtable(unsigned int minsize,
+                 unsigned int (*hashf) (void*),
+                 int (*eqf) (void*,void*))
+{
+    struct hashtable *h;
+    unsigned int numgroups = 1;
+
+    /* Check requested hashtable isn't too large */
+    if (minsize > (1u << 30)) return NULL;
+    while (numgroups * OA_GROUP * 7 < minsize * 8) numgroups <<= 1;
+
+    h = (struct hashtable *)calloc(1, sizeof(struct hashtable));
+    if (NULL == h) return NULL; /*oom*/
+    if (!oatable_init(&h->table, numgroups)) { free(h); return NULL; } /*oom*/
+    h->hashfn = hashf;
+    h->eqfn   = eqf;
+    if (pthread_rwlock_init(&h->globallock, NULL)) {
+        perror("pthread_rwlock_init");
+        return NULL;
+    }
+    return h;
+}
+
+/*****************************************************************************/
+unsigned int
+hashtable_count(struct hashtable *h)
+{
+    rwlock_rdlock(&h->globallock);
+    unsigned int cnt = h->entrycount;
+    rwlock_rdunlock(&h->globallock);
+    return cnt;
+}
+
+/*****************************************************************************/
+int
+hashtable_insert(struct hashtable *h, void *k, void *v)
+{
+    /* This method allows duplicate keys - but they shouldn't be used */
+    unsigned int hashvalue = hash(h,k);
+    size_t len = strlen((char *) k);
+    struct slot *s;
+
+    rwlock_wrlock(&h->globallock);
+    hashtable_migrate(h, OA_MIGRATE_STEP);
+    if (oatable_full(&h->table) && !hashtable_expand(h) &&
+        h->table.used == h->table.numgroups * OA_GROUP) {
+        rwlock_wrunlock(&h->globallock);
+        return 0; /*oom*/
+    }
+    s = oatable_claim(&h->table, hashvalue);
+    if (len < OA_INLINE_KEY) {
+        memcpy(s->k.bytes, k, len + 1);
+        s->inlined = 1;
+        freekey(k);
+    } else {
+        s->k.ptr = k;
+        s->inlined = 0;
+    }
+    s->v = v;
+    h->entrycount++;
+    rwlock_wrunlock(&h->globallock);
+    return -1;
+}
+
+/*****************************************************************************/
+void * /* returns value associated with key */
+hashtable_search(struct hashtable *h, void *k)
+{
+    unsigned int hashvalue = hash(h,k);
+    struct slot *s;
+    void *v = NULL;
+
+    rwlock_rdlock(&h->globallock);
+    s = oatable_find(h, &h->oldtable, hashvalue, k);
+    if (NULL == s) s = oatable_find(h, &h->table, hashvalue, k);
+    if (NULL != s) v = s->v;
+    rwlock_rdunlock(&h->globallock);
+    return v;
+}
+
+/*****************************************************************************/
+void * /* returns value */
+hashtable_remove(struct hashtable *h, void *k)
+{
+    unsigned int hashvalue = hash(h,k);
+    struct oatable *t = &h->oldtable;
+    struct slot *s;
+    void *v;
+
+    rwlock_wrlock(&h->globallock);
+    s = oatable_find(h, t, hashvalue, k);
+    if (NULL == s) {
+        t = &h->table;
+        s = oatable_find(h, t, hashvalue, k);
+    }
+    if (NULL == s) {
+        rwlock_wrunlock(&h->globallock);
+        return NULL;
+    }
+    t->ctrl[s - t->slots] = OA_DELETED;
+    h->entrycount--;
+    v = s->v;
+    if (!s->inlined) freekey(s->k.ptr);
+    hashtable_migrate(h, OA_MIGRATE_STEP);
+    rwlock_wrunlock(&h->globallock);
+    return v;
+}
+
+/*****************************************************************************/
+static void
+foreach_in_oatable(struct oatable *t, void (*fn) (void*,void*,void*), void *arg)
+{
+    unsigned int i;
+    for (i = 0; i < t->numgroups * OA_GROUP; i++) {
+        if (t->ctrl[i] < 0) continue;
+        fn(slotKey(&t->slots[i]), t->slots[i].v, arg);
+    }
+}
+
+void
+hashtable_foreach(struct hashtable *h, void (*fn) (void*,void*,void*), void *arg)
+{
+    rwlock_rdlock(&h->globallock);
+    foreach_in_oatable(&h->oldtable, fn, arg);
+    foreach_in_oatable(&h->table, fn, arg);
+    rwlock_rdunlock(&h->globallock);
+}
+
+/*****************************************************************************/
+/* destroy */
+static void
+destroy_oatable(struct oatable *t, int free_values)
+{
+    unsigned int i;
+    for (i = 0; i < t->numgroups * OA_GROUP; i++) {
+        if (t->ctrl[i] < 0) continue;
+        if (!t->slots[i].inlined) freekey(t->slots[i].k.ptr);
+        if (free_values) free(t->slots[i].v);
+    }
+    oatable_free(t);
+}
+
+void
+hashtable_destroy(struct hashtable *h, int free_values)
+{
+    destroy_oatable(&h->oldtable, free_values);
+    destroy_oatable(&h->table, free_values);
+    if (pthread_rwlock_destroy(&h->globallock)) {
+        perror("pthread_rwlock_destroy");
+    }
+    free(h);
+}
+
+#endif /* OPEN_ADDRESSING */
+
+struct hashtable * global_index;
+
+/*
+ * Copyright (c) 2002, Christopher Clark
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the original author; nor the names of any contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Copyright (c) 2002, Christopher Clark
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the original author; nor the names of any contributors
+ * may be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ * 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+#define LIST_POISON1  ((void *) 0x00100100)
+#define LIST_POISON2  ((void *) 0x00200200)
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+
+#define LIST_HEAD(name) \
+	struct list_head name = LIST_HEAD_INIT(name)
+
+#ifndef offsetof
+#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
+#endif
+/**
  * container_of - cast a member of a structure out to the containing structure
  * @ptr:	the pointer to the member.
  * @type:	the type of the container struct this is embedded in.
@@ -822,18 +1384,370 @@ static inline int list_empty(const struct list_head *head)
 
 
 
-#define MAX_LINES 124
+//
+// Line numbers for one (word, file) pair are stored as a growable stream of
+// delta-encoded varints: 7 bits per byte, high bit set on all but the last
+// byte of a value. Lines are appended in increasing order, so most deltas
+// fit in a single byte. Streams of up to POSTING_INLINE bytes live inside
+// the instance itself, which covers words that show up once or twice.
+//
+// In a positional index (see enable_index_positions) every line delta is
+// followed by a second varint for the word's position within the line: the
+// position itself on a new line, or the distance from the previous position
+// when the line delta is 0.
+//
+#define POSTING_INLINE sizeof(unsigned char *)
+#define POSTING_BLOCK INDEX_CURSOR_BLOCK
+
+static int index_positions;
 
 typedef struct index_instance_s {
-  struct list_head next;  
-  int line_numbers[MAX_LINES];
-  int next_free;
-  char file_name[MAXPATH+1];
+  int file_id;
+  int num_lines;
+  int last_line;
+  int last_position;
+  unsigned int used;
+  unsigned int size;
+  union {
+    unsigned char * ptr;
+    unsigned char bytes[POSTING_INLINE];
+  } lines;
 } index_instance_t;
 
-typedef struct index_element_s {
-  struct list_head instances;
-} index_element_t;
+static inline unsigned char * posting_bytes(index_instance_t * instance)
+{
+  return (instance->size > POSTING_INLINE) ? instance->lines.ptr
+                                           : instance->lines.bytes;
+}
+
+// Makes room for n more bytes at the end of the stream
+static int posting_reserve(index_instance_t * instance, unsigned int n)
+{
+  unsigned int new_size;
+  unsigned char * new_lines;
+
+  if (instance->size == 0) {
+    instance->size = POSTING_INLINE;
+  }
+  if (instance->used + n <= instance->size) {
+    return(0);
+  }
+  new_size = 2 * instance->size;
+  while (new_size < instance->used + n) {
+    new_size *= 2;
+  }
+  if (instance->size > POSTING_INLINE) {
+    new_lines = (unsigned char *) realloc(instance->lines.ptr, new_size);
+  } else {
+    new_lines = (unsigned char *) malloc(new_size);
+    if (new_lines != NULL) {
+      memcpy(new_lines, instance->lines.bytes, instance->used);
+    }
+  }
+  if (new_lines == NULL) {
+    return(-ENOMEM);
+  }
+  instance->lines.ptr = new_lines;
+  instance->size = new_size;
+  return(0);
+}
+
+static inline unsigned int put_varint(unsigned char * buf, unsigned int value)
+{
+  unsigned int n = 0;
+
+  while (value >= 0x80) {
+    buf[n++] = (unsigned char) (value | 0x80);
+    value >>= 7;
+  }
+  buf[n++] = (unsigned char) value;
+  return(n);
+}
+
+static inline unsigned int get_varint(const unsigned char ** p)
+{
+  unsigned int value = 0;
+  int shift = 0;
+
+  while (**p & 0x80) {
+    value |= (unsigned int) (*(*p)++ & 0x7f) << shift;
+    shift += 7;
+  }
+  value |= (unsigned int) *(*p)++ << shift;
+  return(value);
+}
+
+static int posting_append(index_instance_t * instance, int line_number,
+                          int position)
+{
+  unsigned char buf[10];
+  unsigned int delta = (unsigned int) (line_number - instance->last_line);
+  unsigned int n = put_varint(buf, delta);
+
+  if (index_positions) {
+    n += put_varint(buf + n, (unsigned int) (delta == 0 ? position - instance->last_position
+                                                        : position));
+    instance->last_position = position;
+  }
+
+  if (posting_reserve(instance, n)) {
+    return(-ENOMEM);
+  }
+  memcpy(posting_bytes(instance) + instance->used, buf, n);
+  instance->used += n;
+  instance->last_line = line_number;
+  instance->num_lines++;
+  return(0);
+}
+
+// Frees the stream, not the instance itself
+static void posting_release(index_instance_t * instance)
+{
+  if (instance->size > POSTING_INLINE) {
+    free(instance->lines.ptr);
+  }
+  instance->size = 0;
+  instance->used = 0;
+}
+
+//
+// Sequential decoder over one instance. Values come out a block at a time:
+// the varints are first unpacked into raw deltas, then turned back into line
+// numbers with a prefix sum. When a block is all single-byte deltas (the
+// usual case for common words) the unpack is a plain widening copy, and both
+// loops are simple enough for the compiler to vectorize. Positional streams
+// are decoded in one sequential pass into out and positions.
+//
+static void posting_reader_init(posting_reader_t * reader,
+                                index_instance_t * instance)
+{
+  reader->pos = posting_bytes(instance);
+  reader->end = reader->pos + instance->used;
+  reader->remaining = instance->num_lines;
+  reader->last_line = 0;
+  reader->last_position = 0;
+}
+
+static int posting_decode_block(posting_reader_t * reader, int * out,
+                                int * positions)
+{
+  const unsigned char * p = reader->pos;
+  int n = reader->remaining < POSTING_BLOCK ? reader->remaining : POSTING_BLOCK;
+  int i;
+
+  if (n == 0) {
+    return(0);
+  }
+
+  if (index_positions) {
+    int line = reader->last_line, position = reader->last_position;
+    for (i = 0; i < n; i++) {
+      unsigned int delta = get_varint(&p);
+      unsigned int value = get_varint(&p);
+      line += delta;
+      position = (delta == 0) ? position + (int) value : (int) value;
+      out[i] = line;
+      positions[i] = position;
+    }
+    reader->last_position = position;
+    reader->last_line = line;
+    reader->pos = p;
+    reader->remaining -= n;
+    return(n);
+  }
+
+  if (reader->end - p >= n) {
+    unsigned char high = 0;
+    for (i = 0; i < n; i++) {
+      high |= p[i];
+    }
+    if (!(high & 0x80)) {
+      for (i = 0; i < n; i++) {
+        out[i] = p[i];
+      }
+      p += n;
+      goto PrefixSum;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    out[i] = (int) get_varint(&p);
+  }
+
+ PrefixSum:
+  out[0] += reader->last_line;
+  for (i = 1; i < n; i++) {
+    out[i] += out[i - 1];
+  }
+  reader->last_line = out[n - 1];
+  reader->pos = p;
+  reader->remaining -= n;
+  return(n);
+}
+
+//
+// Appends the lines of src, shifted down by line_offset, to dst and releases
+// src. When src starts at or after the last line (and position) of dst, the
+// usual case, only the first entry has to be re-encoded and the rest of the
+// stream is copied as is; otherwise both streams are decoded and merged.
+//
+static int posting_concat(index_instance_t * dst, index_instance_t * src, int line_offset)
+{
+  posting_reader_t reader;
+  int lines[POSTING_BLOCK], positions[POSTING_BLOCK];
+  int n, i, error = 0;
+  const unsigned char * rest;
+
+  if (src->num_lines == 0) {
+    posting_release(src);
+    return(0);
+  }
+  if (dst->num_lines == 0 && line_offset == 0) {
+    posting_release(dst);
+    src->file_id = dst->file_id;
+    *dst = *src;
+    src->size = 0;
+    return(0);
+  }
+
+  posting_reader_init(&reader, src);
+  rest = reader.pos;
+  get_varint(&rest);
+  if (index_positions) {
+    get_varint(&rest);
+  }
+  posting_decode_block(&reader, lines, positions);
+  lines[0] += line_offset;
+
+  if (lines[0] > dst->last_line ||
+      (lines[0] == dst->last_line &&
+       (!index_positions || positions[0] >= dst->last_position))) {
+    unsigned int tail = src->used - (rest - posting_bytes(src));
+    if (posting_append(dst, lines[0], positions[0]) || posting_reserve(dst, tail)) {
+      error = -ENOMEM;
+    } else {
+      memcpy(posting_bytes(dst) + dst->used, rest, tail);
+      dst->used += tail;
+      dst->num_lines += src->num_lines - 1;
+      dst->last_line = src->last_line + line_offset;
+      dst->last_position = src->last_position;
+    }
+  } else {
+    index_instance_t merged;
+    int total = 0, a, b, num_dst;
+    int * all = (int *) malloc(2 * sizeof(int) * (dst->num_lines + src->num_lines));
+    int * all_positions = all + dst->num_lines + src->num_lines;
+
+    if (all == NULL) {
+      posting_release(src);
+      return(-ENOMEM);
+    }
+    posting_reader_init(&reader, dst);
+    while ((n = posting_decode_block(&reader, all + total, all_positions + total)) > 0) {
+      total += n;
+    }
+    num_dst = total;
+    posting_reader_init(&reader, src);
+    while ((n = posting_decode_block(&reader, all + total, all_positions + total)) > 0) {
+      for (i = 0; i < n; i++) {
+        all[total + i] += line_offset;
+      }
+      total += n;
+    }
+
+    memset(&merged, 0, sizeof(merged));
+    merged.file_id = dst->file_id;
+    for (a = 0, b = num_dst, i = 0; i < total && !error; i++) {
+      if (b == total || (a < num_dst && (all[a] < all[b] ||
+                                         (all[a] == all[b] &&
+                                          (!index_positions ||
+                                           all_positions[a] <= all_positions[b]))))) {
+        error = posting_append(&merged, all[a], all_positions[a]);
+        a++;
+      } else {
+        error = posting_append(&merged, all[b], all_positions[b]);
+        b++;
+      }
+    }
+    free(all);
+    if (error) {
+      posting_release(&merged);
+    } else {
+      posting_release(dst);
+      *dst = merged;
+    }
+  }
+  posting_release(src);
+  return(error);
+}
+
+//
+// A word's postings: one instance per file, sorted by file id so a single
+// file can be found by binary search and files can be merged in order.
+// Files are mostly merged in id order, so inserts are usually appends.
+//
+typedef struct index_element_s {
+  index_instance_t * instances;
+  int num_instances;
+  int max_instances;
+  int max_lines;
+} index_element_t;
+
+typedef struct index_file_s {
+  int id;
+  int stamped;
+  int removed;
+  int measured;
+  int64_t length;
+  int64_t staged_length;  // words merged so far from pieces of a split file
+  char * name;
+  file_stamp_t stamp;
+} index_file_t;
+
+//
+// Every path handed to the index is interned here exactly once. The hash
+// table maps a path to its entry, the files array maps an id back to it.
+// When a file has to be indexed again its path moves to a fresh id (see
+// replace_file), and the old id stays behind marked as removed so that its
+// postings are skipped until they are dropped by the next save_index.
+//
+// Every file that has been merged into the index also has its length in
+// words, which the registry sums up over the live files for ranking.
+//
+typedef struct file_registry_s {
+  struct hashtable * names;
+  index_file_t ** files;
+  int num_files;
+  int max_files;
+  int num_removed;
+  int num_documents;
+  int64_t total_length;
+  int64_t min_length;
+  pthread_rwlock_t lock;
+} file_registry_t;
+
+file_registry_t file_registry;
+
+//
+// Guards the instance arrays hanging off global_index. Indexer threads take it
+// as writers once per merge batch (see merge_into_index), searches take it as
+// readers while they walk a word's instances.
+//
+pthread_rwlock_t index_lock;
+
+//
+// Generations let callers tell whether a result they computed earlier is
+// still current. Every word hashes to one of GENERATION_STRIPES counters,
+// bumped (under index_lock) whenever postings are added for a word of that
+// stripe; file_generation is bumped whenever a file is replaced or removed,
+// which changes what every word's postings mean. index_generation moves on
+// with any change at all.
+//
+#define GENERATION_STRIPES 4096
+
+uint64_t term_generations[GENERATION_STRIPES];
+uint64_t file_generation;
+uint64_t index_generation;
 
 
 
@@ -859,117 +1773,2336 @@ int init_index()
  global_index = create_hashtable(1024, hash_from_key_fn, keys_equal_fn);
  if (global_index == NULL) {
    return(-1);
- } else {
-   return(0);
  }
+ file_registry.names = create_hashtable(1024, hash_from_key_fn, keys_equal_fn);
+ if (file_registry.names == NULL) {
+   return(-1);
+ }
+ if (pthread_rwlock_init(&file_registry.lock, NULL)) {
+   perror("pthread_rwlock_init");
+   return(-1);
+ }
+ if (pthread_rwlock_init(&index_lock, NULL)) {
+   perror("pthread_rwlock_init");
+   return(-1);
+ }
+ return(0);
 }
 
-int insert_into_index(char * word, char * file_name, int line_number)
+//
+// Switches the index to positional postings, which also record where on its
+// line each word was found (needed for phrase queries). Only allowed before
+// anything is in the index. Returns 0 or -EBUSY.
+//
+int enable_index_positions()
 {
-  index_element_t * old_value;
-  index_element_t * new_value = NULL;
-  char * new_word = NULL;
-  index_instance_t * instance = NULL;
   int error = 0;
-  int ret;
 
-  old_value = (index_element_t *) hashtable_search(global_index, word);
-  if (old_value == NULL) {
-    //
-    // Copy the word
-    //
+  rwlock_rdlock(&file_registry.lock);
+  if (file_registry.num_files > 0) {
+    error = -EBUSY;
+  } else {
+    index_positions = 1;
+  }
+  rwlock_rdunlock(&file_registry.lock);
+  return(error);
+}
 
-    new_word = strdup(word);
-    if (new_word == NULL) {
-      error = -ENOMEM;
-      goto Cleanup;
+int index_has_positions()
+{
+  return(index_positions);
+}
+
+// Makes room for one more file id. Caller holds the registry lock.
+static int registry_reserve()
+{
+  if (file_registry.num_files == file_registry.max_files) {
+    int new_max = file_registry.max_files ? 2 * file_registry.max_files : 1024;
+    index_file_t ** new_files = (index_file_t **)
+      realloc(file_registry.files, new_max * sizeof(index_file_t *));
+    if (new_files == NULL) {
+      return(-ENOMEM);
     }
+    file_registry.files = new_files;
+    file_registry.max_files = new_max;
+  }
+  return(0);
+}
 
-    new_value = (index_element_t *) calloc(sizeof(index_element_t), 1);
-    if (new_value == NULL) {
-      error = -ENOMEM;
-      goto Cleanup;
+int register_file(char * file_name)
+{
+  index_file_t * file;
+  char * key = NULL;
+  int error = 0;
+
+  file = (index_file_t *) hashtable_search(file_registry.names, file_name);
+  if (file != NULL) {
+    return(file->id);
+  }
+
+  rwlock_wrlock(&file_registry.lock);
+
+  //
+  // Somebody may have registered the same path while we waited for the lock
+  //
+  file = (index_file_t *) hashtable_search(file_registry.names, file_name);
+  if (file != NULL) {
+    rwlock_wrunlock(&file_registry.lock);
+    return(file->id);
+  }
+
+  if (registry_reserve()) {
+    error = -ENOMEM;
+    goto Cleanup;
+  }
+
+  file = (index_file_t *) calloc(sizeof(index_file_t), 1);
+  key = strdup(file_name);
+  if (file == NULL || key == NULL || (file->name = strdup(file_name)) == NULL) {
+    error = -ENOMEM;
+    goto Cleanup;
+  }
+  file->id = file_registry.num_files;
+  if (!hashtable_insert(file_registry.names, key, file)) {
+    error = -ENOMEM;
+    goto Cleanup;
+  }
+  file_registry.files[file_registry.num_files++] = file;
+
+ Cleanup:
+  rwlock_wrunlock(&file_registry.lock);
+  if (error < 0) {
+    if (file != NULL) {
+      free(file->name);
+      free(file);
     }
-    INIT_LIST_HEAD(&new_value->instances);
+    free(key);
+    return(error);
+  }
+  return(file->id);
+}
 
-    //
-    // Create a new instance in and put it in the value list
-    //
+int find_file(char * file_name)
+{
+  index_file_t * file;
+  file = (index_file_t *) hashtable_search(file_registry.names, file_name);
+  return (file != NULL) ? file->id : -1;
+}
 
-    instance = (index_instance_t *) calloc(sizeof(index_instance_t), 1);
-    strncpy(instance->file_name, file_name, MAXPATH);
-    instance->line_numbers[instance->next_free++] = line_number;
-    list_add(&instance->next, &new_value->instances);
-    ret = hashtable_insert(global_index, new_word, new_value);
-    if (!ret) {
-      error = -ENOMEM;
-      goto Cleanup;
+const char * get_file_name(int file_id)
+{
+  const char * name = NULL;
+  rwlock_rdlock(&file_registry.lock);
+  if (file_id >= 0 && file_id < file_registry.num_files) {
+    name = file_registry.files[file_id]->name;
+  }
+  rwlock_rdunlock(&file_registry.lock);
+  return(name);
+}
+
+//
+// Records what the file looked like when it was indexed under file_id, so a
+// later run can tell whether it has to be indexed again.
+//
+int set_file_stamp(int file_id, const file_stamp_t * stamp)
+{
+  int error = -EINVAL;
+  rwlock_wrlock(&file_registry.lock);
+  if (file_id >= 0 && file_id < file_registry.num_files &&
+      !file_registry.files[file_id]->removed) {
+    file_registry.files[file_id]->stamp = *stamp;
+    file_registry.files[file_id]->stamped = 1;
+    error = 0;
+  }
+  rwlock_wrunlock(&file_registry.lock);
+  return(error);
+}
+
+// Returns 0 and fills in stamp if file_id has been indexed, -1 if not
+int get_file_stamp(int file_id, file_stamp_t * stamp)
+{
+  int error = -1;
+  rwlock_rdlock(&file_registry.lock);
+  if (file_id >= 0 && file_id < file_registry.num_files &&
+      file_registry.files[file_id]->stamped) {
+    *stamp = file_registry.files[file_id]->stamp;
+    error = 0;
+  }
+  rwlock_rdunlock(&file_registry.lock);
+  return(error);
+}
+
+// Takes a file out of the collection statistics. Caller holds the registry lock.
+static void forget_file_length(index_file_t * file)
+{
+  if (file->measured) {
+    file_registry.num_documents--;
+    file_registry.total_length -= file->length;
+    file->measured = 0;
+    file->length = 0;
+  }
+}
+
+// Records how many words were indexed for file_id
+static void set_file_length(int file_id, int64_t length)
+{
+  index_file_t * file;
+
+  rwlock_wrlock(&file_registry.lock);
+  file = file_registry.files[file_id];
+  if (!file->removed) {
+    forget_file_length(file);
+    file->measured = 1;
+    file->length = length;
+    file_registry.num_documents++;
+    file_registry.total_length += length;
+    if (length > 0 && (file_registry.min_length == 0 || length < file_registry.min_length)) {
+      file_registry.min_length = length;
     }
-  } else {
-    struct list_head * elem;
-    index_instance_t * old_instance;
-
-    //
-    // We have the word in the index. Look for a matching filename
-    //
-    list_for_each(elem, &old_value->instances) {
-      old_instance = list_entry(elem, index_instance_t, next);
-      if ((strcmp(old_instance->file_name, file_name) == 0) &&
-	  (old_instance->next_free != MAX_LINES)) {
-	old_instance->line_numbers[old_instance->next_free++] = line_number;
-	goto Cleanup;
-      }
+  }
+  rwlock_wrunlock(&file_registry.lock);
+}
+
+// Length in words of an indexed file, or -1 if it is not known
+int64_t get_file_length(int file_id)
+{
+  int64_t length = -1;
+  rwlock_rdlock(&file_registry.lock);
+  if (file_id >= 0 && file_id < file_registry.num_files &&
+      file_registry.files[file_id]->measured) {
+    length = file_registry.files[file_id]->length;
+  }
+  rwlock_rdunlock(&file_registry.lock);
+  return(length);
+}
+
+//
+// Number of indexed files, their average length, and a lower bound on the
+// length of any file with words in it (it does not go back up when the
+// shortest file is removed).
+//
+void get_index_stats(index_stats_t * stats)
+{
+  rwlock_rdlock(&file_registry.lock);
+  stats->num_documents = file_registry.num_documents;
+  stats->average_length = file_registry.num_documents ?
+    (double) file_registry.total_length / file_registry.num_documents : 0;
+  stats->min_length = file_registry.min_length;
+  rwlock_rdunlock(&file_registry.lock);
+}
+
+// Changes whenever the postings of word may have changed
+uint64_t get_term_generation(const char * word)
+{
+  uint64_t generation;
+
+  rwlock_rdlock(&index_lock);
+  generation = term_generations[hash_from_key_fn((void *) word) % GENERATION_STRIPES];
+  rwlock_rdunlock(&index_lock);
+  return generation + __sync_add_and_fetch(&file_generation, 0);
+}
+
+// Changes whenever anything in the index does
+uint64_t get_index_generation()
+{
+  return __sync_add_and_fetch(&index_generation, 0);
+}
+
+//
+// Moves the path of file_id to a new, unstamped id and returns it. The old
+// id is marked removed, which hides whatever postings it already has. If the
+// path has already moved on, its current id is returned instead.
+//
+int replace_file(int file_id)
+{
+  index_file_t * file, * old;
+  int new_id;
+
+  rwlock_wrlock(&file_registry.lock);
+  if (file_id < 0 || file_id >= file_registry.num_files) {
+    rwlock_wrunlock(&file_registry.lock);
+    return(-EINVAL);
+  }
+  if (file_registry.files[file_id]->removed) {
+    file = (index_file_t *) hashtable_search(file_registry.names,
+                                             file_registry.files[file_id]->name);
+    rwlock_wrunlock(&file_registry.lock);
+    return (file != NULL) ? file->id : -EINVAL;
+  }
+
+  file = file_registry.files[file_id];
+  old = (index_file_t *) calloc(sizeof(index_file_t), 1);
+  if (old == NULL || registry_reserve() || (old->name = strdup(file->name)) == NULL) {
+    rwlock_wrunlock(&file_registry.lock);
+    free(old);
+    return(-ENOMEM);
+  }
+  old->id = file_id;
+  old->removed = 1;
+  file_registry.num_removed++;
+  __sync_add_and_fetch(&file_generation, 1);
+  __sync_add_and_fetch(&index_generation, 1);
+  file_registry.files[file_id] = old;
+
+  new_id = file_registry.num_files++;
+  forget_file_length(file);
+  file->id = new_id;
+  file->stamped = 0;
+  file_registry.files[new_id] = file;
+  rwlock_wrunlock(&file_registry.lock);
+  return(new_id);
+}
+
+// Hides the postings of a file that is gone for good
+void remove_file(int file_id)
+{
+  rwlock_wrlock(&file_registry.lock);
+  if (file_id >= 0 && file_id < file_registry.num_files) {
+    forget_file_length(file_registry.files[file_id]);
+    if (!file_registry.files[file_id]->removed) {
+      file_registry.num_removed++;
+      __sync_add_and_fetch(&file_generation, 1);
+      __sync_add_and_fetch(&index_generation, 1);
     }
-    //
-    // Allocate a new instance
-    //
-    instance = (index_instance_t *) calloc(sizeof(index_instance_t), 1);
-    strncpy(instance->file_name, file_name, MAXPATH);
-    instance->line_numbers[instance->next_free++] = line_number;
-    list_add(&instance->next, &old_value->instances);
+    file_registry.files[file_id]->removed = 1;
+    file_registry.files[file_id]->stamped = 0;
+  }
+  rwlock_wrunlock(&file_registry.lock);
+}
+
+static int file_removed(int file_id)
+{
+  int removed;
+  rwlock_rdlock(&file_registry.lock);
+  removed = file_registry.files[file_id]->removed;
+  rwlock_rdunlock(&file_registry.lock);
+  return(removed);
+}
+
+//
+// Returns the element for word, creating it if this is the first time the
+// word is seen. Caller must hold index_lock for writing.
+//
+static index_element_t * get_or_create_element(char * word)
+{
+  index_element_t * element;
+  char * new_word;
+
+  element = (index_element_t *) hashtable_search(global_index, word);
+  if (element != NULL) {
+    return(element);
+  }
+
+  new_word = strdup(word);
+  element = (index_element_t *) calloc(sizeof(index_element_t), 1);
+  if (new_word == NULL || element == NULL) {
+    goto Cleanup;
+  }
+  if (!hashtable_insert(global_index, new_word, element)) {
+    goto Cleanup;
   }
+  return(element);
+
  Cleanup:
-  if (error < 0) {
-    if (new_word != NULL) 
-      free(new_word);
-    if (instance != NULL)
-      free(instance);
-    if (new_value != NULL)
-      free(new_value);
+  free(new_word);
+  free(element);
+  return(NULL);
+}
+
+//
+// Binary search for file_id in the element's instances. Returns its position,
+// or the position it would have to be inserted at as -(pos + 1).
+//
+static int find_instance(index_element_t * element, int file_id)
+{
+  int lo = 0, hi = element->num_instances;
+
+  // Fast path: most lookups are for the newest file
+  if (hi > 0 && element->instances[hi - 1].file_id < file_id) {
+    return(-(hi + 1));
   }
-  return(error);
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (element->instances[mid].file_id < file_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < element->num_instances && element->instances[lo].file_id == file_id) {
+    return(lo);
+  }
+  return(-(lo + 1));
 }
-  
-index_search_results_t * find_in_index(char * word)
+
+//
+// Returns the instance for file_id, adding an empty one in sorted position if
+// the word has not been seen in that file yet. Caller holds index_lock for
+// writing.
+//
+static index_instance_t * get_or_create_instance(index_element_t * element,
+                                                 int file_id)
+{
+  index_instance_t * instance;
+  int pos = find_instance(element, file_id);
+
+  if (pos >= 0) {
+    return(&element->instances[pos]);
+  }
+  pos = -(pos + 1);
+
+  if (element->num_instances == element->max_instances) {
+    int new_max = element->max_instances ? 2 * element->max_instances : 1;
+    index_instance_t * new_instances = (index_instance_t *)
+      realloc(element->instances, new_max * sizeof(index_instance_t));
+    if (new_instances == NULL) {
+      return(NULL);
+    }
+    element->instances = new_instances;
+    element->max_instances = new_max;
+  }
+  instance = &element->instances[pos];
+  memmove(instance + 1, instance,
+          (element->num_instances - pos) * sizeof(index_instance_t));
+  element->num_instances++;
+  memset(instance, 0, sizeof(index_instance_t));
+  instance->file_id = file_id;
+  return(instance);
+}
+
+int insert_into_index(char * word, int file_id, int line_number)
 {
-  index_search_results_t * results = NULL;
-  int num_results = 0;
   index_element_t * element;
-  element = hashtable_search(global_index, word);
+  index_instance_t * instance;
+  int error = -ENOMEM;
+
+  rwlock_wrlock(&index_lock);
+  element = get_or_create_element(word);
+  term_generations[hash_from_key_fn(word) % GENERATION_STRIPES]++;
   if (element != NULL) {
-    struct list_head * next;
-    int i;
-    index_instance_t * instance;
-    list_for_each(next, &element->instances) {
-      instance = list_entry(next, index_instance_t, next);
-      for (i = 0; i < instance->next_free; i++) {
-	num_results++;
+    instance = get_or_create_instance(element, file_id);
+    if (instance != NULL) {
+      error = posting_append(instance, line_number, 0);
+      if (instance->num_lines > element->max_lines) {
+        element->max_lines = instance->num_lines;
       }
     }
+  }
+  rwlock_wrunlock(&index_lock);
+  __sync_add_and_fetch(&index_generation, 1);
+  return(error);
+}
 
-    results = (index_search_results_t *) calloc(sizeof(index_search_results_t) +
-						(num_results - 1) * sizeof(index_search_elem_t), 1);
-    if (results != NULL) {
+//
+// Staging index: a private word -> instance map that one indexer thread fills
+// for the file it is working on. Nothing in here is shared, so no locks are
+// taken until merge_into_index publishes the whole thing at once.
+//
+#define STAGING_MIN_BUCKETS 256
+#define MERGE_BATCH 4096
 
-      list_for_each(next, &element->instances) {
-	instance = list_entry(next, index_instance_t, next);
-	for (i = 0; i < instance->next_free; i++) {
-	  strcpy(results->results[results->num_results].file_name, instance->file_name);
-	  results->results[results->num_results].line_number = instance->line_numbers[i];
-	  results->num_results++;
-	}
-      }
-    }   
+typedef struct staging_entry_s {
+  struct staging_entry_s * next;
+  unsigned int hash;
+  index_instance_t instance;
+  char word[1];
+} staging_entry_t;
+
+struct index_staging_s {
+  staging_entry_t ** buckets;
+  unsigned int num_buckets;
+  unsigned int num_entries;
+  int64_t num_tokens;
+};
+
+static int staging_alloc_buckets(index_staging_t * staging, unsigned int num_buckets)
+{
+  staging->buckets = (staging_entry_t **) calloc(num_buckets, sizeof(staging_entry_t *));
+  if (staging->buckets == NULL) {
+    return(-ENOMEM);
   }
-  return(results);
+  staging->num_buckets = num_buckets;
+  return(0);
+}
+
+index_staging_t * create_staging_index()
+{
+  index_staging_t * staging;
+
+  staging = (index_staging_t *) calloc(sizeof(index_staging_t), 1);
+  if (staging == NULL) {
+    return(NULL);
+  }
+  if (staging_alloc_buckets(staging, STAGING_MIN_BUCKETS)) {
+    free(staging);
+    return(NULL);
+  }
+  return(staging);
+}
+
+static void staging_grow(index_staging_t * staging)
+{
+  staging_entry_t ** old_buckets = staging->buckets;
+  unsigned int old_num_buckets = staging->num_buckets;
+  staging_entry_t * entry;
+  unsigned int i;
+
+  // Keep going with the old table if we can't get a bigger one
+  if (staging_alloc_buckets(staging, 2 * old_num_buckets)) {
+    staging->buckets = old_buckets;
+    staging->num_buckets = old_num_buckets;
+    return;
+  }
+  for (i = 0; i < old_num_buckets; i++) {
+    while ((entry = old_buckets[i]) != NULL) {
+      old_buckets[i] = entry->next;
+      entry->next = staging->buckets[entry->hash & (staging->num_buckets - 1)];
+      staging->buckets[entry->hash & (staging->num_buckets - 1)] = entry;
+    }
+  }
+  free(old_buckets);
+}
+
+int insert_into_staging(index_staging_t * staging, const char * word,
+                        int length, int line_number, int position)
+{
+  staging_entry_t * entry;
+  staging_entry_t ** bucket;
+  unsigned int hash = 5381;
+  int i, error;
+
+  for (i = 0; i < length; i++) {
+    hash = ((hash << 5) + hash) + (unsigned char) word[i];
+  }
+  staging->num_tokens++;
+
+  bucket = &staging->buckets[hash & (staging->num_buckets - 1)];
+  for (entry = *bucket; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && !memcmp(entry->word, word, length) &&
+        entry->word[length] == '\0') {
+      return posting_append(&entry->instance, line_number, position);
+    }
+  }
+
+  entry = (staging_entry_t *) malloc(sizeof(staging_entry_t) + length);
+  if (entry == NULL) {
+    return(-ENOMEM);
+  }
+  memset(&entry->instance, 0, sizeof(index_instance_t));
+  memcpy(entry->word, word, length);
+  entry->word[length] = '\0';
+  entry->hash = hash;
+  error = posting_append(&entry->instance, line_number, position);
+  if (error) {
+    posting_release(&entry->instance);
+    free(entry);
+    return(error);
+  }
+  entry->next = *bucket;
+  *bucket = entry;
+
+  if (++staging->num_entries > staging->num_buckets) {
+    staging_grow(staging);
+  }
+  return(0);
+}
+
+//
+// Publish everything staged for file_id into the global index and leave the
+// staging index empty for the next file. The global lock is taken once per
+// MERGE_BATCH words rather than once per token, so searches still get a
+// chance to run while a file with a huge vocabulary is merged.
+//
+static int merge_staging(index_staging_t * staging, int file_id, int line_offset)
+{
+  staging_entry_t * entry;
+  index_element_t * element;
+  index_instance_t * instance;
+  unsigned int i;
+  int batch = 0;
+  int error = 0;
+
+  for (i = 0; i < staging->num_buckets; i++) {
+    while ((entry = staging->buckets[i]) != NULL) {
+      staging->buckets[i] = entry->next;
+
+      if (batch == 0) {
+        rwlock_wrlock(&index_lock);
+      }
+      element = get_or_create_element(entry->word);
+      instance = (element != NULL) ? get_or_create_instance(element, file_id) : NULL;
+      term_generations[hash_from_key_fn(entry->word) % GENERATION_STRIPES]++;
+      if (instance != NULL) {
+        if (posting_concat(instance, &entry->instance, line_offset)) {
+          error = -ENOMEM;
+        }
+        if (instance->num_lines > element->max_lines) {
+          element->max_lines = instance->num_lines;
+        }
+      } else {
+        posting_release(&entry->instance);
+        error = -ENOMEM;
+      }
+      if (++batch == MERGE_BATCH) {
+        rwlock_wrunlock(&index_lock);
+        batch = 0;
+      }
+
+      free(entry);
+    }
+  }
+  if (batch != 0) {
+    rwlock_wrunlock(&index_lock);
+  }
+  staging->num_entries = 0;
+  return(error);
+}
+
+int merge_into_index(index_staging_t * staging, int file_id)
+{
+  int error = merge_staging(staging, file_id, 0);
+
+  set_file_length(file_id, staging->num_tokens);
+  __sync_add_and_fetch(&index_generation, 1);
+  staging->num_tokens = 0;
+  return(error);
+}
+
+//
+// Same for one of the newline-aligned pieces a big file was split into, so
+// that several indexers can work on it. Pieces have to be merged in file
+// order: line_offset is the number of lines before the piece, and the
+// length of the file is only recorded with its last piece.
+//
+int merge_chunk_into_index(index_staging_t * staging, int file_id, int line_offset,
+                           int last)
+{
+  int error = merge_staging(staging, file_id, line_offset);
+  index_file_t * file;
+  int64_t length;
+
+  rwlock_wrlock(&file_registry.lock);
+  file = file_registry.files[file_id];
+  file->staged_length += staging->num_tokens;
+  length = file->staged_length;
+  if (last) {
+    file->staged_length = 0;
+  }
+  rwlock_wrunlock(&file_registry.lock);
+  if (last) {
+    set_file_length(file_id, length);
+  }
+  __sync_add_and_fetch(&index_generation, 1);
+  staging->num_tokens = 0;
+  return(error);
+}
+
+// Drops everything staged without publishing any of it, for a file that
+// could not be read to the end
+void clear_staging_index(index_staging_t * staging)
+{
+  staging_entry_t * entry;
+  unsigned int i;
+
+  for (i = 0; i < staging->num_buckets; i++) {
+    while ((entry = staging->buckets[i]) != NULL) {
+      staging->buckets[i] = entry->next;
+      posting_release(&entry->instance);
+      free(entry);
+    }
+  }
+  staging->num_entries = 0;
+  staging->num_tokens = 0;
+}
+
+void destroy_staging_index(index_staging_t * staging)
+{
+  clear_staging_index(staging);
+  free(staging->buckets);
+  free(staging);
+}
+
+//
+// Snapshot of the whole index on disk (save_index/load_index). The file is
+// laid out so that it can be mapped and queried in place:
+//
+//   header | files | file names | term buckets | terms | postings
+//
+// Each file entry holds the offset of its name, the stamp it was indexed
+// with and its length in words. Term buckets are an open-addressed table
+// (linear probing, power of two size) of offsets to term records, hashed
+// with hash_from_key_fn. A term record lists the word's instances sorted by
+// file id, each pointing at its delta-varint stream in the postings area,
+// which is stored exactly as it is kept in memory, along with the most
+// postings it has in any one file. Everything before the postings is the
+// dictionary.
+//
+// Loading checks the dictionary checksum and the bounds of every record, but
+// never reads the postings, so their pages are faulted in by the queries that
+// need them. The postings have their own checksum for offline checks.
+//
+// A loaded snapshot stays mapped underneath the in-memory index: cursors
+// merge a word's mapped instances with its in-memory ones by file id, and
+// skip files that have been removed or replaced since the snapshot was made.
+//
+#define SNAPSHOT_MAGIC "SE537IDX"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_POSITIONS 0x1
+#define SNAPSHOT_ALIGN(n) (((n) + 7) & ~(uint64_t) 7)
+
+typedef struct snapshot_header_s {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_files;
+  uint32_t num_words;
+  uint32_t num_buckets;
+  uint32_t flags;
+  uint32_t pad;
+  uint64_t file_size;
+  uint64_t files_offset;
+  uint64_t buckets_offset;
+  uint64_t postings_offset;
+  uint64_t dictionary_checksum;
+  uint64_t postings_checksum;
+} snapshot_header_t;
+
+typedef struct snapshot_file_s {
+  uint64_t name;
+  uint32_t stamped;
+  uint32_t pad;
+  uint64_t size;
+  int64_t mtime;
+  uint64_t inode;
+  uint64_t hash;
+  int64_t length;
+} snapshot_file_t;
+
+typedef struct snapshot_instance_s {
+  int32_t file_id;
+  int32_t num_lines;
+  int32_t last_line;
+  uint32_t used;
+  uint64_t offset;
+} snapshot_instance_t;
+
+// Followed by num_instances instances and the NUL-terminated word
+typedef struct snapshot_term_s {
+  uint32_t hash;
+  uint32_t length;
+  uint32_t num_instances;
+  uint32_t max_lines;
+} snapshot_term_t;
+
+typedef struct snapshot_s {
+  const unsigned char * base;
+  size_t size;
+  const snapshot_header_t * header;
+  const uint64_t * buckets;
+} snapshot_t;
+
+snapshot_t snapshot;
+
+static inline const snapshot_instance_t * snapshot_instances(const snapshot_term_t * term)
+{
+  return (const snapshot_instance_t *) (term + 1);
+}
+
+static inline const char * snapshot_word(const snapshot_term_t * term)
+{
+  return (const char *) (snapshot_instances(term) + term->num_instances);
+}
+
+static inline uint64_t snapshot_term_size(uint32_t length, uint32_t num_instances)
+{
+  return SNAPSHOT_ALIGN(sizeof(snapshot_term_t) +
+                        num_instances * sizeof(snapshot_instance_t) + length + 1);
+}
+
+static inline const unsigned char * snapshot_postings(const snapshot_instance_t * instance)
+{
+  return snapshot.base + snapshot.header->postings_offset + instance->offset;
+}
+
+// 64-bit FNV-1a
+static uint64_t snapshot_checksum(uint64_t checksum, const void * buf, size_t n)
+{
+  const unsigned char * p = (const unsigned char *) buf;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    checksum = (checksum ^ p[i]) * 1099511628211ULL;
+  }
+  return(checksum);
+}
+#define SNAPSHOT_CHECKSUM_INIT 14695981039346656037ULL
+
+static const snapshot_term_t * snapshot_find_term(const char * word)
+{
+  uint32_t hash = hash_from_key_fn((void *) word);
+  uint32_t mask = snapshot.header->num_buckets - 1;
+  uint32_t i;
+
+  for (i = hash & mask; snapshot.buckets[i] != 0; i = (i + 1) & mask) {
+    const snapshot_term_t * term =
+      (const snapshot_term_t *) (snapshot.base + snapshot.buckets[i]);
+    if (term->hash == hash && !strcmp(snapshot_word(term), word)) {
+      return(term);
+    }
+  }
+  return(NULL);
+}
+
+static int find_snapshot_instance(const snapshot_term_t * term, int file_id)
+{
+  const snapshot_instance_t * instances = snapshot_instances(term);
+  int lo = 0, hi = term->num_instances;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (instances[mid].file_id < file_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < (int) term->num_instances && instances[lo].file_id == file_id) {
+    return(lo);
+  }
+  return(-1);
+}
+
+static void snapshot_reader_init(posting_reader_t * reader,
+                                 const snapshot_instance_t * instance)
+{
+  reader->pos = snapshot_postings(instance);
+  reader->end = reader->pos + instance->used;
+  reader->remaining = instance->num_lines;
+  reader->last_line = 0;
+  reader->last_position = 0;
+}
+
+//
+// One word as it will be written: its mapped term, its in-memory element, or
+// both. Instances of both are merged by file id, renumbered through new_ids
+// and dropped if their file was removed (new_ids[file_id] < 0).
+//
+typedef struct snapshot_entry_s {
+  const char * word;
+  const snapshot_term_t * term;
+  index_element_t * element;
+  uint32_t hash;
+  uint32_t num_instances;
+  uint32_t max_lines;
+} snapshot_entry_t;
+
+typedef struct snapshot_merge_s {
+  const snapshot_entry_t * entry;
+  const int * new_ids;
+  uint32_t mapped;
+  int instance;
+} snapshot_merge_t;
+
+static void snapshot_merge_init(snapshot_merge_t * merge, const snapshot_entry_t * entry,
+                                const int * new_ids)
+{
+  merge->entry = entry;
+  merge->new_ids = new_ids;
+  merge->mapped = 0;
+  merge->instance = 0;
+}
+
+static int snapshot_merge_next(snapshot_merge_t * merge, snapshot_instance_t * out,
+                               const unsigned char ** bytes)
+{
+  const snapshot_term_t * term = merge->entry->term;
+  index_element_t * element = merge->entry->element;
+
+  for (;;) {
+    const snapshot_instance_t * mapped = NULL;
+    index_instance_t * instance = NULL;
+
+    if (term != NULL && merge->mapped < term->num_instances) {
+      mapped = &snapshot_instances(term)[merge->mapped];
+    }
+    if (element != NULL && merge->instance < element->num_instances) {
+      instance = &element->instances[merge->instance];
+    }
+    if (mapped != NULL && (instance == NULL || mapped->file_id <= instance->file_id)) {
+      merge->mapped++;
+      *out = *mapped;
+      *bytes = snapshot_postings(mapped);
+    } else if (instance != NULL) {
+      merge->instance++;
+      out->file_id = instance->file_id;
+      out->num_lines = instance->num_lines;
+      out->last_line = instance->last_line;
+      out->used = instance->used;
+      *bytes = posting_bytes(instance);
+    } else {
+      return(0);
+    }
+    if (merge->new_ids[out->file_id] >= 0) {
+      out->file_id = merge->new_ids[out->file_id];
+      return(1);
+    }
+  }
+}
+
+typedef struct snapshot_writer_s {
+  FILE * out;
+  snapshot_entry_t * entries;
+  uint32_t num_entries;
+  uint32_t max_entries;
+  uint64_t checksum;
+  int error;
+} snapshot_writer_t;
+
+static void add_snapshot_entry(snapshot_writer_t * writer, const char * word,
+                               const snapshot_term_t * term, index_element_t * element)
+{
+  snapshot_entry_t * entry;
+
+  if (writer->num_entries == writer->max_entries) {
+    uint32_t new_max = writer->max_entries ? 2 * writer->max_entries : 1024;
+    snapshot_entry_t * new_entries = (snapshot_entry_t *)
+      realloc(writer->entries, new_max * sizeof(snapshot_entry_t));
+    if (new_entries == NULL) {
+      writer->error = -ENOMEM;
+      return;
+    }
+    writer->entries = new_entries;
+    writer->max_entries = new_max;
+  }
+  entry = &writer->entries[writer->num_entries++];
+  entry->word = word;
+  entry->term = term;
+  entry->element = element;
+  entry->hash = hash_from_key_fn((void *) word);
+  entry->num_instances = 0;
+  entry->max_lines = 0;
+}
+
+static void collect_snapshot_entry(void * k, void * v, void * arg)
+{
+  const snapshot_term_t * term = NULL;
+  if (snapshot.header != NULL) {
+    term = snapshot_find_term((const char *) k);
+  }
+  add_snapshot_entry((snapshot_writer_t *) arg, (const char *) k, term,
+                     (index_element_t *) v);
+}
+
+static void snapshot_write(snapshot_writer_t * writer, const void * buf, size_t n)
+{
+  static const unsigned char zeros[8];
+
+  if (buf == NULL) {
+    buf = zeros;
+  }
+  writer->checksum = snapshot_checksum(writer->checksum, buf, n);
+  if (writer->error == 0 && fwrite(buf, 1, n, writer->out) != n) {
+    writer->error = -errno;
+  }
+}
+
+//
+// Writes the index and the file registry to path, including whatever is
+// still used from a loaded snapshot. Removed files are left out and the rest
+// are renumbered densely. The snapshot is written next to path under a
+// temporary name and renamed into place, so an existing snapshot (even the
+// one currently loaded) is never left half written. Returns 0 or a negative
+// errno.
+//
+int save_index(const char * path)
+{
+  snapshot_writer_t writer;
+  snapshot_header_t header;
+  snapshot_merge_t merge;
+  snapshot_instance_t instance;
+  const unsigned char * bytes;
+  uint64_t * buckets = NULL;
+  int * new_ids = NULL;
+  char * tmp_path = NULL;
+  uint64_t offset, postings;
+  uint32_t i, j, mask, live;
+  int num_files;
+
+  memset(&writer, 0, sizeof(writer));
+  memset(&header, 0, sizeof(header));
+  tmp_path = (char *) malloc(strlen(path) + 5);
+  if (tmp_path == NULL) {
+    return(-ENOMEM);
+  }
+  sprintf(tmp_path, "%s.tmp", path);
+
+  // Postings must not change underneath us, the registry only ever grows
+  rwlock_rdlock(&index_lock);
+  rwlock_rdlock(&file_registry.lock);
+  num_files = file_registry.num_files;
+
+  new_ids = (int *) malloc((num_files + 1) * sizeof(int));
+  if (new_ids == NULL) {
+    writer.error = -ENOMEM;
+    goto Cleanup;
+  }
+  for (i = 0, live = 0; i < (uint32_t) num_files; i++) {
+    new_ids[i] = file_registry.files[i]->removed ? -1 : (int) live++;
+  }
+
+  // Every word in memory, then the words only the loaded snapshot has
+  hashtable_foreach(global_index, collect_snapshot_entry, &writer);
+  if (snapshot.header != NULL) {
+    for (i = 0; i < snapshot.header->num_buckets && writer.error == 0; i++) {
+      const snapshot_term_t * term;
+      if (snapshot.buckets[i] == 0) {
+        continue;
+      }
+      term = (const snapshot_term_t *) (snapshot.base + snapshot.buckets[i]);
+      if (hashtable_search(global_index, (void *) snapshot_word(term)) == NULL) {
+        add_snapshot_entry(&writer, snapshot_word(term), term, NULL);
+      }
+    }
+  }
+  if (writer.error) {
+    goto Cleanup;
+  }
+
+  // Words left without a single live instance are not written at all
+  for (i = 0, j = 0; i < writer.num_entries; i++) {
+    snapshot_merge_init(&merge, &writer.entries[i], new_ids);
+    while (snapshot_merge_next(&merge, &instance, &bytes)) {
+      writer.entries[i].num_instances++;
+      if ((uint32_t) instance.num_lines > writer.entries[i].max_lines) {
+        writer.entries[i].max_lines = instance.num_lines;
+      }
+    }
+    if (writer.entries[i].num_instances > 0) {
+      writer.entries[j++] = writer.entries[i];
+    }
+  }
+  writer.num_entries = j;
+
+  header.num_buckets = 1;
+  while (header.num_buckets < 2 * writer.num_entries) {
+    header.num_buckets <<= 1;
+  }
+  buckets = (uint64_t *) calloc(header.num_buckets, sizeof(uint64_t));
+  if (buckets == NULL) {
+    writer.error = -ENOMEM;
+    goto Cleanup;
+  }
+
+  // Lay out the dictionary so every offset is known before writing it
+  offset = sizeof(snapshot_header_t);
+  header.files_offset = offset;
+  offset += live * sizeof(snapshot_file_t);
+  for (i = 0; i < (uint32_t) num_files; i++) {
+    if (new_ids[i] >= 0) {
+      offset += strlen(file_registry.files[i]->name) + 1;
+    }
+  }
+  header.buckets_offset = offset = SNAPSHOT_ALIGN(offset);
+  offset += header.num_buckets * sizeof(uint64_t);
+
+  mask = header.num_buckets - 1;
+  for (i = 0; i < writer.num_entries; i++) {
+    for (j = writer.entries[i].hash & mask; buckets[j] != 0; j = (j + 1) & mask) {
+    }
+    buckets[j] = offset;
+    offset += snapshot_term_size(strlen(writer.entries[i].word),
+                                 writer.entries[i].num_instances);
+  }
+  header.postings_offset = offset;
+
+  writer.out = fopen(tmp_path, "w");
+  if (writer.out == NULL) {
+    writer.error = -errno;
+    goto Cleanup;
+  }
+
+  // Header goes in last, once the checksums are known
+  snapshot_write(&writer, &header, sizeof(header));
+  writer.checksum = SNAPSHOT_CHECKSUM_INIT;
+
+  offset = header.files_offset + live * sizeof(snapshot_file_t);
+  for (i = 0; i < (uint32_t) num_files; i++) {
+    index_file_t * file = file_registry.files[i];
+    snapshot_file_t entry;
+
+    if (new_ids[i] < 0) {
+      continue;
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.name = offset;
+    entry.length = file->measured ? file->length : -1;
+    if (file->stamped) {
+      entry.stamped = 1;
+      entry.size = file->stamp.size;
+      entry.mtime = file->stamp.mtime;
+      entry.inode = file->stamp.inode;
+      entry.hash = file->stamp.hash;
+    }
+    snapshot_write(&writer, &entry, sizeof(entry));
+    offset += strlen(file->name) + 1;
+  }
+  for (i = 0; i < (uint32_t) num_files; i++) {
+    if (new_ids[i] >= 0) {
+      const char * name = file_registry.files[i]->name;
+      snapshot_write(&writer, name, strlen(name) + 1);
+    }
+  }
+  snapshot_write(&writer, NULL, header.buckets_offset - offset);
+  snapshot_write(&writer, buckets, header.num_buckets * sizeof(uint64_t));
+
+  postings = 0;
+  for (i = 0; i < writer.num_entries; i++) {
+    snapshot_term_t term;
+    uint64_t size;
+
+    term.hash = writer.entries[i].hash;
+    term.length = strlen(writer.entries[i].word);
+    term.num_instances = writer.entries[i].num_instances;
+    term.max_lines = writer.entries[i].max_lines;
+    snapshot_write(&writer, &term, sizeof(term));
+    snapshot_merge_init(&merge, &writer.entries[i], new_ids);
+    while (snapshot_merge_next(&merge, &instance, &bytes)) {
+      instance.offset = postings;
+      postings += instance.used;
+      snapshot_write(&writer, &instance, sizeof(instance));
+    }
+    snapshot_write(&writer, writer.entries[i].word, term.length + 1);
+    size = snapshot_term_size(term.length, term.num_instances);
+    snapshot_write(&writer, NULL, size - (sizeof(term) + term.num_instances *
+                                          sizeof(snapshot_instance_t) + term.length + 1));
+  }
+  header.dictionary_checksum = writer.checksum;
+
+  writer.checksum = SNAPSHOT_CHECKSUM_INIT;
+  for (i = 0; i < writer.num_entries; i++) {
+    snapshot_merge_init(&merge, &writer.entries[i], new_ids);
+    while (snapshot_merge_next(&merge, &instance, &bytes)) {
+      snapshot_write(&writer, bytes, instance.used);
+    }
+  }
+  header.postings_checksum = writer.checksum;
+
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.num_files = live;
+  header.num_words = writer.num_entries;
+  header.flags = index_positions ? SNAPSHOT_POSITIONS : 0;
+  header.file_size = header.postings_offset + postings;
+  if (writer.error == 0 &&
+      (fseek(writer.out, 0, SEEK_SET) ||
+       fwrite(&header, sizeof(header), 1, writer.out) != 1 ||
+       fflush(writer.out) || fsync(fileno(writer.out)))) {
+    writer.error = -errno;
+  }
+
+ Cleanup:
+  rwlock_rdunlock(&file_registry.lock);
+  rwlock_rdunlock(&index_lock);
+  if (writer.out != NULL && fclose(writer.out) && writer.error == 0) {
+    writer.error = -errno;
+  }
+  if (writer.error == 0 && rename(tmp_path, path)) {
+    writer.error = -errno;
+  }
+  if (writer.error != 0 && writer.out != NULL) {
+    unlink(tmp_path);
+  }
+  free(writer.entries);
+  free(buckets);
+  free(new_ids);
+  free(tmp_path);
+  return(writer.error);
+}
+
+// Checks that every offset in the (already checksummed) dictionary stays
+// inside the mapping, so queries never have to
+static int snapshot_validate(const snapshot_header_t * header, size_t size)
+{
+  const snapshot_file_t * files;
+  uint64_t postings_size = size - header->postings_offset;
+  uint64_t names_offset = header->files_offset + header->num_files * sizeof(snapshot_file_t);
+  uint32_t i, j;
+
+  files = (const snapshot_file_t *) (snapshot.base + header->files_offset);
+  for (i = 0; i < header->num_files; i++) {
+    if (files[i].name < names_offset || files[i].name >= header->buckets_offset ||
+        memchr(snapshot.base + files[i].name, '\0',
+               header->buckets_offset - files[i].name) == NULL) {
+      return(-1);
+    }
+  }
+  for (i = 0; i < header->num_buckets; i++) {
+    const snapshot_term_t * term;
+    const snapshot_instance_t * instances;
+    uint64_t offset = snapshot.buckets[i];
+
+    if (offset == 0) {
+      continue;
+    }
+    if (offset < header->buckets_offset || offset % 8 ||
+        offset + sizeof(snapshot_term_t) > header->postings_offset) {
+      return(-1);
+    }
+    term = (const snapshot_term_t *) (snapshot.base + offset);
+    if (offset + snapshot_term_size(term->length, term->num_instances) >
+        header->postings_offset || snapshot_word(term)[term->length] != '\0') {
+      return(-1);
+    }
+    instances = snapshot_instances(term);
+    for (j = 0; j < term->num_instances; j++) {
+      if (instances[j].offset > postings_size ||
+          instances[j].used > postings_size - instances[j].offset ||
+          instances[j].num_lines < 0 || instances[j].num_lines > (int64_t) instances[j].used ||
+          (j > 0 && instances[j].file_id <= instances[j - 1].file_id) ||
+          instances[j].file_id < 0 || instances[j].file_id >= (int32_t) header->num_files) {
+        return(-1);
+      }
+    }
+  }
+  return(0);
+}
+
+//
+// Maps a snapshot written by save_index and registers its files, in order,
+// so their ids match the ones in the postings, along with the stamps they
+// were indexed with. Must be called on a freshly initialized index, before
+// any file is registered. Returns the number of files in the snapshot, a
+// negative errno, or -EINVAL if the file is not a valid snapshot.
+//
+int load_index(const char * path)
+{
+  const snapshot_header_t * header;
+  const snapshot_file_t * files;
+  struct stat st;
+  void * base;
+  uint32_t i;
+  int fd, error = -EINVAL;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return(-errno);
+  }
+  if (fstat(fd, &st)) {
+    error = -errno;
+    close(fd);
+    return(error);
+  }
+  if (st.st_size < (off_t) sizeof(snapshot_header_t)) {
+    close(fd);
+    return(-EINVAL);
+  }
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return(-errno);
+  }
+  // Queries jump straight to the postings they need, don't read ahead
+  madvise(base, st.st_size, MADV_RANDOM);
+
+  snapshot.base = (const unsigned char *) base;
+  snapshot.size = st.st_size;
+  header = (const snapshot_header_t *) base;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+      header->version != SNAPSHOT_VERSION || header->file_size != (uint64_t) st.st_size ||
+      header->num_buckets == 0 || (header->num_buckets & (header->num_buckets - 1)) ||
+      header->files_offset != sizeof(snapshot_header_t) ||
+      header->buckets_offset < header->files_offset + header->num_files * sizeof(snapshot_file_t) ||
+      header->buckets_offset % 8 ||
+      header->postings_offset < header->buckets_offset + header->num_buckets * sizeof(uint64_t) ||
+      header->postings_offset > header->file_size ||
+      (header->flags & ~SNAPSHOT_POSITIONS)) {
+    goto Cleanup;
+  }
+  if (snapshot_checksum(SNAPSHOT_CHECKSUM_INIT, snapshot.base + header->files_offset,
+                        header->postings_offset - header->files_offset) !=
+      header->dictionary_checksum) {
+    goto Cleanup;
+  }
+  snapshot.buckets = (const uint64_t *) (snapshot.base + header->buckets_offset);
+  if (snapshot_validate(header, snapshot.size)) {
+    goto Cleanup;
+  }
+
+  files = (const snapshot_file_t *) (snapshot.base + header->files_offset);
+  for (i = 0; i < header->num_files; i++) {
+    int file_id = register_file((char *) snapshot.base + files[i].name);
+    if (file_id != (int) i) {
+      error = (file_id < 0) ? file_id : -EINVAL;
+      goto Cleanup;
+    }
+    if (files[i].stamped) {
+      file_stamp_t stamp;
+      stamp.size = files[i].size;
+      stamp.mtime = files[i].mtime;
+      stamp.inode = files[i].inode;
+      stamp.hash = files[i].hash;
+      set_file_stamp(file_id, &stamp);
+    }
+    if (files[i].length >= 0) {
+      set_file_length(file_id, files[i].length);
+    }
+  }
+  // Postings are decoded the way they were written
+  index_positions = (header->flags & SNAPSHOT_POSITIONS) != 0;
+  snapshot.header = header;
+  __sync_add_and_fetch(&index_generation, 1);
+  return(header->num_files);
+
+ Cleanup:
+  munmap(base, st.st_size);
+  memset(&snapshot, 0, sizeof(snapshot));
+  return(error);
+}
+
+//
+// Positions the cursor before the first instance of word. Returns 0 if the
+// word is in the index, -1 if not.
+//
+int open_index_cursor(index_cursor_t * cursor, char * word)
+{
+  index_element_t * element;
+  const snapshot_term_t * term = NULL;
+
+  rwlock_rdlock(&index_lock);
+  memset(cursor, 0, offsetof(index_cursor_t, lines));
+  element = (index_element_t *) hashtable_search(global_index, word);
+  if (snapshot.header != NULL) {
+    term = snapshot_find_term(word);
+  }
+  if (element != NULL && element->num_instances > 0) {
+    cursor->element = element;
+    cursor->end = element->num_instances;
+  }
+  if (term != NULL && term->num_instances > 0) {
+    cursor->term = term;
+    cursor->term_end = term->num_instances;
+  }
+  if (cursor->element == NULL && cursor->term == NULL) {
+    return(-1);
+  }
+  return(0);
+}
+
+//
+// Like open_index_cursor, but only visits the postings of one file. Costs a
+// binary search over the word's files, then only the hits in that file.
+//
+int open_index_file_cursor(index_cursor_t * cursor, char * word, int file_id)
+{
+  int pos;
+
+  if (open_index_cursor(cursor, word) < 0) {
+    return(-1);
+  }
+  pos = -1;
+  if (cursor->term != NULL) {
+    pos = find_snapshot_instance((const snapshot_term_t *) cursor->term, file_id);
+  }
+  cursor->term_instance = (pos < 0) ? cursor->term_end : pos;
+  cursor->term_end = (pos < 0) ? cursor->term_end : pos + 1;
+  pos = -1;
+  if (cursor->element != NULL) {
+    pos = find_instance((index_element_t *) cursor->element, file_id);
+  }
+  cursor->instance = (pos < 0) ? cursor->end : pos;
+  cursor->end = (pos < 0) ? cursor->end : pos + 1;
+  if (cursor->term_instance == cursor->term_end && cursor->instance == cursor->end) {
+    cursor->element = NULL;
+    cursor->term = NULL;
+    return(-1);
+  }
+  return(0);
+}
+
+//
+// Moves the cursor to the next file that has not been removed, taking the
+// mapped and in-memory instances in file id order. Returns 0 when both are
+// exhausted.
+//
+static int index_cursor_advance(index_cursor_t * cursor)
+{
+  const snapshot_term_t * term = (const snapshot_term_t *) cursor->term;
+  index_element_t * element = (index_element_t *) cursor->element;
+
+  for (;;) {
+    const snapshot_instance_t * mapped = NULL;
+    index_instance_t * instance = NULL;
+
+    if (cursor->term_instance < cursor->term_end) {
+      mapped = &snapshot_instances(term)[cursor->term_instance];
+    }
+    if (cursor->instance < cursor->end) {
+      instance = &element->instances[cursor->instance];
+    }
+    if (mapped != NULL && (instance == NULL || mapped->file_id <= instance->file_id)) {
+      cursor->term_instance++;
+      cursor->file_id = mapped->file_id;
+      snapshot_reader_init(&cursor->reader, mapped);
+    } else if (instance != NULL) {
+      cursor->instance++;
+      cursor->file_id = instance->file_id;
+      posting_reader_init(&cursor->reader, instance);
+    } else {
+      return(0);
+    }
+    if (!file_removed(cursor->file_id)) {
+      return(1);
+    }
+  }
+}
+
+//
+// Produces the next (file id, line number) pair. Returns 1 if one was
+// produced, 0 at the end of the postings.
+//
+int index_cursor_next(index_cursor_t * cursor, int * file_id, int * line_number)
+{
+  if (cursor->element == NULL && cursor->term == NULL) {
+    return(0);
+  }
+  while (cursor->next == cursor->count) {
+    cursor->next = 0;
+    cursor->count = posting_decode_block(&cursor->reader, cursor->lines,
+                                         cursor->positions);
+    if (cursor->count > 0) {
+      break;
+    }
+    // Current instance exhausted, move on to the next file
+    if (!index_cursor_advance(cursor)) {
+      cursor->element = NULL;
+      cursor->term = NULL;
+      return(0);
+    }
+  }
+  *file_id = cursor->file_id;
+  *line_number = cursor->lines[cursor->next++];
+  return(1);
+}
+
+// Position within its line of the posting last produced, or -1 if the index
+// does not record positions
+int index_cursor_position(index_cursor_t * cursor)
+{
+  if (!index_positions || cursor->next == 0) {
+    return(-1);
+  }
+  return(cursor->positions[cursor->next - 1]);
+}
+
+//
+// First position in [lo, hi) of an instance array whose file id is at least
+// file_id, found by galloping forward from lo and then bisecting. Both kinds
+// of instance keep their file id as the first member, so one search serves
+// the mapped and the in-memory arrays.
+//
+static int gallop_file_id(const void * base, size_t stride, int lo, int hi,
+                          int file_id)
+{
+#define FILE_ID_AT(i) (*(const int *) ((const char *) base + (size_t) (i) * stride))
+  int step = 1, mid;
+
+  while (lo < hi && FILE_ID_AT(lo) < file_id) {
+    if (lo + step >= hi || FILE_ID_AT(lo + step) >= file_id) {
+      hi = (lo + step < hi) ? lo + step : hi;
+      lo++;
+      while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (FILE_ID_AT(mid) < file_id) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      break;
+    }
+    lo += step;
+    step *= 2;
+  }
+  return(lo);
+#undef FILE_ID_AT
+}
+
+//
+// Skips forward to the first posting at or after (file_id, line_number) and
+// produces it like index_cursor_next does. Files before file_id are skipped
+// without decoding anything, and within a file whole decoded blocks are
+// skipped by their last line. Returns 1 if a posting was produced, 0 at the
+// end of the postings.
+//
+int index_cursor_seek(index_cursor_t * cursor, int file_id, int line_number,
+                      int * found_file_id, int * found_line_number)
+{
+  int lo, hi, mid;
+
+  if (cursor->element == NULL && cursor->term == NULL) {
+    return(0);
+  }
+  if (cursor->file_id < file_id) {
+    if (cursor->term != NULL) {
+      cursor->term_instance =
+        gallop_file_id(snapshot_instances((const snapshot_term_t *) cursor->term),
+                       sizeof(snapshot_instance_t), cursor->term_instance,
+                       cursor->term_end, file_id);
+    }
+    if (cursor->element != NULL) {
+      cursor->instance =
+        gallop_file_id(((index_element_t *) cursor->element)->instances,
+                       sizeof(index_instance_t), cursor->instance,
+                       cursor->end, file_id);
+    }
+    cursor->reader.remaining = 0;
+    cursor->next = cursor->count = 0;
+  }
+
+  for (;;) {
+    if (cursor->next < cursor->count && cursor->file_id == file_id) {
+      if (cursor->lines[cursor->count - 1] < line_number) {
+        cursor->next = cursor->count;
+      } else {
+        lo = cursor->next;
+        hi = cursor->count - 1;
+        while (lo < hi) {
+          mid = lo + (hi - lo) / 2;
+          if (cursor->lines[mid] < line_number) {
+            lo = mid + 1;
+          } else {
+            hi = mid;
+          }
+        }
+        cursor->next = lo;
+      }
+    }
+    if (!index_cursor_next(cursor, found_file_id, found_line_number)) {
+      return(0);
+    }
+    if (*found_file_id > file_id ||
+        (*found_file_id == file_id && *found_line_number >= line_number)) {
+      return(1);
+    }
+  }
+}
+
+//
+// Upper bound on the postings (or, with files set, on the files) the cursor
+// has left to visit, from the instance headers alone. Used to order terms
+// so that the rarest one drives an intersection.
+//
+int index_cursor_cost(index_cursor_t * cursor, int files)
+{
+  int cost = 0, i;
+
+  if (files) {
+    return (cursor->term != NULL ? cursor->term_end - cursor->term_instance : 0) +
+           (cursor->element != NULL ? cursor->end - cursor->instance : 0);
+  }
+  if (cursor->term != NULL) {
+    const snapshot_instance_t * instances =
+      snapshot_instances((const snapshot_term_t *) cursor->term);
+    for (i = cursor->term_instance; i < cursor->term_end; i++) {
+      cost += files ? 1 : instances[i].num_lines;
+    }
+  }
+  if (cursor->element != NULL) {
+    index_instance_t * instances = ((index_element_t *) cursor->element)->instances;
+    for (i = cursor->instance; i < cursor->end; i++) {
+      cost += files ? 1 : instances[i].num_lines;
+    }
+  }
+  return(cost);
+}
+
+// Number of files the word is in, not counting removed ones
+int index_cursor_num_files(index_cursor_t * cursor)
+{
+  int num_files = index_cursor_cost(cursor, 1), i;
+
+  rwlock_rdlock(&file_registry.lock);
+  if (file_registry.num_removed > 0) {
+    if (cursor->term != NULL) {
+      const snapshot_instance_t * instances =
+        snapshot_instances((const snapshot_term_t *) cursor->term);
+      for (i = cursor->term_instance; i < cursor->term_end; i++) {
+        num_files -= file_registry.files[instances[i].file_id]->removed;
+      }
+    }
+    if (cursor->element != NULL) {
+      index_instance_t * instances = ((index_element_t *) cursor->element)->instances;
+      for (i = cursor->instance; i < cursor->end; i++) {
+        num_files -= file_registry.files[instances[i].file_id]->removed;
+      }
+    }
+  }
+  rwlock_rdunlock(&file_registry.lock);
+  return(num_files);
+}
+
+// Most postings the word has in any one file
+int index_cursor_max_count(index_cursor_t * cursor)
+{
+  int max_count = 0;
+
+  if (cursor->term != NULL) {
+    max_count = ((const snapshot_term_t *) cursor->term)->max_lines;
+  }
+  if (cursor->element != NULL &&
+      ((index_element_t *) cursor->element)->max_lines > max_count) {
+    max_count = ((index_element_t *) cursor->element)->max_lines;
+  }
+  return(max_count);
+}
+
+//
+// Skips to the first file at or after file_id that the cursor has not
+// visited yet, and reports how many postings the word has there without
+// decoding any of them. index_cursor_next then produces that file's
+// postings. Returns 1 if there is such a file, 0 if not.
+//
+int index_cursor_next_file(index_cursor_t * cursor, int file_id, int * found_file_id,
+                           int * count)
+{
+  if (cursor->element == NULL && cursor->term == NULL) {
+    return(0);
+  }
+  if (cursor->term != NULL) {
+    cursor->term_instance =
+      gallop_file_id(snapshot_instances((const snapshot_term_t *) cursor->term),
+                     sizeof(snapshot_instance_t), cursor->term_instance,
+                     cursor->term_end, file_id);
+  }
+  if (cursor->element != NULL) {
+    cursor->instance =
+      gallop_file_id(((index_element_t *) cursor->element)->instances,
+                     sizeof(index_instance_t), cursor->instance, cursor->end, file_id);
+  }
+  cursor->next = cursor->count = 0;
+  if (!index_cursor_advance(cursor)) {
+    cursor->element = NULL;
+    cursor->term = NULL;
+    cursor->reader.remaining = 0;
+    return(0);
+  }
+  *found_file_id = cursor->file_id;
+  *count = cursor->reader.remaining;
+  return(1);
+}
+
+void close_index_cursor(index_cursor_t * cursor)
+{
+  cursor->element = NULL;
+  cursor->term = NULL;
+  rwlock_rdunlock(&index_lock);
+}
+
+index_search_results_t * find_in_index(char * word)
+{
+  index_search_results_t * results = NULL;
+  index_cursor_t cursor;
+  int num_results = 0;
+  int file_id, line_number, i;
+
+  if (open_index_cursor(&cursor, word) == 0) {
+    // Upper bound, lines of removed files are counted but never produced
+    if (cursor.term != NULL) {
+      const snapshot_term_t * term = (const snapshot_term_t *) cursor.term;
+      for (i = 0; i < (int) term->num_instances; i++) {
+        num_results += snapshot_instances(term)[i].num_lines;
+      }
+    }
+    if (cursor.element != NULL) {
+      index_element_t * element = (index_element_t *) cursor.element;
+      for (i = 0; i < element->num_instances; i++) {
+        num_results += element->instances[i].num_lines;
+      }
+    }
+
+    results = (index_search_results_t *) calloc(sizeof(index_search_results_t) +
+						(num_results - 1) * sizeof(index_search_elem_t), 1);
+    if (results != NULL) {
+      while (index_cursor_next(&cursor, &file_id, &line_number)) {
+	results->results[results->num_results].file_id = file_id;
+	results->results[results->num_results].line_number = line_number;
+	results->num_results++;
+      }
+    }
+  }
+  close_index_cursor(&cursor);
+  return(results);
+}
+
+//
+// Sorted term dictionary, for lookups the hash table cannot answer: every
+// word with a given prefix, in a range, or matching a wildcard pattern. It
+// is built once indexing is over (see build_term_dictionary) and does not
+// see words added after that.
+//
+// Words are stored sorted and front coded in blocks of TERM_BLOCK: the first
+// word of a block is stored whole, every other one as the length of the
+// prefix it shares with the word before it plus the rest of it. A lookup
+// bisects the block heads and decodes forward from there, so its cost is a
+// few string compares plus the number of words it walks over.
+//
+// Alongside it sits a trigram index for approximate lookups: for every
+// trigram of every word, padded with TRIGRAM_PAD on both sides, the sorted
+// list of the words (by their number in dictionary order) that contain it.
+// Words are also grouped by length, for queries too short for trigrams to
+// narrow anything down.
+//
+#define TERM_BLOCK 16
+#define TRIGRAM_PAD '$'
+
+typedef struct trigram_index_s {
+  uint32_t * grams;
+  uint32_t * starts;
+  uint32_t * terms;
+  int num_grams;
+  uint32_t * by_length;
+  uint32_t * length_starts;
+} trigram_index_t;
+
+typedef struct term_dictionary_s {
+  unsigned char * data;
+  size_t * blocks;
+  int num_blocks;
+  int num_terms;
+  int max_length;
+  trigram_index_t trigrams;
+  pthread_rwlock_t lock;
+} term_dictionary_t;
+
+term_dictionary_t term_dictionary = { NULL, NULL, 0, 0, 0, { NULL, NULL, NULL, 0, NULL, NULL },
+                                      PTHREAD_RWLOCK_INITIALIZER };
+
+typedef struct term_list_s {
+  const char ** words;
+  int num_words;
+  int max_words;
+  int error;
+} term_list_t;
+
+// The list keeps its own copy of word, see build_term_dictionary()
+static void add_term(term_list_t * list, const char * word)
+{
+  char * copy;
+
+  if (list->num_words == list->max_words) {
+    int new_max = list->max_words ? 2 * list->max_words : 1024;
+    const char ** new_words = (const char **)
+      realloc(list->words, new_max * sizeof(const char *));
+    if (new_words == NULL) {
+      list->error = -ENOMEM;
+      return;
+    }
+    list->words = new_words;
+    list->max_words = new_max;
+  }
+  if ((copy = strdup(word)) == NULL) {
+    list->error = -ENOMEM;
+    return;
+  }
+  list->words[list->num_words++] = copy;
+}
+
+static void collect_term(void * k, void * v, void * arg)
+{
+  term_list_t * list = (term_list_t *) arg;
+  if (list->error == 0) {
+    add_term(list, (const char *) k);
+  }
+}
+
+static int compare_terms(const void * a, const void * b)
+{
+  return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+typedef struct term_sort_s {
+  const char ** words;
+  int num_words;
+} term_sort_t;
+
+static void * sort_terms(void * arg)
+{
+  term_sort_t * slice = (term_sort_t *) arg;
+  qsort(slice->words, slice->num_words, sizeof(const char *), compare_terms);
+  return(NULL);
+}
+
+// The trigrams of word padded with two TRIGRAM_PADs on each side, length + 2
+// of them, each packed into 24 bits
+static int word_trigrams(const char * word, int length, uint32_t * grams)
+{
+  uint32_t gram = (TRIGRAM_PAD << 8) | TRIGRAM_PAD;
+  int i;
+
+  for (i = 0; i < length + 2; i++) {
+    unsigned char c = (i < length) ? (unsigned char) word[i] : TRIGRAM_PAD;
+    gram = ((gram << 8) | c) & 0xffffff;
+    grams[i] = gram;
+  }
+  return(length + 2);
+}
+
+static int compare_trigram_pairs(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x < y) ? -1 : (x > y);
+}
+
+static void free_trigram_index(trigram_index_t * t)
+{
+  free(t->grams);
+  free(t->starts);
+  free(t->terms);
+  free(t->by_length);
+  free(t->length_starts);
+  memset(t, 0, sizeof(trigram_index_t));
+}
+
+//
+// Builds the trigram index over the num_terms words of sorted. Every (trigram,
+// word number) pair goes into one array that is sorted once, which leaves the
+// word lists of each trigram in dictionary order. Returns 0 or -ENOMEM.
+//
+static int build_trigram_index(const char ** sorted, int num_terms, int max_length,
+                               trigram_index_t * t)
+{
+  uint64_t * pairs;
+  uint32_t * grams;
+  size_t num_pairs = 0, i;
+  int n, j, length;
+
+  memset(t, 0, sizeof(trigram_index_t));
+  for (n = 0; n < num_terms; n++) {
+    num_pairs += strlen(sorted[n]) + 2;
+  }
+  pairs = (uint64_t *) malloc((num_pairs + 1) * sizeof(uint64_t));
+  grams = (uint32_t *) malloc((max_length + 2) * sizeof(uint32_t));
+  t->terms = (uint32_t *) malloc((num_pairs + 1) * sizeof(uint32_t));
+  t->by_length = (uint32_t *) malloc((num_terms + 1) * sizeof(uint32_t));
+  t->length_starts = (uint32_t *) calloc(max_length + 2, sizeof(uint32_t));
+  if (pairs == NULL || grams == NULL || t->terms == NULL || t->by_length == NULL ||
+      t->length_starts == NULL) {
+    goto Fail;
+  }
+
+  for (n = 0, i = 0; n < num_terms; n++) {
+    length = (int) strlen(sorted[n]);
+    word_trigrams(sorted[n], length, grams);
+    for (j = 0; j < length + 2; j++) {
+      pairs[i++] = ((uint64_t) grams[j] << 32) | (uint32_t) n;
+    }
+    t->length_starts[length + 1]++;
+  }
+  qsort(pairs, num_pairs, sizeof(uint64_t), compare_trigram_pairs);
+
+  // Distinct trigrams first, to size the arrays
+  for (i = 0; i < num_pairs; i++) {
+    if (i == 0 || (pairs[i] >> 32) != (pairs[i - 1] >> 32)) {
+      t->num_grams++;
+    }
+  }
+  t->grams = (uint32_t *) malloc((t->num_grams + 1) * sizeof(uint32_t));
+  t->starts = (uint32_t *) malloc((t->num_grams + 1) * sizeof(uint32_t));
+  if (t->grams == NULL || t->starts == NULL) {
+    goto Fail;
+  }
+  for (i = 0, j = 0; i < num_pairs; i++) {
+    if (i == 0 || (pairs[i] >> 32) != (pairs[i - 1] >> 32)) {
+      t->grams[j] = (uint32_t) (pairs[i] >> 32);
+      t->starts[j++] = (uint32_t) i;
+    }
+    t->terms[i] = (uint32_t) pairs[i];
+  }
+  t->starts[j] = (uint32_t) num_pairs;
+
+  // Counting sort by length, which keeps dictionary order within a length
+  for (length = 1; length <= max_length + 1; length++) {
+    t->length_starts[length] += t->length_starts[length - 1];
+  }
+  for (n = 0; n < num_terms; n++) {
+    t->by_length[t->length_starts[strlen(sorted[n])]++] = (uint32_t) n;
+  }
+  for (length = max_length + 1; length > 0; length--) {
+    t->length_starts[length] = t->length_starts[length - 1];
+  }
+  t->length_starts[0] = 0;
+
+  free(pairs);
+  free(grams);
+  return(0);
+
+ Fail:
+  free(pairs);
+  free(grams);
+  free_trigram_index(t);
+  return(-ENOMEM);
+}
+
+//
+// Builds the term dictionary from every word in memory and in the loaded
+// snapshot. The words are split into num_threads slices that are sorted in
+// parallel and then merged while they are front coded. Searches can keep
+// running meanwhile, the new dictionary replaces the old one at the end.
+// Returns the number of words, or a negative errno.
+//
+int build_term_dictionary(int num_threads)
+{
+  term_list_t list;
+  term_sort_t * slices = NULL;
+  pthread_t * threads = NULL;
+  int * next = NULL;
+  const char ** sorted = NULL;
+  trigram_index_t trigrams;
+  unsigned char * data = NULL, * old_data;
+  size_t * blocks = NULL, * old_blocks;
+  size_t size = 0, max_size;
+  const char * previous = "";
+  int num_started = 0, max_length = 0, i, n = 0;
+
+  memset(&list, 0, sizeof(list));
+  memset(&trigrams, 0, sizeof(trigrams));
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  rwlock_rdlock(&index_lock);
+  hashtable_foreach(global_index, collect_term, &list);
+  if (snapshot.header != NULL) {
+    for (i = 0; i < (int) snapshot.header->num_buckets && list.error == 0; i++) {
+      const char * word;
+      if (snapshot.buckets[i] == 0) {
+        continue;
+      }
+      word = snapshot_word((const snapshot_term_t *) (snapshot.base + snapshot.buckets[i]));
+      if (hashtable_search(global_index, (void *) word) == NULL) {
+        add_term(&list, word);
+      }
+    }
+  }
+  // The words are copied: the open addressing table keeps short keys in
+  // its slots, which move when it grows
+  rwlock_rdunlock(&index_lock);
+  if (list.error) {
+    goto Cleanup;
+  }
+
+  if (num_threads > list.num_words / 1024 + 1) {
+    num_threads = list.num_words / 1024 + 1;
+  }
+  slices = (term_sort_t *) calloc(num_threads, sizeof(term_sort_t));
+  threads = (pthread_t *) calloc(num_threads, sizeof(pthread_t));
+  next = (int *) calloc(num_threads, sizeof(int));
+  if (slices == NULL || threads == NULL || next == NULL) {
+    list.error = -ENOMEM;
+    goto Cleanup;
+  }
+  for (i = 0; i < num_threads; i++) {
+    int lo = (int) ((int64_t) list.num_words * i / num_threads);
+    int hi = (int) ((int64_t) list.num_words * (i + 1) / num_threads);
+    slices[i].words = list.words + lo;
+    slices[i].num_words = hi - lo;
+  }
+  // The calling thread sorts the first slice itself
+  for (i = 1; i < num_threads; i++, num_started++) {
+    if (pthread_create(&threads[i], NULL, sort_terms, &slices[i])) {
+      break;
+    }
+  }
+  for (i = num_started + 1; i < num_threads; i++) {
+    sort_terms(&slices[i]);
+  }
+  sort_terms(&slices[0]);
+  for (i = 1; i <= num_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  max_size = 4096;
+  data = (unsigned char *) malloc(max_size);
+  blocks = (size_t *) malloc((list.num_words / TERM_BLOCK + 1) * sizeof(size_t));
+  sorted = (const char **) malloc((list.num_words + 1) * sizeof(const char *));
+  if (data == NULL || blocks == NULL || sorted == NULL) {
+    list.error = -ENOMEM;
+    goto Cleanup;
+  }
+
+  // Merge the sorted slices, front coding as we go
+  for (n = 0; ; n++) {
+    const char * word = NULL;
+    size_t length, shared = 0;
+    int min = -1;
+
+    for (i = 0; i < num_threads; i++) {
+      if (next[i] < slices[i].num_words &&
+          (min < 0 || strcmp(slices[i].words[next[i]], word) < 0)) {
+        min = i;
+        word = slices[i].words[next[i]];
+      }
+    }
+    if (min < 0) {
+      break;
+    }
+    next[min]++;
+    sorted[n] = word;
+
+    length = strlen(word);
+    if (n % TERM_BLOCK == 0) {
+      blocks[n / TERM_BLOCK] = size;
+    } else {
+      while (previous[shared] != '\0' && previous[shared] == word[shared]) {
+        shared++;
+      }
+    }
+    if (size + length + 11 > max_size) {
+      unsigned char * new_data;
+      while (size + length + 11 > max_size) {
+        max_size *= 2;
+      }
+      new_data = (unsigned char *) realloc(data, max_size);
+      if (new_data == NULL) {
+        list.error = -ENOMEM;
+        goto Cleanup;
+      }
+      data = new_data;
+    }
+    if (n % TERM_BLOCK != 0) {
+      size += put_varint(data + size, (unsigned int) shared);
+    }
+    memcpy(data + size, word + shared, length - shared + 1);
+    size += length - shared + 1;
+    if ((int) length > max_length) {
+      max_length = (int) length;
+    }
+    previous = word;
+  }
+
+  list.error = build_trigram_index(sorted, n, max_length, &trigrams);
+  if (list.error) {
+    goto Cleanup;
+  }
+
+  rwlock_wrlock(&term_dictionary.lock);
+  old_data = term_dictionary.data;
+  old_blocks = term_dictionary.blocks;
+  term_dictionary.data = data;
+  term_dictionary.blocks = blocks;
+  term_dictionary.num_blocks = (n + TERM_BLOCK - 1) / TERM_BLOCK;
+  term_dictionary.num_terms = n;
+  term_dictionary.max_length = max_length;
+  free_trigram_index(&term_dictionary.trigrams);
+  term_dictionary.trigrams = trigrams;
+  rwlock_wrunlock(&term_dictionary.lock);
+  __sync_add_and_fetch(&index_generation, 1);
+  data = old_data;
+  blocks = old_blocks;
+
+ Cleanup:
+  free(sorted);
+  free(data);
+  free(blocks);
+  free(next);
+  free(threads);
+  free(slices);
+  for (i = 0; i < list.num_words; i++) {
+    free((char *) list.words[i]);
+  }
+  free(list.words);
+  return (list.error < 0) ? list.error : n;
+}
+
+// Bisects the block heads for the last block whose first word is <= from
+static int term_block_of(const char * from)
+{
+  int lo = 0, hi = term_dictionary.num_blocks - 1, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo + 1) / 2;
+    if (strcmp((const char *) term_dictionary.data + term_dictionary.blocks[mid], from) <= 0) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return(lo);
+}
+
+//
+// Walks the dictionary in order from the first word >= from (or from the
+// start if from is NULL), stopping at the first word that does not start
+// with prefix or sorts after last (whichever are not NULL). Words that do
+// not match pattern are skipped. visit returning non-zero stops the walk.
+//
+static int scan_terms(const char * from, const char * prefix, const char * last,
+                      const char * pattern, term_visitor_t visit, void * arg)
+{
+  const unsigned char * p;
+  size_t prefix_length = prefix ? strlen(prefix) : 0;
+  char * word;
+  int block, n, count = 0;
+
+  rwlock_rdlock(&term_dictionary.lock);
+  if (term_dictionary.data == NULL) {
+    rwlock_rdunlock(&term_dictionary.lock);
+    return(-EAGAIN);
+  }
+  word = (char *) malloc(term_dictionary.max_length + 1);
+  if (word == NULL) {
+    rwlock_rdunlock(&term_dictionary.lock);
+    return(-ENOMEM);
+  }
+
+  block = (from != NULL && term_dictionary.num_blocks > 0) ? term_block_of(from) : 0;
+  p = term_dictionary.data + (term_dictionary.num_blocks > 0 ? term_dictionary.blocks[block] : 0);
+  for (n = block * TERM_BLOCK; n < term_dictionary.num_terms; n++) {
+    size_t shared = 0, length;
+
+    if (n % TERM_BLOCK != 0) {
+      shared = get_varint(&p);
+    }
+    length = strlen((const char *) p);
+    memcpy(word + shared, p, length + 1);
+    p += length + 1;
+
+    if (from != NULL && strcmp(word, from) < 0) {
+      continue;
+    }
+    if ((prefix != NULL && strncmp(word, prefix, prefix_length)) ||
+        (last != NULL && strcmp(word, last) > 0)) {
+      break;
+    }
+    if (pattern != NULL && fnmatch(pattern, word, FNM_NOESCAPE)) {
+      continue;
+    }
+    count++;
+    if (visit(arg, word)) {
+      break;
+    }
+  }
+  rwlock_rdunlock(&term_dictionary.lock);
+  free(word);
+  return(count);
+}
+
+//
+// Lookups in the term dictionary. Each calls visit with every matching word,
+// in sorted order, until it returns non-zero; the word is only valid during
+// the call. They return the number of words visited, or -EAGAIN if the
+// dictionary has not been built yet.
+//
+int find_terms_by_prefix(const char * prefix, term_visitor_t visit, void * arg)
+{
+  return scan_terms(prefix, prefix, NULL, NULL, visit, arg);
+}
+
+// Words between first and last, both included. Either may be NULL for no bound.
+int find_terms_in_range(const char * first, const char * last, term_visitor_t visit,
+                        void * arg)
+{
+  return scan_terms(first, NULL, last, NULL, visit, arg);
+}
+
+// Shell-style pattern (* ? [...]). Only words sharing the literal prefix
+// before the first wildcard are looked at.
+int find_terms_matching(const char * pattern, term_visitor_t visit, void * arg)
+{
+  size_t length = strcspn(pattern, "*?[");
+  char * prefix;
+  int count;
+
+  if (pattern[length] == '\0') {
+    return scan_terms(pattern, NULL, pattern, NULL, visit, arg);
+  }
+  prefix = strndup(pattern, length);
+  if (prefix == NULL) {
+    return(-ENOMEM);
+  }
+  count = scan_terms(prefix, prefix, NULL, pattern, visit, arg);
+  free(prefix);
+  return(count);
+}
+
+// Decodes word number n of the dictionary into word
+static void term_at(int n, char * word)
+{
+  const unsigned char * p = term_dictionary.data + term_dictionary.blocks[n / TERM_BLOCK];
+  int i;
+
+  for (i = n - n % TERM_BLOCK; i <= n; i++) {
+    size_t shared = 0, length;
+    if (i % TERM_BLOCK != 0) {
+      shared = get_varint(&p);
+    }
+    length = strlen((const char *) p);
+    memcpy(word + shared, p, length + 1);
+    p += length + 1;
+  }
+}
+
+// Whether a and b are within max_distance edits of each other. Gives up as
+// soon as a whole row of the table is over the limit. rows has room for
+// 2 * (length of b + 1) ints.
+static int within_distance(const char * a, int length_a, const char * b, int length_b,
+                           int max_distance, int * rows)
+{
+  int * previous = rows, * current = rows + length_b + 1, * tmp;
+  int i, j, best;
+
+  for (j = 0; j <= length_b; j++) {
+    previous[j] = j;
+  }
+  for (i = 1; i <= length_a; i++) {
+    current[0] = best = i;
+    for (j = 1; j <= length_b; j++) {
+      int cost = previous[j - 1] + (a[i - 1] != b[j - 1]);
+      if (previous[j] + 1 < cost) {
+        cost = previous[j] + 1;
+      }
+      if (current[j - 1] + 1 < cost) {
+        cost = current[j - 1] + 1;
+      }
+      current[j] = cost;
+      if (cost < best) {
+        best = cost;
+      }
+    }
+    if (best > max_distance) {
+      return(0);
+    }
+    tmp = previous;
+    previous = current;
+    current = tmp;
+  }
+  return(previous[length_b] <= max_distance);
+}
+
+static int compare_ordinals(const void * a, const void * b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return (x < y) ? -1 : (x > y);
+}
+
+//
+// Words within max_distance edits (insertions, deletions, substitutions) of
+// word, in dictionary order. One edit changes at most three of a word's
+// padded trigrams, so a match shares at least length + 2 - 3 * max_distance
+// of them with word: only the words that show up that often in word's
+// trigram lists are checked with a bounded Levenshtein distance. When that
+// bound is not positive, the words of nearby lengths are checked instead.
+// Returns like the other lookups.
+//
+int find_terms_near(const char * word, int max_distance, term_visitor_t visit, void * arg)
+{
+  trigram_index_t * t = &term_dictionary.trigrams;
+  int length = (int) strlen(word);
+  int threshold = length + 2 - 3 * max_distance;
+  uint32_t * grams = NULL, * candidates = NULL;
+  size_t num_candidates = 0, i, k;
+  char * term = NULL;
+  int * rows = NULL;
+  int j, count = 0;
+
+  rwlock_rdlock(&term_dictionary.lock);
+  if (term_dictionary.data == NULL) {
+    rwlock_rdunlock(&term_dictionary.lock);
+    return(-EAGAIN);
+  }
+  grams = (uint32_t *) malloc((length + 2) * sizeof(uint32_t));
+  term = (char *) malloc(term_dictionary.max_length + 1);
+  rows = (int *) malloc(2 * (term_dictionary.max_length + 1) * sizeof(int));
+  if (grams == NULL || term == NULL || rows == NULL) {
+    count = -ENOMEM;
+    goto Cleanup;
+  }
+
+  if (threshold > 0) {
+    // Gather every word on the lists of word's trigrams, then keep the ones
+    // that came up at least threshold times
+    size_t total = 0;
+    int lo[length + 2], hi[length + 2];
+
+    word_trigrams(word, length, grams);
+    for (j = 0; j < length + 2; j++) {
+      int a = 0, b = t->num_grams;
+      while (a < b) {
+        int mid = a + (b - a) / 2;
+        if (t->grams[mid] < grams[j]) {
+          a = mid + 1;
+        } else {
+          b = mid;
+        }
+      }
+      lo[j] = hi[j] = 0;
+      if (a < t->num_grams && t->grams[a] == grams[j]) {
+        lo[j] = t->starts[a];
+        hi[j] = t->starts[a + 1];
+        total += hi[j] - lo[j];
+      }
+    }
+    candidates = (uint32_t *) malloc((total + 1) * sizeof(uint32_t));
+    if (candidates == NULL) {
+      count = -ENOMEM;
+      goto Cleanup;
+    }
+    for (j = 0; j < length + 2; j++) {
+      memcpy(candidates + num_candidates, t->terms + lo[j],
+             (hi[j] - lo[j]) * sizeof(uint32_t));
+      num_candidates += hi[j] - lo[j];
+    }
+    qsort(candidates, num_candidates, sizeof(uint32_t), compare_ordinals);
+    for (i = 0, k = 0; i < num_candidates; ) {
+      size_t run = i;
+      while (run < num_candidates && candidates[run] == candidates[i]) {
+        run++;
+      }
+      if ((int) (run - i) >= threshold) {
+        candidates[k++] = candidates[i];
+      }
+      i = run;
+    }
+    num_candidates = k;
+  } else {
+    int shortest = (length > max_distance) ? length - max_distance : 0;
+    int longest = length + max_distance;
+    uint32_t first, last;
+
+    if (longest > term_dictionary.max_length) {
+      longest = term_dictionary.max_length;
+    }
+    first = (shortest <= longest) ? t->length_starts[shortest] : 0;
+    last = (shortest <= longest) ? t->length_starts[longest + 1] : 0;
+    candidates = (uint32_t *) malloc((last - first + 1) * sizeof(uint32_t));
+    if (candidates == NULL) {
+      count = -ENOMEM;
+      goto Cleanup;
+    }
+    memcpy(candidates, t->by_length + first, (last - first) * sizeof(uint32_t));
+    num_candidates = last - first;
+    qsort(candidates, num_candidates, sizeof(uint32_t), compare_ordinals);
+  }
+
+  for (i = 0; i < num_candidates; i++) {
+    int term_length;
+
+    term_at(candidates[i], term);
+    term_length = (int) strlen(term);
+    if (abs(term_length - length) > max_distance ||
+        !within_distance(word, length, term, term_length, max_distance, rows)) {
+      continue;
+    }
+    count++;
+    if (visit(arg, term)) {
+      break;
+    }
+  }
+
+ Cleanup:
+  rwlock_rdunlock(&term_dictionary.lock);
+  free(grams);
+  free(candidates);
+  free(term);
+  free(rows);
+  return(count);
 }
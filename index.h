@@ -1,9 +1,11 @@
 #ifndef __INDEX_H_537__
 #define __INDEX_H_537__
 
+#include "tokenizer.h"
+
 #define MAXPATH 511
 typedef struct index_search_elem_s {
-  char file_name[MAXPATH];
+  int file_id;
   int line_number;
 } index_search_elem_t;
 
@@ -12,8 +14,104 @@ typedef struct index_search_results_s {
   index_search_elem_t results[1];
 } index_search_results_t;
 
+//
+// Cursor over the postings of one word. Results are decoded a block at a
+// time into the cursor itself, so walking it allocates nothing. The index
+// stays read-locked from open_index_cursor until close_index_cursor, which
+// must be called whether or not the word was found.
+//
+#define INDEX_CURSOR_BLOCK 128
+
+typedef struct posting_reader_s {
+  const unsigned char * pos;
+  const unsigned char * end;
+  int remaining;
+  int last_line;
+  int last_position;
+} posting_reader_t;
+
+typedef struct index_cursor_s {
+  void * element;
+  const void * term;
+  int instance;
+  int end;
+  int term_instance;
+  int term_end;
+  posting_reader_t reader;
+  int file_id;
+  int next;
+  int count;
+  int lines[INDEX_CURSOR_BLOCK];
+  int positions[INDEX_CURSOR_BLOCK];
+} index_cursor_t;
+
 int init_index();
-int insert_into_index(char * word, char * file_name, int line_number);
+int enable_index_positions();
+int index_has_positions();
+int insert_into_index(char * word, int file_id, int line_number);
 index_search_results_t * find_in_index(char * word);
 
+int open_index_cursor(index_cursor_t * cursor, char * word);
+int open_index_file_cursor(index_cursor_t * cursor, char * word, int file_id);
+int index_cursor_next(index_cursor_t * cursor, int * file_id, int * line_number);
+int index_cursor_seek(index_cursor_t * cursor, int file_id, int line_number,
+                      int * found_file_id, int * found_line_number);
+int index_cursor_position(index_cursor_t * cursor);
+int index_cursor_cost(index_cursor_t * cursor, int files);
+int index_cursor_num_files(index_cursor_t * cursor);
+int index_cursor_max_count(index_cursor_t * cursor);
+int index_cursor_next_file(index_cursor_t * cursor, int file_id, int * found_file_id,
+                           int * count);
+void close_index_cursor(index_cursor_t * cursor);
+
+// Per-thread staging index, published to the shared index in one merge
+typedef struct index_staging_s index_staging_t;
+index_staging_t * create_staging_index();
+int insert_into_staging(index_staging_t * staging, const char * word,
+                        int length, int line_number, int position);
+int merge_into_index(index_staging_t * staging, int file_id);
+int merge_chunk_into_index(index_staging_t * staging, int file_id, int line_offset,
+                           int last);
+void clear_staging_index(index_staging_t * staging);
+void destroy_staging_index(index_staging_t * staging);
+
+// Snapshot of the whole index in one file that is mapped, not read, on load
+int save_index(const char * path);
+int load_index(const char * path);
+
+// Sorted term dictionary for prefix, range and wildcard lookups, built once
+// indexing is done
+typedef int (*term_visitor_t)(void * arg, const char * word);
+int build_term_dictionary(int num_threads);
+int find_terms_by_prefix(const char * prefix, term_visitor_t visit, void * arg);
+int find_terms_in_range(const char * first, const char * last, term_visitor_t visit,
+                        void * arg);
+int find_terms_matching(const char * pattern, term_visitor_t visit, void * arg);
+int find_terms_near(const char * word, int max_distance, term_visitor_t visit, void * arg);
+
+// File registry: every path is interned once and referred to by its id
+int register_file(char * file_name);
+int find_file(char * file_name);
+const char * get_file_name(int file_id);
+
+// What each file looked like when it was indexed, for incremental re-runs
+int set_file_stamp(int file_id, const file_stamp_t * stamp);
+int get_file_stamp(int file_id, file_stamp_t * stamp);
+int replace_file(int file_id);
+void remove_file(int file_id);
+
+// Collection statistics for ranking, lengths are in words
+typedef struct index_stats_s {
+  int num_documents;
+  double average_length;
+  int64_t min_length;
+} index_stats_t;
+
+int64_t get_file_length(int file_id);
+void get_index_stats(index_stats_t * stats);
+
+// Generation counters, for callers that cache what they found in the index
+uint64_t get_term_generation(const char * word);
+uint64_t get_index_generation();
+
 #endif // __INDEX_H_537__
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//
+// Load generator for search-engine --listen. Every connection replays the
+// whole query file, keeping up to <window> queries outstanding, and times
+// each query from when it was sent to when the empty line ending its answer
+// came back. With -o the answers on the first connection go to stdout.
+//
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_WINDOW 32
+
+typedef struct connection_s {
+  pthread_t thread;
+  int fd;
+  int echo;
+  long num_answers;
+  double total_latency;
+  double max_latency;
+} connection_t;
+
+static const char * socket_name;
+static char ** queries;
+static long num_queries;
+static int window = DEFAULT_WINDOW;
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_queries(const char * name)
+{
+  FILE * file = fopen(name, "r");
+  char line[1024];
+  long size = 0;
+
+  if (file == NULL) {
+    perror(name);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), file)) {
+    if (num_queries == size) {
+      size = size ? 2 * size : 1024;
+      queries = (char **) realloc(queries, size * sizeof(char *));
+      if (queries == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    // Every query goes out as one line
+    line[strcspn(line, "\n")] = '\0';
+    if ((queries[num_queries] = (char *) malloc(strlen(line) + 2)) == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    sprintf(queries[num_queries++], "%s\n", line);
+  }
+  fclose(file);
+}
+
+static int connect_to_server(void)
+{
+  struct sockaddr_un address;
+  int fd;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_name, sizeof(address.sun_path) - 1);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address))) {
+    perror(socket_name);
+    exit(1);
+  }
+  return(fd);
+}
+
+static void * run_connection(void * data)
+{
+  connection_t * conn = (connection_t *) data;
+  double * sent_at = (double *) calloc(window, sizeof(double));
+  char buffer[65536];
+  long num_sent = 0;
+  int at_line_start = 1;
+
+  if (sent_at == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  while (conn->num_answers < num_queries) {
+    // Keep the window full, then wait for answers
+    while (num_sent < num_queries && num_sent - conn->num_answers < window) {
+      const char * query = queries[num_sent];
+      size_t length = strlen(query), written = 0;
+
+      sent_at[num_sent % window] = now();
+      while (written < length) {
+        ssize_t n = send(conn->fd, query + written, length - written, MSG_NOSIGNAL);
+        if (n < 0 && errno != EINTR) {
+          perror("send");
+          exit(1);
+        }
+        written += n > 0 ? n : 0;
+      }
+      num_sent++;
+    }
+
+    ssize_t n = read(conn->fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "Server closed the connection after %ld answers.\n", conn->num_answers);
+      exit(1);
+    }
+    if (conn->echo) {
+      fwrite(buffer, 1, n, stdout);
+    }
+    // An empty line ends an answer
+    for (ssize_t i = 0; i < n; i++) {
+      if (buffer[i] == '\n' && at_line_start) {
+        double latency = now() - sent_at[conn->num_answers % window];
+
+        conn->total_latency += latency;
+        if (latency > conn->max_latency) {
+          conn->max_latency = latency;
+        }
+        conn->num_answers++;
+      }
+      at_line_start = (buffer[i] == '\n');
+    }
+  }
+  close(conn->fd);
+  free(sent_at);
+  return(NULL);
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: loadgen [-o] <socket> <query-file> [<connections> [<window>]]\n");
+  exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+  connection_t * conns;
+  int num_conns = DEFAULT_CONNECTIONS;
+  int echo = 0, i = 1;
+  long num_answers = 0;
+  double start, elapsed, total_latency = 0, max_latency = 0;
+
+  if (i < argc && !strcmp(argv[i], "-o")) {
+    echo = 1;
+    i++;
+  }
+  if (argc - i < 2 || argc - i > 4) {
+    usage();
+  }
+  socket_name = argv[i];
+  read_queries(argv[i + 1]);
+  if (argc - i > 2 && (num_conns = atoi(argv[i + 2])) < 1) {
+    usage();
+  }
+  if (argc - i > 3 && (window = atoi(argv[i + 3])) < 1) {
+    usage();
+  }
+
+  conns = (connection_t *) calloc(num_conns, sizeof(connection_t));
+  if (conns == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  // Everyone is connected before the clock starts
+  for (i = 0; i < num_conns; i++) {
+    conns[i].fd = connect_to_server();
+    conns[i].echo = echo && i == 0;
+  }
+  start = now();
+  for (i = 0; i < num_conns; i++) {
+    if (pthread_create(&conns[i].thread, NULL, run_connection, &conns[i])) {
+      fprintf(stderr, "Failed to create connection thread.\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < num_conns; i++) {
+    pthread_join(conns[i].thread, NULL);
+    num_answers += conns[i].num_answers;
+    total_latency += conns[i].total_latency;
+    if (conns[i].max_latency > max_latency) {
+      max_latency = conns[i].max_latency;
+    }
+  }
+  elapsed = now() - start;
+
+  fprintf(stderr, "%ld queries on %d connections in %.3f s: %.0f queries/s, "
+          "latency %.3f ms mean, %.3f ms max\n",
+          num_answers, num_conns, elapsed, num_answers / elapsed,
+          num_answers ? 1000 * total_latency / num_answers : 0.0, 1000 * max_latency);
+  for (i = 0; i < num_queries; i++) {
+    free(queries[i]);
+  }
+  free(queries);
+  free(conns);
+  return(0);
+}
@@ -0,0 +1,629 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include "index.h"
+#include "query.h"
+
+//
+// Every term gets its own index cursor, and each cursor remembers the last
+// posting it produced. A clause is evaluated as a leapfrog join: its rarest
+// term proposes a position, every other term seeks to it, and the first one
+// that overshoots proposes the next position. index_cursor_seek gallops over
+// the files in between, so a conjunction only decodes postings near the
+// rarest term's. Clauses are then merged in order, so nothing is ever
+// materialized.
+//
+// Phrases use the same join with the word's position within its line as a
+// third coordinate. Each term's position is shifted back by its offset in
+// the phrase, so the terms line up on the same key exactly where the words
+// are adjacent and in order.
+//
+// All cursors of a query are open at the same time, which takes the index
+// read lock once per term on the same thread. That is fine with the default
+// (reader-preferring) rwlocks.
+//
+typedef struct query_cursor_s {
+  index_cursor_t cursor;
+  int file_id;
+  int line_number;
+  int position;
+  int offset;
+  int valid;
+  int done;
+  int cost;
+} query_cursor_t;
+
+typedef struct clause_s {
+  query_cursor_t ** include;
+  int num_include;
+  query_cursor_t ** exclude;
+  int num_exclude;
+  int started;
+  int file_id;
+  int line_number;
+} clause_t;
+
+int is_query_operator(const char * word)
+{
+  return(!strcmp(word, "AND") || !strcmp(word, "OR") || !strcmp(word, "NOT"));
+}
+
+//
+// Parses "term (OP term)*" from words, which must stay valid while the query
+// is used. Returns 0, or -1 if the words are not a valid query.
+//
+int parse_query(query_t * query, char ** words, int num_words,
+                query_granularity_t granularity)
+{
+  int i;
+
+  if (num_words % 2 == 0 || num_words / 2 + 1 > QUERY_MAX_TERMS) {
+    return(-1);
+  }
+  query->granularity = granularity;
+  query->num_terms = 0;
+  query->num_clauses = 1;
+  for (i = 0; i < num_words; i += 2) {
+    query_term_t * term = &query->terms[query->num_terms++];
+
+    if (is_query_operator(words[i]) || (i > 0 && !is_query_operator(words[i - 1]))) {
+      return(-1);
+    }
+    term->word = words[i];
+    term->offset = 0;
+    term->negated = (i > 0 && !strcmp(words[i - 1], "NOT"));
+    if (i > 0 && !strcmp(words[i - 1], "OR")) {
+      query->num_clauses++;
+    }
+    term->clause = query->num_clauses - 1;
+  }
+  return(0);
+}
+
+//
+// Splits the text between the quotes of a phrase into its words, the same
+// way the indexer does, and makes them the terms of a single clause. The
+// words are NUL-terminated in place, so phrase must stay valid while the
+// query is used. Returns 0, or -1 if there are no words or too many.
+//
+int parse_phrase(query_t * query, char * phrase)
+{
+  tokenizer_t tokenizer;
+  token_t tokens[QUERY_MAX_TERMS + 1];
+  int num_tokens, i;
+
+  tokenizer_init(&tokenizer, phrase, strlen(phrase), 1);
+  num_tokens = tokenizer_next(&tokenizer, tokens, QUERY_MAX_TERMS + 1);
+  if (num_tokens <= 0 || num_tokens > QUERY_MAX_TERMS) {
+    return(-1);
+  }
+  query->granularity = QUERY_PHRASE;
+  query->num_terms = num_tokens;
+  query->num_clauses = 1;
+  for (i = 0; i < num_tokens; i++) {
+    query->terms[i].word = phrase + tokens[i].offset;
+    query->terms[i].negated = 0;
+    query->terms[i].clause = 0;
+    query->terms[i].offset = i;
+    query->terms[i].word[tokens[i].length] = '\0';
+  }
+  return(0);
+}
+
+static int compare_position(query_t * query, int file_a, int line_a, int position_a,
+                            int file_b, int line_b, int position_b)
+{
+  if (file_a != file_b) {
+    return (file_a < file_b) ? -1 : 1;
+  }
+  if (query->granularity == QUERY_FILES) {
+    return(0);
+  }
+  if (line_a != line_b) {
+    return (line_a < line_b) ? -1 : 1;
+  }
+  if (query->granularity != QUERY_PHRASE || position_a == position_b) {
+    return(0);
+  }
+  return (position_a < position_b) ? -1 : 1;
+}
+
+//
+// Moves the cursor to its first posting at or after the target, unless it is
+// there already. Lines before the target are skipped with a seek, positions
+// on the target line one posting at a time. Returns 0 once the cursor has
+// nothing left.
+//
+static int reach(query_t * query, query_cursor_t * qc, int file_id, int line_number,
+                 int position)
+{
+  int found;
+
+  if (qc->done) {
+    return(0);
+  }
+  if (qc->valid &&
+      compare_position(query, qc->file_id, qc->line_number, qc->position,
+                       file_id, line_number, position) >= 0) {
+    return(1);
+  }
+  if (!qc->valid || qc->file_id < file_id ||
+      (qc->file_id == file_id && qc->line_number < line_number)) {
+    found = index_cursor_seek(&qc->cursor, file_id,
+                              query->granularity == QUERY_FILES ? 0 : line_number,
+                              &qc->file_id, &qc->line_number);
+  } else {
+    found = index_cursor_next(&qc->cursor, &qc->file_id, &qc->line_number);
+  }
+  for (;;) {
+    if (!found) {
+      qc->done = 1;
+      return(0);
+    }
+    qc->valid = 1;
+    if (query->granularity != QUERY_PHRASE) {
+      return(1);
+    }
+    qc->position = index_cursor_position(&qc->cursor) - qc->offset;
+    if (compare_position(query, qc->file_id, qc->line_number, qc->position,
+                         file_id, line_number, position) >= 0) {
+      return(1);
+    }
+    found = index_cursor_next(&qc->cursor, &qc->file_id, &qc->line_number);
+  }
+}
+
+// Produces the clause's next match after the last one it produced
+static int clause_next(query_t * query, clause_t * clause, int * file_id,
+                       int * line_number)
+{
+  int target_file = 0, target_line = 0, target_position = INT_MIN;
+  int i, excluded;
+
+  // Lines (and files) are reported once, however many matches they hold
+  if (clause->started) {
+    target_file = clause->file_id + (query->granularity == QUERY_FILES);
+    target_line = (query->granularity == QUERY_FILES) ? 0 : clause->line_number + 1;
+  }
+
+  for (;;) {
+    // The rarest term proposes, the others have to catch up
+    if (!reach(query, clause->include[0], target_file, target_line, target_position)) {
+      return(0);
+    }
+    target_file = clause->include[0]->file_id;
+    target_line = clause->include[0]->line_number;
+    target_position = clause->include[0]->position;
+    for (i = 1; i < clause->num_include; i++) {
+      query_cursor_t * qc = clause->include[i];
+      if (!reach(query, qc, target_file, target_line, target_position)) {
+        return(0);
+      }
+      if (compare_position(query, qc->file_id, qc->line_number, qc->position,
+                           target_file, target_line, target_position) > 0) {
+        break;
+      }
+    }
+    if (i < clause->num_include) {
+      target_file = clause->include[i]->file_id;
+      target_line = clause->include[i]->line_number;
+      target_position = clause->include[i]->position;
+      continue;
+    }
+
+    excluded = 0;
+    for (i = 0; i < clause->num_exclude && !excluded; i++) {
+      query_cursor_t * qc = clause->exclude[i];
+      excluded = reach(query, qc, target_file, target_line, target_position) &&
+        !compare_position(query, qc->file_id, qc->line_number, qc->position,
+                          target_file, target_line, target_position);
+    }
+    clause->started = 1;
+    clause->file_id = target_file;
+    clause->line_number = target_line;
+    if (!excluded) {
+      *file_id = target_file;
+      *line_number = (query->granularity == QUERY_FILES) ? 0 : target_line;
+      return(1);
+    }
+    if (query->granularity == QUERY_FILES) {
+      target_file++;
+      target_line = 0;
+    } else {
+      target_line++;
+    }
+    target_position = INT_MIN;
+  }
+}
+
+//
+// Evaluates the query over every file, or only over file_id if it is not
+// negative, calling hit for each match. Returns the number of matches, or a
+// negative errno.
+//
+int run_query(query_t * query, int file_id, query_hit_t hit, void * arg)
+{
+  query_cursor_t * cursors;
+  query_cursor_t ** order;
+  clause_t * clauses;
+  int * have, * head_file, * head_line;
+  int i, j, c, count = 0;
+
+  cursors = (query_cursor_t *) calloc(query->num_terms, sizeof(query_cursor_t));
+  order = (query_cursor_t **) calloc(query->num_terms, sizeof(query_cursor_t *));
+  clauses = (clause_t *) calloc(query->num_clauses, sizeof(clause_t));
+  have = (int *) calloc(3 * query->num_clauses, sizeof(int));
+  if (cursors == NULL || order == NULL || clauses == NULL || have == NULL) {
+    free(cursors);
+    free(order);
+    free(clauses);
+    free(have);
+    return(-ENOMEM);
+  }
+  head_file = have + query->num_clauses;
+  head_line = head_file + query->num_clauses;
+
+  for (i = 0; i < query->num_terms; i++) {
+    if (file_id >= 0) {
+      open_index_file_cursor(&cursors[i].cursor, query->terms[i].word, file_id);
+    } else {
+      open_index_cursor(&cursors[i].cursor, query->terms[i].word);
+    }
+    cursors[i].offset = query->terms[i].offset;
+    cursors[i].cost = index_cursor_cost(&cursors[i].cursor,
+                                        query->granularity == QUERY_FILES);
+  }
+
+  // Group the cursors by clause, included terms first and rarest first
+  for (c = 0, j = 0; c < query->num_clauses; c++) {
+    clause_t * clause = &clauses[c];
+    clause->include = &order[j];
+    for (i = 0; i < query->num_terms; i++) {
+      if (query->terms[i].clause == c && !query->terms[i].negated) {
+        int k = clause->num_include++;
+        while (k > 0 && clause->include[k - 1]->cost > cursors[i].cost) {
+          clause->include[k] = clause->include[k - 1];
+          k--;
+        }
+        clause->include[k] = &cursors[i];
+      }
+    }
+    j += clause->num_include;
+    clause->exclude = &order[j];
+    for (i = 0; i < query->num_terms; i++) {
+      if (query->terms[i].clause == c && query->terms[i].negated) {
+        clause->exclude[clause->num_exclude++] = &cursors[i];
+      }
+    }
+    j += clause->num_exclude;
+  }
+
+  // Merge the clauses' matches, each position reported once
+  for (c = 0; c < query->num_clauses; c++) {
+    have[c] = clause_next(query, &clauses[c], &head_file[c], &head_line[c]);
+  }
+  for (;;) {
+    int min = -1;
+    for (c = 0; c < query->num_clauses; c++) {
+      if (have[c] && (min < 0 || compare_position(query, head_file[c], head_line[c], 0,
+                                                  head_file[min], head_line[min], 0) < 0)) {
+        min = c;
+      }
+    }
+    if (min < 0) {
+      break;
+    }
+    hit(arg, head_file[min], head_line[min]);
+    count++;
+    for (c = 0; c < query->num_clauses; c++) {
+      if (c != min && have[c] &&
+          !compare_position(query, head_file[c], head_line[c], 0,
+                            head_file[min], head_line[min], 0)) {
+        have[c] = clause_next(query, &clauses[c], &head_file[c], &head_line[c]);
+      }
+    }
+    have[min] = clause_next(query, &clauses[min], &head_file[min], &head_line[min]);
+  }
+
+  for (i = 0; i < query->num_terms; i++) {
+    close_index_cursor(&cursors[i].cursor);
+  }
+  free(cursors);
+  free(order);
+  free(clauses);
+  free(have);
+  return(count);
+}
+
+static int union_before(query_cursor_t * a, query_cursor_t * b)
+{
+  return (a->file_id != b->file_id) ? a->file_id < b->file_id
+                                    : a->line_number < b->line_number;
+}
+
+static void union_sift_down(query_cursor_t ** heap, int size, int i)
+{
+  for (;;) {
+    int child = 2 * i + 1;
+    query_cursor_t * tmp;
+
+    if (child >= size) {
+      return;
+    }
+    if (child + 1 < size && union_before(heap[child + 1], heap[child])) {
+      child++;
+    }
+    if (!union_before(heap[child], heap[i])) {
+      return;
+    }
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+}
+
+//
+// Lines holding any of the words, each reported once, in order. Used for
+// words expanded from a prefix or pattern, which can be far more than a
+// boolean query allows, so the cursors are merged through a binary heap.
+// Evaluated over every file, or only over file_id if it is not negative.
+// Returns the number of matches, or a negative errno.
+//
+int run_union(char ** words, int num_words, int file_id, query_hit_t hit, void * arg)
+{
+  query_cursor_t * cursors;
+  query_cursor_t ** heap;
+  int last_file = -1, last_line = -1;
+  int i, size = 0, count = 0;
+
+  cursors = (query_cursor_t *) calloc(num_words, sizeof(query_cursor_t));
+  heap = (query_cursor_t **) calloc(num_words, sizeof(query_cursor_t *));
+  if (cursors == NULL || heap == NULL) {
+    free(cursors);
+    free(heap);
+    return(-ENOMEM);
+  }
+
+  for (i = 0; i < num_words; i++) {
+    if (file_id >= 0) {
+      open_index_file_cursor(&cursors[i].cursor, words[i], file_id);
+    } else {
+      open_index_cursor(&cursors[i].cursor, words[i]);
+    }
+    if (index_cursor_next(&cursors[i].cursor, &cursors[i].file_id,
+                          &cursors[i].line_number)) {
+      heap[size++] = &cursors[i];
+    }
+  }
+  for (i = size / 2 - 1; i >= 0; i--) {
+    union_sift_down(heap, size, i);
+  }
+
+  while (size > 0) {
+    query_cursor_t * top = heap[0];
+    if (top->file_id != last_file || top->line_number != last_line) {
+      last_file = top->file_id;
+      last_line = top->line_number;
+      hit(arg, last_file, last_line);
+      count++;
+    }
+    if (!index_cursor_next(&top->cursor, &top->file_id, &top->line_number)) {
+      heap[0] = heap[--size];
+    }
+    union_sift_down(heap, size, 0);
+  }
+
+  for (i = 0; i < num_words; i++) {
+    close_index_cursor(&cursors[i].cursor);
+  }
+  free(cursors);
+  free(heap);
+  return(count);
+}
+
+//
+// Top-k by BM25, evaluated document at a time with WAND. Every term gets an
+// upper bound on the score it can add to any file, from its most postings in
+// one file and the shortest file length. The terms are kept sorted by the
+// file their cursor is on; walking them in that order until the bounds add
+// up to more than the k-th best score so far finds the pivot, the first file
+// that could still make it. Files before the pivot are skipped without being
+// scored (or their postings decoded), and only files every term before the
+// pivot agrees on are scored in full.
+//
+typedef struct ranked_term_s {
+  index_cursor_t cursor;
+  int file_id;
+  int count;
+  double idf;
+  double bound;
+} ranked_term_t;
+
+typedef struct ranked_result_s {
+  int file_id;
+  double score;
+} ranked_result_t;
+
+// Worse results sort first: lower score, then higher file id
+static int ranked_worse(const ranked_result_t * a, const ranked_result_t * b)
+{
+  return (a->score != b->score) ? a->score < b->score : a->file_id > b->file_id;
+}
+
+static void ranked_sift_down(ranked_result_t * heap, int size, int i)
+{
+  for (;;) {
+    int child = 2 * i + 1;
+    ranked_result_t tmp;
+
+    if (child >= size) {
+      return;
+    }
+    if (child + 1 < size && ranked_worse(&heap[child + 1], &heap[child])) {
+      child++;
+    }
+    if (!ranked_worse(&heap[child], &heap[i])) {
+      return;
+    }
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+}
+
+static void ranked_sift_up(ranked_result_t * heap, int i)
+{
+  while (i > 0 && ranked_worse(&heap[i], &heap[(i - 1) / 2])) {
+    ranked_result_t tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+static double bm25(double idf, int count, double length, double average_length)
+{
+  double norm = BM25_K1 * (1 - BM25_B + BM25_B * length / average_length);
+  return idf * count * (BM25_K1 + 1) / (count + norm);
+}
+
+// Moves a term to its next file at or after file_id, dropping it from the
+// first num_terms of terms (kept sorted by file) once it runs out
+static void ranked_advance(ranked_term_t ** terms, int * num_terms, int i, int file_id)
+{
+  ranked_term_t * term = terms[i];
+
+  if (!index_cursor_next_file(&term->cursor, file_id, &term->file_id, &term->count)) {
+    memmove(&terms[i], &terms[i + 1], (*num_terms - i - 1) * sizeof(ranked_term_t *));
+    (*num_terms)--;
+    return;
+  }
+  while (i + 1 < *num_terms && terms[i + 1]->file_id < term->file_id) {
+    terms[i] = terms[i + 1];
+    i++;
+  }
+  terms[i] = term;
+}
+
+//
+// Calls hit for the (up to) k best files, best first. Returns how many there
+// were, or a negative errno.
+//
+int run_ranked(char ** words, int num_words, int k, ranked_hit_t hit, void * arg)
+{
+  ranked_term_t * storage;
+  ranked_term_t ** terms;
+  ranked_result_t * heap;
+  index_stats_t stats;
+  int num_terms = 0, size = 0, i, j;
+
+  get_index_stats(&stats);
+  storage = (ranked_term_t *) calloc(num_words, sizeof(ranked_term_t));
+  terms = (ranked_term_t **) calloc(num_words, sizeof(ranked_term_t *));
+  heap = (ranked_result_t *) calloc(k, sizeof(ranked_result_t));
+  if (storage == NULL || terms == NULL || heap == NULL) {
+    free(storage);
+    free(terms);
+    free(heap);
+    return(-ENOMEM);
+  }
+
+  for (i = 0; i < num_words; i++) {
+    ranked_term_t * term = &storage[i];
+    int df;
+
+    open_index_cursor(&term->cursor, words[i]);
+    df = index_cursor_num_files(&term->cursor);
+    term->idf = log(1 + (stats.num_documents - df + 0.5) / (df + 0.5));
+    if (term->idf < 0) {
+      term->idf = 0;
+    }
+    term->bound = bm25(term->idf, index_cursor_max_count(&term->cursor),
+                       stats.min_length, stats.average_length);
+    if (index_cursor_next_file(&term->cursor, 0, &term->file_id, &term->count)) {
+      // Insertion sort by file
+      for (j = num_terms++; j > 0 && terms[j - 1]->file_id > term->file_id; j--) {
+        terms[j] = terms[j - 1];
+      }
+      terms[j] = term;
+    }
+  }
+
+  while (num_terms > 0) {
+    double threshold = (size == k) ? heap[0].score : -1;
+    double bound = 0;
+    int pivot, pivot_file;
+
+    // The first file whose bounds could beat the k-th best
+    for (pivot = 0; pivot < num_terms; pivot++) {
+      bound += terms[pivot]->bound;
+      if (bound > threshold) {
+        break;
+      }
+    }
+    if (pivot == num_terms) {
+      break;
+    }
+    pivot_file = terms[pivot]->file_id;
+    // Include the terms after the pivot that are on the same file
+    while (pivot + 1 < num_terms && terms[pivot + 1]->file_id == pivot_file) {
+      pivot++;
+    }
+
+    if (terms[0]->file_id == pivot_file) {
+      ranked_result_t result;
+      int64_t length = get_file_length(pivot_file);
+
+      result.file_id = pivot_file;
+      result.score = 0;
+      for (i = 0; i <= pivot; i++) {
+        result.score += bm25(terms[i]->idf, terms[i]->count,
+                             length > 0 ? length : stats.min_length,
+                             stats.average_length);
+      }
+      if (size < k) {
+        heap[size] = result;
+        ranked_sift_up(heap, size++);
+      } else if (ranked_worse(&heap[0], &result)) {
+        heap[0] = result;
+        ranked_sift_down(heap, size, 0);
+      }
+      // Everything on this file moves on, the first term last
+      for (i = pivot; i >= 0; i--) {
+        ranked_advance(terms, &num_terms, i, pivot_file + 1);
+      }
+    } else {
+      // Catch the terms before the pivot up with it, they skip whole files
+      for (i = pivot - 1; i >= 0; i--) {
+        if (terms[i]->file_id < pivot_file) {
+          ranked_advance(terms, &num_terms, i, pivot_file);
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < num_words; i++) {
+    close_index_cursor(&storage[i].cursor);
+  }
+
+  // Pop worst first, report best first
+  for (i = size - 1; i >= 0; i--) {
+    ranked_result_t worst = heap[0];
+    heap[0] = heap[i];
+    ranked_sift_down(heap, i, 0);
+    heap[i] = worst;
+  }
+  for (i = 0; i < size; i++) {
+    hit(arg, heap[i].file_id, heap[i].score);
+  }
+
+  free(storage);
+  free(terms);
+  free(heap);
+  return(size);
+}
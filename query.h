@@ -0,0 +1,57 @@
+#ifndef __QUERY_H_537__
+#define __QUERY_H_537__
+
+//
+// Boolean queries: terms joined by AND, OR and NOT, e.g. "a AND b NOT c OR d".
+// NOT means AND NOT and binds like AND; AND binds tighter than OR, so a
+// query is an OR of clauses, each a conjunction of terms with optional
+// exclusions. Queries match either lines (both words on the same line of a
+// file) or whole files.
+//
+// A phrase query ("a b c") is a single clause whose terms must appear next
+// to each other, in order, on one line. It needs a positional index.
+//
+#define QUERY_MAX_TERMS 32
+
+typedef enum query_granularity_e {
+  QUERY_LINES,
+  QUERY_FILES,
+  QUERY_PHRASE
+} query_granularity_t;
+
+typedef struct query_term_s {
+  char * word;
+  int negated;
+  int clause;
+  int offset;
+} query_term_t;
+
+typedef struct query_s {
+  query_granularity_t granularity;
+  int num_terms;
+  int num_clauses;
+  query_term_t terms[QUERY_MAX_TERMS];
+} query_t;
+
+// Called once per match, in (file id, line number) order. line_number is 0
+// for QUERY_FILES. A line matching a phrase more than once is reported once.
+typedef void (*query_hit_t)(void * arg, int file_id, int line_number);
+
+int is_query_operator(const char * word);
+int parse_query(query_t * query, char ** words, int num_words,
+                query_granularity_t granularity);
+int parse_phrase(query_t * query, char * phrase);
+int run_query(query_t * query, int file_id, query_hit_t hit, void * arg);
+int run_union(char ** words, int num_words, int file_id, query_hit_t hit, void * arg);
+
+//
+// Ranked retrieval: the k files that score best by BM25 for the words, best
+// first. Ties go to the lower file id.
+//
+#define BM25_K1 1.2
+#define BM25_B 0.75
+
+typedef void (*ranked_hit_t)(void * arg, int file_id, double score);
+int run_ranked(char ** words, int num_words, int k, ranked_hit_t hit, void * arg);
+
+#endif // __QUERY_H_537__
@@ -5,61 +5,103 @@
 #include <pthread.h>
 #include <assert.h>
 #include <semaphore.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include "index.h"
+#include "tokenizer.h"
+#include "query.h"
+#include "cache.h"
+#include "server.h"
+#include "workqueue.h"
+#include "crawler.h"
+#include "filestate.h"
 
 // #define DEBUG
 // #define LOCKS
 // #define VERBOSE
-#define BOUNDED_BUFFER_SIZE 32
-
-typedef struct bounded_buffer_s {
-	char ** buffer;
-	int fill;
-	int use;
-	int count;
-	int done;
-	int size; 
-} Bounded_Buffer; 
-typedef Bounded_Buffer * bounded_buffer_t; 
-
-typedef struct mutex_cond {
-	pthread_mutex_t bb_mutex;
-	pthread_cond_t empty;
-	pthread_cond_t full; 
-} Mutex_Cond; 
-Mutex_Cond mutex_cond; 
+// File ids queued between the scanner and the indexers
+#define DEFAULT_QUEUE_DEPTH 32
+// File ids moved through the queue at a time
+#define SCANNER_BATCH 16
+#define INDEXER_BATCH 64
+// Bytes of files an indexer takes from the queue at a time, unless it is
+// all in one file
+#define INDEXER_BUDGET (1024 * 1024)
+// Threads walking the directories given with --crawl
+#define DEFAULT_CRAWL_THREADS 4
+// Queued in place of a file id to wake an indexer to help with chunks
+#define CHUNK_WORK -1
+// Files at least twice this big are split between the indexers
+#define FILE_CHUNK_SIZE (16 * 1024 * 1024)
+// Query results cache, 0 turns it off
+#define DEFAULT_CACHE_MEGABYTES 64
+// Queries read ahead of the oldest one not yet written out
+#define QUERY_WINDOW 1024
+
+// A big file being indexed in newline-aligned chunks. Chunks are handed out
+// from the list of chunked files (next_chunk, under chunks_lock) and merged
+// into the index strictly in order (under lock) by whoever finds the next
+// one staged, adding up their newlines to get each chunk's line offset.
+typedef struct tag_file_chunks {
+    struct tag_file_chunks *next;
+    int file_id;
+    mapped_file_t file;
+    int num_chunks;
+    size_t *bounds;
+    int next_chunk;
+    pthread_mutex_t lock;
+    index_staging_t **staged;
+    int *num_lines;
+    int next_merge;
+    int line_offset;
+    int merging;
+    int error;
+} File_Chunks;
 
 typedef struct tag_args {
     int num_indexer_threads;
     const char *file_list_name;
+    const char *save_index_name;
+    const char *load_index_name;
+    const char *query_file_name;
+    const char *socket_name;
+    int positions;
+    long cache_megabytes;
+    int num_query_threads;
+    int queue_depth;
+    const char **crawl_roots;
+    int num_crawl_roots;
+    int num_crawl_threads;
+    crawl_options_t crawl_options;
+    int scanning;
 } Args;
 Args args;
 
 typedef struct tag_info {
     FILE *file_list;
-    bounded_buffer_t bbp; 
+    work_queue_t *work_queue;
+    pthread_mutex_t chunks_lock;
+    pthread_cond_t chunks_posted;
+    int busy_indexers;
     pthread_t scanner_thread;
     pthread_t collector_thread;
     pthread_t *indexer_threads;
-    pthread_mutex_t scanner_mutex;
-    int scan_complete;
+    File_Chunks *chunked_files;
+    File_Chunks *last_chunked_file;
     int files_indexed;
+    int num_loaded_files;
+    char *loaded_file_listed;
+    query_cache_t *query_cache;
+    FILE *query_file;
+    file_states_t *file_states;
 } Info;
 Info info;
 
-
-struct stringnode {
-    char* string;
-    struct stringnode* next;
-};
-
-struct stringnode* indexedfilelist;
-struct stringnode* endofindexedfilelist;
-char* searchfor;
-int indexcomplete;
-pthread_mutex_t filelistlock;
-pthread_cond_t  searchcomplete;
+int dictionarybuilt;
+pthread_mutex_t dictionarylock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  dictionaryready;
 
 
 void parseArgs(int argc, char *argv[]);
@@ -67,12 +109,19 @@ void initialize();
 void startScanner();
 void startIndexers();
 void startThreadCollector();
+void loadIndex();
+int isUnchanged(int file_id, const char *filename);
 void startSearch();
+void startServer();
 void cleanup();
 
-void addToFileList(char* filename);
+void setFileState(const char *filename, file_state_t state);
+void promoteFile(const char *filename);
+void finishedlisting();
 void finishedindexing();
 int waitUntilFileIsIndexed(char* filename);
+void buildTermDictionary(int num_threads);
+void waitUntilDictionaryIsBuilt();
 
 
 // ----------------------------------------------------------------------------
@@ -82,74 +131,61 @@ int main(int argc, char *argv[]) {
     parseArgs(argc, argv);
 
     initialize();
-    startScanner();
-    startIndexers();
-    startThreadCollector();
-    startSearch();
+    if (args.positions && enable_index_positions()) {
+        fprintf(stderr, "Failed to enable positional index.\n");
+        exit(1);
+    }
+    if (args.load_index_name != NULL) {
+        loadIndex();
+    }
+    // Without files to scan everything is in the snapshot, nothing to index
+    if (args.scanning) {
+        startScanner();
+        startIndexers();
+        startThreadCollector();
+    }
+    if (args.socket_name != NULL) {
+        startServer();
+    } else {
+        startSearch();
+    }
     cleanup();
     return 0;
 }
 
 
 //-----------------------------------------------------------------------------
-void initMutexStruct() {
-	memset(&mutex_cond, 0, sizeof(Mutex_Cond));
-
-    // Initialize buffer mutex and condition vars
-	if (pthread_mutex_init(&mutex_cond.bb_mutex, NULL)) {
-        fprintf(stderr, "Failed to initialize bounded buffer mutex.\n");
-        exit(1);
-    }
-	if (pthread_cond_init(&mutex_cond.empty, NULL)) {
-        fprintf(stderr, "Failed to initialize empty condition variable.\n");
-        exit(1);
-    }
-    if (pthread_cond_init(&mutex_cond.full, NULL)) {
-        fprintf(stderr, "Failed to initialize full condition variable.\n");
+void initWorkQueue() {
+    // File ids from the scanner to the indexers
+    info.work_queue = create_work_queue(args.queue_depth);
+    if (info.work_queue == NULL) {
+        fprintf(stderr, "Failed to allocate work queue.\n");
         exit(1);
     }
 
-    // Initialize scanner mutex
-    if (pthread_mutex_init(&info.scanner_mutex, NULL)) {
-        fprintf(stderr, "Failed to initialize scanner mutex.\n");
+    // Chunks of big files are handed out separately
+    if (pthread_mutex_init(&info.chunks_lock, NULL) ||
+        pthread_cond_init(&info.chunks_posted, NULL)) {
+        fprintf(stderr, "Failed to initialize chunk list mutex.\n");
         exit(1);
     }
-}
-
-//-----------------------------------------------------------------------------
-void initBoundedBuffer() {
-    // Allocate and initialize the Bounded_Buffer struct
-    info.bbp = (Bounded_Buffer *) malloc(sizeof(Bounded_Buffer));
-    memset(info.bbp, 0, sizeof(Bounded_Buffer));
-    info.bbp->size = BOUNDED_BUFFER_SIZE;
-
-    // Allocate and initialize the buffer
-    info.bbp->buffer = (char **) malloc(sizeof(char *) * BOUNDED_BUFFER_SIZE);
-    for (int i = 0; i < BOUNDED_BUFFER_SIZE; ++i) {
-        info.bbp->buffer[i] = (char *) malloc(sizeof(char) * MAXPATH);
-        // TODO : is this supposed to be MAXPATH + 2 for \n\0 ?
-        memset(info.bbp->buffer[i], 0, MAXPATH);
-    }
 #ifdef DEBUG
-    printf("info.bbp->buffer = %p\n", info.bbp->buffer);
-	printf("info.bbp->fill  = %d\n", info.bbp->fill);
-	printf("info.bbp->use   = %d\n", info.bbp->use);
-	printf("info.bbp->count = %d\n", info.bbp->count);
-	printf("info.bbp->done  = %d\n", info.bbp->done);
-	printf("info.bbp->size  = %d\n", info.bbp->size);
+    printf("work queue depth = %d\n", args.queue_depth);
 #endif
 }
 
 //-----------------------------------------------------------------------------
 void initAdvSearchLocks() {
     // Initialize search helper vars
-    indexedfilelist = NULL;
-    endofindexedfilelist = NULL;
-    searchfor = NULL;
-    indexcomplete = 0;
+    dictionarybuilt = 0;
 
-    // Initialize adv. search mutex
-    if (pthread_cond_init(&searchcomplete, NULL)) {
+    // Advanced searches wait on the file they name
+    info.file_states = create_file_states(promoteFile);
+    if (info.file_states == NULL) {
+        fprintf(stderr, "Failed to allocate file states.\n");
+        exit(1);
+    }
+    if (pthread_cond_init(&dictionaryready, NULL)) {
         perror("pthread_cond_init");
         exit(1);
     }
@@ -162,29 +198,153 @@ void initialize() {
         exit(1);
     }
 
-    initBoundedBuffer();
-	initMutexStruct(); 
+    initWorkQueue();
     initAdvSearchLocks();	
+
+    // Without a cache every query is simply run
+    if (args.cache_megabytes > 0) {
+        info.query_cache = create_query_cache((size_t) args.cache_megabytes << 20);
+        if (info.query_cache == NULL) {
+            fprintf(stderr, "Failed to allocate query cache.\n");
+            exit(1);
+        }
+    }
 }
 
 // ----------------------------------------------------------------------------
 void usage() {
-    fprintf(stderr, "Usage: search-index <num-indexer-threads> <file-list>\n");
+    fprintf(stderr, "Usage: search-index [--load-index <index-file>] [--save-index <index-file>]\n");
+    fprintf(stderr, "                    [--positions] [--cache-size <megabytes>]\n");
+    fprintf(stderr, "                    [--queue-depth <n>]\n");
+    fprintf(stderr, "                    [--queries <query-file> | --listen <socket>]\n");
+    fprintf(stderr, "                    [--query-threads <n>] <num-indexer-threads> <file-list>\n");
+    fprintf(stderr, "       search-index [options as above] --crawl <dir> [--crawl <dir> ...]\n");
+    fprintf(stderr, "                    [--include <glob> ...] [--exclude <glob> ...]\n");
+    fprintf(stderr, "                    [--crawl-threads <n>] <num-indexer-threads>\n");
+    fprintf(stderr, "       search-index --load-index <index-file> [--cache-size <megabytes>]\n");
+    fprintf(stderr, "                    [--queries <query-file> | --listen <socket>]\n");
+    fprintf(stderr, "                    [--query-threads <n>]\n");
     exit(1);
 }
 
 // ----------------------------------------------------------------------------
 void parseArgs(int argc, char *argv[]) {
-    // Enough args?
-    if (argc != 3) {
+    int i = 1;
+    memset(&args, 0, sizeof(Args));
+    memset(&info, 0, sizeof(Info));
+    args.cache_megabytes = DEFAULT_CACHE_MEGABYTES;
+    args.num_query_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    args.queue_depth = DEFAULT_QUEUE_DEPTH;
+    args.num_crawl_threads = DEFAULT_CRAWL_THREADS;
+
+    // Repeatable options, there can't be more of each than arguments
+    args.crawl_roots = (const char **) calloc(argc, sizeof(char *));
+    args.crawl_options.include = (const char **) calloc(argc, sizeof(char *));
+    args.crawl_options.exclude = (const char **) calloc(argc, sizeof(char *));
+    if (args.crawl_roots == NULL || args.crawl_options.include == NULL ||
+        args.crawl_options.exclude == NULL) {
+        fprintf(stderr, "Failed to allocate memory for arguments.\n");
+        exit(1);
+    }
+
+    // Options come before the positional arguments
+    while (i < argc && !strncmp(argv[i], "--", 2)) {
+        if (!strcmp(argv[i], "--positions")) {
+            args.positions = 1;
+            i += 1;
+            continue;
+        }
+        if (i + 1 == argc) {
+            usage();
+        }
+        if (!strcmp(argv[i], "--save-index")) {
+            args.save_index_name = argv[i + 1];
+        } else if (!strcmp(argv[i], "--load-index")) {
+            args.load_index_name = argv[i + 1];
+        } else if (!strcmp(argv[i], "--cache-size")) {
+            char *end;
+            args.cache_megabytes = strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || args.cache_megabytes < 0) {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--queries")) {
+            args.query_file_name = argv[i + 1];
+        } else if (!strcmp(argv[i], "--listen")) {
+            args.socket_name = argv[i + 1];
+        } else if (!strcmp(argv[i], "--queue-depth")) {
+            char *end;
+            args.queue_depth = strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || args.queue_depth < 1) {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--crawl")) {
+            args.crawl_roots[args.num_crawl_roots++] = argv[i + 1];
+        } else if (!strcmp(argv[i], "--include")) {
+            args.crawl_options.include[args.crawl_options.num_include++] = argv[i + 1];
+        } else if (!strcmp(argv[i], "--exclude")) {
+            args.crawl_options.exclude[args.crawl_options.num_exclude++] = argv[i + 1];
+        } else if (!strcmp(argv[i], "--crawl-threads")) {
+            char *end;
+            args.num_crawl_threads = strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || args.num_crawl_threads < 1) {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--query-threads")) {
+            char *end;
+            args.num_query_threads = strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || args.num_query_threads < 1) {
+                usage();
+            }
+        } else {
+            usage();
+        }
+        i += 2;
+    }
+
+    // Queries come from stdin unless a file of them is given, or clients
+    if (args.query_file_name != NULL && args.socket_name != NULL) {
+        usage();
+    }
+    info.query_file = stdin;
+    if (args.query_file_name != NULL) {
+        info.query_file = fopen(args.query_file_name, "r");
+        if (info.query_file == NULL) {
+            char buf[MAXPATH];
+            snprintf(buf, sizeof(buf), "fopen('%s')", args.query_file_name);
+            perror(buf);
+            exit(1);
+        }
+    }
+
+    // A loaded index keeps whatever kind of postings it was saved with
+    if (args.positions && args.load_index_name != NULL) {
+        usage();
+    }
+
+    // Globs only make sense for a crawl
+    if (args.num_crawl_roots == 0 &&
+        (args.crawl_options.num_include > 0 || args.crawl_options.num_exclude > 0)) {
+        usage();
+    }
+
+    // A loaded index without files to scan is searched as is, with some it
+    // is brought up to date with them
+    if (args.load_index_name != NULL && i == argc && args.num_crawl_roots == 0) {
+        if (args.save_index_name != NULL) {
+            usage();
+        }
+        return;
+    }
+
+    // Enough args? Crawled directories take the place of the file list
+    if (argc - i != (args.num_crawl_roots > 0 ? 1 : 2)) {
         usage();
     }
+    args.scanning = 1;
 
     // Parse argument strings
-    memset(&args, 0, sizeof(Args));
     // TODO : use strtol instead of atoi
-    args.num_indexer_threads = atoi(argv[1]);
-    args.file_list_name = argv[2];
+    args.num_indexer_threads = atoi(argv[i]);
 
     // Validate number of threads
     if (args.num_indexer_threads < 1) {
@@ -192,45 +352,225 @@ void parseArgs(int argc, char *argv[]) {
         exit(1);
     }
 
+    // Validate crawled directories
+    for (int root = 0; root < args.num_crawl_roots; ++root) {
+        struct stat st;
+        int error = stat(args.crawl_roots[root], &st) ? errno :
+                    !S_ISDIR(st.st_mode) ? ENOTDIR : 0;
+        if (error) {
+            fprintf(stderr, "%s: %s\n", args.crawl_roots[root], strerror(error));
+            exit(1);
+        }
+    }
+
     // Validate files list
-    memset(&info, 0, sizeof(Info));
-    info.file_list = fopen(args.file_list_name, "r");
-    if (info.file_list == NULL) {
-        char buf[MAXPATH];
-        memset(buf, 0, sizeof(buf));
-        sprintf(buf, "fopen('%s')", args.file_list_name);
-        perror(buf);
-        exit(1);
+    if (args.num_crawl_roots == 0) {
+        args.file_list_name = argv[i + 1];
+        info.file_list = fopen(args.file_list_name, "r");
+        if (info.file_list == NULL) {
+            char buf[MAXPATH];
+            memset(buf, 0, sizeof(buf));
+            sprintf(buf, "fopen('%s')", args.file_list_name);
+            perror(buf);
+            exit(1);
+        }
     }
 
 #ifdef DEBUG
     printf("Args: num indexer threads = %d\n", args.num_indexer_threads);
-    printf("Args: file list name = '%s'\n", args.file_list_name);
+    if (args.file_list_name != NULL) {
+        printf("Args: file list name = '%s'\n", args.file_list_name);
+    } else {
+        printf("Args: crawling %d directories with %d threads\n",
+               args.num_crawl_roots, args.num_crawl_threads);
+    }
 #endif
 }
 
 // ----------------------------------------------------------------------------
 // Scanner related ------------------------------------------------------------
 // ----------------------------------------------------------------------------
-void add_to_buffer(char * filename) {
-    // Copy the specified filename into the bounded buffer
-    strcpy(info.bbp->buffer[info.bbp->fill], filename);
-    // Update fill index and buffer count
-	info.bbp->fill = (info.bbp->fill + 1) % info.bbp->size;
-	info.bbp->count++;
+// True if the file still has the size, mtime and inode it was indexed with
+int isUnchanged(int file_id, const char *filename) {
+    file_stamp_t indexed, current;
+    if (get_file_stamp(file_id, &indexed) || stamp_file(filename, &current, 0)) {
+        return 0;
+    }
+    return indexed.size == current.size && indexed.mtime == current.mtime &&
+           indexed.inode == current.inode;
+}
+
+// ----------------------------------------------------------------------------
+// File ids listed but not yet in the work queue. Files are listed as fast
+// as they are found, not as fast as the indexers take them, so that a
+// search waiting on a file far down the list can have it promoted; the ids
+// go on to the queue whenever there is room. Files bigger than an indexer
+// batch go biggest first, so one listed last does not leave every other
+// indexer idle at the end while one works through it. The rest keep their
+// listed order: ids handed out of order make the index insert postings in
+// the middle of its lists rather than append them.
+typedef struct tag_backlog_entry {
+    int file_id;
+    unsigned int size;
+} Backlog_Entry;
+
+// A heap, see goesBefore()
+typedef struct tag_scan_backlog {
+    Backlog_Entry *entries;
+    int num_entries;
+    int size;
+    int since_feed;
+} Scan_Backlog;
+
+// Big files by size, then everything else by id
+int goesBefore(Backlog_Entry a, Backlog_Entry b) {
+    unsigned int a_big = a.size > INDEXER_BUDGET ? a.size : 0;
+    unsigned int b_big = b.size > INDEXER_BUDGET ? b.size : 0;
+    return a_big != b_big ? a_big > b_big : a.file_id < b.file_id;
+}
+
+void addToBacklog(Scan_Backlog *backlog, int file_id, unsigned int size) {
+    if (backlog->num_entries == backlog->size) {
+        backlog->size = backlog->size ? 2 * backlog->size : 1024;
+        backlog->entries = (Backlog_Entry *) realloc(backlog->entries,
+                                                     backlog->size * sizeof(Backlog_Entry));
+        if (backlog->entries == NULL) {
+            fprintf(stderr, "Failed to allocate memory for scanner backlog.\n");
+            exit(1);
+        }
+    }
+
+    // Sift up from the bottom
+    Backlog_Entry entry = { file_id, size };
+    int i = backlog->num_entries++;
+    while (i > 0 && goesBefore(entry, backlog->entries[(i - 1) / 2])) {
+        backlog->entries[i] = backlog->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    backlog->entries[i] = entry;
+}
+
+Backlog_Entry takeFromBacklog(Scan_Backlog *backlog) {
+    Backlog_Entry top = backlog->entries[0];
+    Backlog_Entry last = backlog->entries[--backlog->num_entries];
+
+    // Sift the last one down from the top
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= backlog->num_entries) {
+            break;
+        }
+        if (child + 1 < backlog->num_entries &&
+            goesBefore(backlog->entries[child + 1], backlog->entries[child])) {
+            child++;
+        }
+        if (!goesBefore(backlog->entries[child], last)) {
+            break;
+        }
+        backlog->entries[i] = backlog->entries[child];
+        i = child;
+    }
+    backlog->entries[i] = last;
+    return top;
+}
+
+// Moves backlogged ids to the work queue a batch at a time, with their
+// sizes for the indexers to budget by: as many as fit every SCANNER_BATCH
+// files listed or, at the end of the scan, all of them
+void feedIndexers(Scan_Backlog *backlog, int all) {
+    int file_ids[SCANNER_BATCH];
+    unsigned int sizes[SCANNER_BATCH];
+
+    if (!all && ++backlog->since_feed < SCANNER_BATCH) {
+        return;
+    }
+    backlog->since_feed = 0;
+    while (backlog->num_entries > 0) {
+        int n = 0;
+        while (n < SCANNER_BATCH && backlog->num_entries > 0) {
+            Backlog_Entry entry = takeFromBacklog(backlog);
+            file_ids[n] = entry.file_id;
+            sizes[n++] = entry.size;
+        }
+        if (all) {
+            work_queue_push(info.work_queue, file_ids, sizes, n);
+            continue;
+        }
+
+        // Whatever does not fit waits for the next time
+        int pushed = work_queue_try_push(info.work_queue, file_ids, sizes, n);
+        for (int i = pushed; i < n; ++i) {
+            addToBacklog(backlog, file_ids[i], sizes[i]);
+        }
+        if (pushed < n) {
+            break;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Registers a listed or crawled file and backlogs it if it needs indexing.
+// Called from every crawler thread at once, each with its own backlog.
+void queueFile(char *filename, Scan_Backlog *backlog) {
+    // A file listed twice is only indexed once
+    if (get_file_state(info.file_states, filename) != FILE_UNLISTED) {
+        return;
+    }
+
+    // Intern the path once, everything downstream refers to it by id
+    int file_id = register_file(filename);
+    if (file_id < 0) {
+        fprintf(stderr, "Failed to register file '%s'.\n", filename);
+        setFileState(filename, FILE_FAILED);
+        return;
+    }
+
+    // Files that came with a loaded index are only queued if they changed
+    if (file_id < info.num_loaded_files) {
+        info.loaded_file_listed[file_id] = 1;
+        if (isUnchanged(file_id, filename)) {
+            setFileState(filename, FILE_INDEXED);
+            return;
+        }
+        file_stamp_t stamp;
+        if (get_file_stamp(file_id, &stamp) != 0) {
+            // Never fully indexed, drop what it has and start over
+            file_id = replace_file(file_id);
+            if (file_id < 0) {
+                fprintf(stderr, "Failed to register file '%s'.\n", filename);
+                setFileState(filename, FILE_FAILED);
+                return;
+            }
+        }
+    }
+    setFileState(filename, FILE_QUEUED);
+
+    // Sized now to be scheduled by size, one that is gone fails later
+    file_stamp_t current;
+    uint64_t size = stamp_file(filename, &current, 0) == 0 ? current.size : 0;
+
+#ifdef DEBUG
+    printf("[%.8x scanner] queueing '%s' (%llu bytes) as file %d\n", pthread_self(), filename,
+           (unsigned long long) size, file_id);
+#endif
+    addToBacklog(backlog, file_id, size > UINT_MAX ? UINT_MAX : (unsigned int) size);
+    feedIndexers(backlog, 0);
 }
 
 // ----------------------------------------------------------------------------
 // Scan files from file list
-void* scannerWorker(void *data) {
+void scanFileList() {
     // Allocate space for a filename + path
 	char *line;
+    Scan_Backlog backlog;
+    memset(&backlog, 0, sizeof(backlog));
 	if((line = malloc(MAXPATH * sizeof(char))) == NULL) {
 		fprintf(stderr, "Failed to allocate memory for file path.\n");
 		exit(1);
 	}
 
-    // Get filenames from files list and add to bounded buffer
+    // Get filenames from files list and queue them for the indexers
 	while (NULL != fgets(line, MAXPATH, info.file_list)) {
         // Chomp newline from file path
 		if (line[strlen(line) - 1] == '\n')
@@ -238,55 +578,75 @@ void* scannerWorker(void *data) {
 #ifdef DEBUG
         printf("[%.8x scanner] got line '%s' from file list.\n", pthread_self(), line);
 #endif
+        queueFile(line, &backlog);
+	}
+    feedIndexers(&backlog, 1);
+    free(backlog.entries);
 
-#ifdef LOCKS
-        printf("[%.8x scanner] locking buffer mutex...\n", pthread_self());
-#endif
-        // Lock and wait on empty condition if neccessary 
-		if (pthread_mutex_lock(&mutex_cond.bb_mutex)) {
-            perror("pthread_mutex_lock()");
-        }
-		while (info.bbp->count == BOUNDED_BUFFER_SIZE) {
-#ifdef LOCKS
-            printf("[%.8x scanner] waiting on buffer empty condition...\n", pthread_self());
+#ifdef DEBUG
+    printf("[%.8x scanner] finished fetching lines from '%s'.\n", pthread_self(), args.file_list_name);
 #endif
-			pthread_cond_wait(&mutex_cond.empty, &mutex_cond.bb_mutex); 
-		}
+    fclose(info.file_list);
+    free(line);
+}
+
+// ----------------------------------------------------------------------------
+// Crawl sink, queues a file found by one of the crawler threads (each has
+// its own backlog) or, at the end, whatever that thread still has backlogged
+static int queueCrawledFile(void *data, int worker, const char *path) {
+    Scan_Backlog *backlog = (Scan_Backlog *) data + worker;
+    if (path == NULL) {
+        feedIndexers(backlog, 1);
+        free(backlog->entries);
+        return 0;
+    }
+    queueFile((char *) path, backlog);
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Scan files from the crawled directories, queueing them as they are found
+void crawlDirectories() {
+    Scan_Backlog *backlogs = (Scan_Backlog *) calloc(args.num_crawl_threads, sizeof(Scan_Backlog));
+    if (backlogs == NULL) {
+        fprintf(stderr, "Failed to allocate memory for crawler backlogs.\n");
+        exit(1);
+    }
 
+    int error = crawl_directories(args.crawl_roots, args.num_crawl_roots,
+                                  args.num_crawl_threads, &args.crawl_options,
+                                  queueCrawledFile, backlogs);
+    if (error) {
+        fprintf(stderr, "Failed to crawl directories: %s\n", strerror(-error));
+        exit(1);
+    }
 #ifdef DEBUG
-        printf("[%.8x scanner] add_to_buffer[%d] '%s'\n", pthread_self(), info.bbp->fill, line);
+    printf("[%.8x scanner] finished crawling %d directories.\n", pthread_self(), args.num_crawl_roots);
 #endif
-        // Add filename + path to bounded buffer
-		add_to_buffer(line);
+    free(backlogs);
+}
 
-#ifdef LOCKS
-        printf("[%.8x scanner] signalling full condition...\n", pthread_self());
-#endif
-        // Signal full condition and unlock
-		pthread_cond_signal(&mutex_cond.full);
+// ----------------------------------------------------------------------------
+// Scan files from the file list or the crawled directories
+void* scannerWorker(void *data) {
+    if (args.num_crawl_roots > 0) {
+        crawlDirectories();
+    } else {
+        scanFileList();
+    }
 
-#ifdef LOCKS
-        printf("[%.8x scanner] unlocking buffer mutex...\n", pthread_self());
-#endif
-		if (pthread_mutex_unlock(&mutex_cond.bb_mutex)) {
-            perror("pthread_mutex_unlock()");
+    // Loaded files that are no longer listed are gone from the index
+    for (int file_id = 0; file_id < info.num_loaded_files; ++file_id) {
+        if (!info.loaded_file_listed[file_id]) {
+            remove_file(file_id);
         }
-	}
+    }
 
-#ifdef DEBUG
-    printf("[%.8x scanner] finished fetching lines from '%s'.\n", pthread_self(), args.file_list_name);
-#endif
-    fclose(info.file_list);
+    // Searches for files that were not listed need not wait any longer
+    finishedlisting();
 
-#ifdef LOCKS
-    printf("[%.8x scanner] locking scanner mutex.\n", pthread_self());
-#endif
-    pthread_mutex_lock(&info.scanner_mutex);
-    info.scan_complete = 1;
-#ifdef LOCKS
-    printf("[%.8x scanner] unlocking scanner mutex.\n", pthread_self());
-#endif
-    pthread_mutex_unlock(&info.scanner_mutex);
+    // Indexers run until the queue is drained once it is closed
+    work_queue_close(info.work_queue);
 	
     return NULL;
 }
@@ -309,112 +669,307 @@ void startScanner() {
 // ----------------------------------------------------------------------------
 // Indexer related ------------------------------------------------------------
 // ----------------------------------------------------------------------------
-char* get_from_buffer() {
-    // Get a filename from the bounded buffer
-	char * file = info.bbp->buffer[info.bbp->use];
-#ifdef DEBUG
-    printf("[%.8x indexer] get_from_buffer[%d] '%s'\n", pthread_self(), info.bbp->use, file);
+// Token sink for tokenize_file, stages one word for the current file
+static int stageWord(void *staging, const char *word, int length, int line_number,
+                     int position) {
+#ifdef VERBOSE 
+    printf("[%.8x indexer] staging '%.*s'...\n", pthread_self(), length, word);
 #endif
-    // Update use index and buffer count
-	info.bbp->use = (info.bbp->use + 1) % info.bbp->size; 
-	info.bbp->count--;
-	return file; 
+    return insert_into_staging((index_staging_t *) staging, word, length, line_number,
+                               position);
 }
 
 // ----------------------------------------------------------------------------
-//Read files from list produced by scanner, add words to hash table
-void* indexerWorker(void *data) {
-    GetNext: // Get the next element from the bounded buffer
-#ifdef LOCKS
-    printf("[%.8x indexer] locking buffer mutex...\n", pthread_self());
+// Maps a big file and cuts it into chunks for several indexers to share.
+// Returns NULL for anything not worth splitting, which is indexed whole.
+File_Chunks* splitFile(int file_id, const char *filename) {
+    file_stamp_t stamp;
+    if (args.num_indexer_threads < 2 || stamp_file(filename, &stamp, 0) ||
+        stamp.size < 2 * FILE_CHUNK_SIZE) {
+        return NULL;
+    }
+
+    File_Chunks *chunks = (File_Chunks *) calloc(1, sizeof(File_Chunks));
+    if (chunks == NULL || map_file(filename, &chunks->file)) {
+        free(chunks);
+        return NULL;
+    }
+    int max_chunks = chunks->file.size / FILE_CHUNK_SIZE + 1;
+    chunks->bounds = (size_t *) calloc(max_chunks + 1, sizeof(size_t));
+    chunks->staged = (index_staging_t **) calloc(max_chunks, sizeof(index_staging_t *));
+    chunks->num_lines = (int *) calloc(max_chunks, sizeof(int));
+    if (chunks->bounds == NULL || chunks->staged == NULL || chunks->num_lines == NULL ||
+        pthread_mutex_init(&chunks->lock, NULL)) {
+        fprintf(stderr, "Failed to allocate memory for file chunks.\n");
+        exit(1);
+    }
+    chunks->file_id = file_id;
+    chunks->num_chunks = split_mapped_file(&chunks->file, FILE_CHUNK_SIZE, chunks->bounds,
+                                           max_chunks);
+#ifdef DEBUG
+    printf("[%.8x indexer] split '%s' into %d chunks.\n", pthread_self(), filename,
+           chunks->num_chunks);
 #endif
-    // Lock and wait on full condition if neccessary 
-	pthread_mutex_lock(&mutex_cond.bb_mutex);
-    while (info.bbp->count == 0) {
-        // See if there are no more files to scan, if so, exit this indexer thread
-        if (info.scan_complete && info.bbp->count == 0) {
-            pthread_mutex_unlock(&mutex_cond.bb_mutex);
-#ifdef DEBUG 
-            printf("[%.8x indexer] buffer empty, scan complete, exiting thread...\n", pthread_self());
-#endif 
-            return NULL;
+    return chunks;
+}
+
+// ----------------------------------------------------------------------------
+// After its last chunk is merged the file is done, just like a whole one
+void finishChunkedFile(File_Chunks *chunks) {
+    const char *filename = get_file_name(chunks->file_id);
+    file_stamp_t stamp;
+
+    unmap_file(&chunks->file, &stamp);
+    if (chunks->error < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(-chunks->error));
+        remove_file(chunks->file_id);
+        setFileState(filename, FILE_FAILED);
+    } else {
+        set_file_stamp(chunks->file_id, &stamp);
+        __sync_fetch_and_add(&info.files_indexed, 1);
+        setFileState(filename, FILE_INDEXED);
+    }
+    pthread_mutex_destroy(&chunks->lock);
+    free(chunks->bounds);
+    free(chunks->staged);
+    free(chunks->num_lines);
+    free(chunks);
+}
+
+// ----------------------------------------------------------------------------
+// Stages one chunk, then merges every chunk that is ready in order unless
+// another indexer is already at it. A staging index left for someone else
+// to merge is theirs to free, so the caller gets a fresh one.
+void indexChunk(File_Chunks *chunks, int chunk, index_staging_t **staging) {
+    int num_lines, error, done = 0, kept = 0;
+
+    error = tokenize_mapped_range(&chunks->file, chunks->bounds[chunk],
+                                  chunks->bounds[chunk + 1], stageWord, *staging,
+                                  &num_lines);
+
+    pthread_mutex_lock(&chunks->lock);
+    if (error < 0) {
+        chunks->error = error;
+    }
+    chunks->staged[chunk] = *staging;
+    chunks->num_lines[chunk] = num_lines;
+    if (!chunks->merging) {
+        chunks->merging = 1;
+        while (chunks->next_merge < chunks->num_chunks &&
+               chunks->staged[chunks->next_merge] != NULL) {
+            int next = chunks->next_merge;
+            index_staging_t *ready = chunks->staged[next];
+            int line_offset = chunks->line_offset;
+            int failed = chunks->error < 0;
+            pthread_mutex_unlock(&chunks->lock);
+
+            // Once a chunk has failed nothing more of the file is published,
+            // and what already was is dropped when it is finished
+            if (failed) {
+                clear_staging_index(ready);
+            } else {
+                merge_chunk_into_index(ready, chunks->file_id, line_offset,
+                                       next == chunks->num_chunks - 1);
+                hash_mapped_range(&chunks->file, chunks->bounds[next], chunks->bounds[next + 1]);
+            }
+            if (ready == *staging) {
+                kept = 1;
+            } else {
+                destroy_staging_index(ready);
+            }
+
+            pthread_mutex_lock(&chunks->lock);
+            chunks->staged[next] = NULL;
+            chunks->line_offset += chunks->num_lines[next];
+            chunks->next_merge++;
         }
-#ifdef LOCKS
-        printf("[%.8x indexer] waiting on buffer full condition...\n", pthread_self());
-#endif
-		pthread_cond_wait(&mutex_cond.full, &mutex_cond.bb_mutex);
-	}
+        chunks->merging = 0;
+        done = (chunks->next_merge == chunks->num_chunks);
+    }
+    pthread_mutex_unlock(&chunks->lock);
 
-    // Get the next filename + path from the bounded buffer
-	char *filename = get_from_buffer();
-#ifdef LOCKS
-    printf("[%.8x indexer] signalling empty condition...\n", pthread_self(), filename);
-#endif 
-    // Signalling empty condition
-	pthread_cond_signal(&mutex_cond.empty);
+    if (done) {
+        finishChunkedFile(chunks);
+    }
+    if (!kept) {
+        *staging = create_staging_index();
+        if (*staging == NULL) {
+            fprintf(stderr, "Failed to allocate staging index.\n");
+            exit(1);
+        }
+    }
+}
 
-#ifdef LOCKS
-    printf("[%.8x indexer] unlocking buffer mutex...\n", pthread_self());
-#endif 
-    // Unlocking buffer mutex
-	pthread_mutex_unlock(&mutex_cond.bb_mutex);
+// ----------------------------------------------------------------------------
+// Takes the next chunk of a big file if there is one. The list is checked
+// without the lock first, as it is empty nearly all of the time.
+int takeChunk(index_staging_t **staging) {
+    if (info.chunked_files == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&info.chunks_lock);
+    File_Chunks *chunks = info.chunked_files;
+    if (chunks == NULL) {
+        pthread_mutex_unlock(&info.chunks_lock);
+        return 0;
+    }
+    int chunk = chunks->next_chunk++;
+    if (chunks->next_chunk == chunks->num_chunks) {
+        info.chunked_files = chunks->next;
+    }
+    pthread_mutex_unlock(&info.chunks_lock);
+
+    indexChunk(chunks, chunk, staging);
+    return 1;
+}
+
+// ----------------------------------------------------------------------------
+// Indexes one file from the queue into the shared index
+void indexFile(int file_id, index_staging_t **staging) {
+	const char *filename = get_file_name(file_id);
+    file_stamp_t stamp, indexed;
 
 #ifdef DEBUG
-    printf("[%.8x indexer] opening file '%s'...\n", pthread_self(), filename);
+    printf("[%.8x indexer] indexing file '%s'...\n", pthread_self(), filename);
 #endif 
-    // Open filename from buffer and read lines
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        char buf[MAXPATH + 2];
-        memset(buf, 0, MAXPATH + 2);
-        sprintf(buf, "fopen('%s')", filename);
-        perror(buf);
-    } else {
-#ifdef DEBUG
-        printf("[%.8x indexer] file '%s' opened.\n", pthread_self(), filename);
-#endif
+    // Already taken if a search had it promoted
+    if (claim_file(info.file_states, filename)) {
+        return;
     }
 
-    int line_number = 1;
-    char *line = NULL;
-    size_t len = 0;
-    size_t read;
+    // Indexed before, but touched since: only redo it if the contents changed
+    if (get_file_stamp(file_id, &indexed) == 0) {
+        if (stamp_file(filename, &stamp, 1) == 0 &&
+            stamp.size == indexed.size && stamp.hash == indexed.hash) {
+            set_file_stamp(file_id, &stamp);
+            __sync_fetch_and_add(&info.files_indexed, 1);
+            setFileState(filename, FILE_INDEXED);
+            return;
+        }
+        // New postings go under a new id, the old ones are dropped
+        file_id = replace_file(file_id);
+        if (file_id < 0) {
+            fprintf(stderr, "%s: %s\n", filename, strerror(-file_id));
+            setFileState(filename, FILE_FAILED);
+            return;
+        }
+    }
 
-    // Get a new line (of arbitrary length) from the file
-    while ((read = getline(&line, &len, file)) != -1) {
-#ifdef DEBUG
-        printf("[%.8x indexer] line of length %zu retreived\n\t'%s'\n", pthread_self(), read, line);
-#endif
-        // Tokenize the line into words to be inserted into index
-        char *saveptr;
-        char *word = strtok_r(line, " \n\t-_!@#$%^&*()[]{}:;_+=,./<>?", &saveptr);
-        while (word != NULL) {
-#ifdef VERBOSE 
-            printf("[%.8x indexer] checking if '%s' is already in index...\n", pthread_self(), word);
-#endif
-            // Insert word into index (if not already in index)
-            insert_into_index(word, filename, line_number);
-            word = strtok_r(NULL, " \n\t-_!@#$%^&*()[]{}:;_+=,./<>?", &saveptr);
+    // Big files are shared out in chunks, this indexer takes the first and
+    // wakes as many idle ones as there are chunks left
+    File_Chunks *chunks = splitFile(file_id, filename);
+    if (chunks != NULL && chunks->num_chunks > 1) {
+        pthread_mutex_lock(&info.chunks_lock);
+        chunks->next_chunk = 1;
+        if (info.chunked_files == NULL) {
+            info.chunked_files = chunks;
+        } else {
+            info.last_chunked_file->next = chunks;
+        }
+        info.last_chunked_file = chunks;
+        pthread_cond_broadcast(&info.chunks_posted);
+        pthread_mutex_unlock(&info.chunks_lock);
+        for (int i = 1; i < chunks->num_chunks; ++i) {
+            int wake = CHUNK_WORK;
+            if (work_queue_try_push(info.work_queue, &wake, NULL, 1) == 0) {
+                // Full, so nobody is idle
+                break;
+            }
         }
-        ++line_number;
+    }
+    if (chunks != NULL) {
+        indexChunk(chunks, 0, staging);
+        return;
     }
 
-    // Cleanup memory for getline
-    free(line);
+    // Map (or chunk-read) the file and stage every word found in it
+    int error = tokenize_file(filename, stageWord, *staging, &stamp);
+    if (error < 0) {
+        // Nothing of a file that failed is published
+        fprintf(stderr, "%s: %s\n", filename, strerror(-error));
+        clear_staging_index(*staging);
+    } else {
+        // Publish everything found in this file to the shared index at once
+        merge_into_index(*staging, file_id);
+    }
 
 #ifdef DEBUG
     printf("[%.8x indexer] done indexing file '%s'.\n", pthread_self(), filename);
 #endif 
-    // Cleanup file
-    fclose(file);
-    // Update list of files indexed
-    // TODO : lock me?
-    info.files_indexed++;
-	addToFileList(filename);
+    // Let searches waiting for this file go ahead
+    if (error == 0) {
+        set_file_stamp(file_id, &stamp);
+        __sync_fetch_and_add(&info.files_indexed, 1);
+        setFileState(filename, FILE_INDEXED);
+    } else {
+        setFileState(filename, FILE_FAILED);
+    }
+}
 
-    // Go grab the next file to index from the buffer
-    goto GetNext;
+// ----------------------------------------------------------------------------
+// Called once the queue is closed and drained. Another indexer may still be
+// in the middle of a file from it that it is about to split, so this one
+// only gives up once nobody is busy any more; returns 1 if chunks turned
+// up in the meantime.
+int waitForChunks() {
+    pthread_mutex_lock(&info.chunks_lock);
+    info.busy_indexers--;
+    pthread_cond_broadcast(&info.chunks_posted);
+    while (info.chunked_files == NULL && info.busy_indexers > 0) {
+        pthread_cond_wait(&info.chunks_posted, &info.chunks_lock);
+    }
+    int more = (info.chunked_files != NULL);
+    if (more) {
+        info.busy_indexers++;
+    }
+    pthread_mutex_unlock(&info.chunks_lock);
+    return more;
+}
+
+// ----------------------------------------------------------------------------
+//Read files from list produced by scanner, add words to hash table
+void* indexerWorker(void *data) {
+    int batch[INDEXER_BATCH];
+    int num_batch = 0, next = 0;
+
+    // Words are collected here privately and merged into the index per file
+    index_staging_t *staging = create_staging_index();
+    if (staging == NULL) {
+        fprintf(stderr, "Failed to allocate staging index.\n");
+        exit(1);
+    }
+
+    for (;;) {
+        // Help with a big file already started before taking on another one
+        if (takeChunk(&staging)) {
+            continue;
+        }
+
+        // Get the next few file ids from the queue, up to a budget in bytes
+        if (next == num_batch) {
+            next = 0;
+            num_batch = work_queue_pop(info.work_queue, batch, INDEXER_BATCH, INDEXER_BUDGET);
+            if (num_batch == 0 && !waitForChunks()) {
+                break;
+            }
+            // Wake-ups for chunks beyond the first are for other indexers
+            for (int i = 0, seen = 0; i < num_batch; ++i) {
+                if (batch[i] == CHUNK_WORK && seen++) {
+                    work_queue_try_push(info.work_queue, &batch[i], NULL, 1);
+                }
+            }
+            continue;
+        }
+        if (batch[next] != CHUNK_WORK) {
+            indexFile(batch[next], &staging);
+        }
+        next++;
+    }
 
+#ifdef DEBUG 
+    printf("[%.8x indexer] queue drained, scan complete, exiting thread...\n", pthread_self());
+#endif 
+    destroy_staging_index(staging);
     return NULL;
 }
 
@@ -430,10 +985,15 @@ void startIndexers() {
         exit(1);
     }
 
-    // Create all the indexer threads
+    // Create all the indexer threads, each busy until it runs out of work
+    info.busy_indexers = args.num_indexer_threads;
 	for (int i = 0; i < args.num_indexer_threads; ++i) {
 		if (pthread_create(&info.indexer_threads[i], NULL, indexerWorker, NULL)) {
             fprintf(stderr, "Failed to create indexer thread #%d.\n", i);
+            pthread_mutex_lock(&info.chunks_lock);
+            info.busy_indexers--;
+            pthread_cond_broadcast(&info.chunks_posted);
+            pthread_mutex_unlock(&info.chunks_lock);
         } else {
 #ifdef DEBUG
             printf("[%.8x main] created indexer thread #%d.\n", pthread_self(), i);
@@ -478,8 +1038,20 @@ void* threadCollector(void *threadptr) {
 	finishedindexing();
 
 #ifdef DEBUG
-	printf("Indexing complete = %d.\n", indexcomplete);
+	printf("Indexing complete.\n");
 #endif
+
+    // Prefix and pattern searches wait for this, so it goes before the save
+    buildTermDictionary(args.num_indexer_threads);
+
+    // Searches keep going while the snapshot is written
+    if (args.save_index_name != NULL) {
+        int error = save_index(args.save_index_name);
+        if (error < 0) {
+            fprintf(stderr, "Failed to save index to '%s': %s\n",
+                    args.save_index_name, strerror(-error));
+        }
+    }
 	return NULL; 
 }
 
@@ -499,70 +1071,512 @@ void startThreadCollector() {
 	}
 }
 
+// ----------------------------------------------------------------------------
+// Map a saved index. Without a file list all of its indexed files are ready
+// to search, with one the scanner decides which of them are still current.
+void loadIndex() {
+    int num_files = load_index(args.load_index_name);
+    if (num_files < 0) {
+        fprintf(stderr, "Failed to load index from '%s': %s\n",
+                args.load_index_name,
+                num_files == -EINVAL ? "not a valid index file" : strerror(-num_files));
+        exit(1);
+    }
+
+    if (args.scanning) {
+        info.num_loaded_files = num_files;
+        info.loaded_file_listed = (char *) calloc(num_files + 1, sizeof(char));
+        if (info.loaded_file_listed == NULL) {
+            fprintf(stderr, "Failed to allocate memory for loaded file list.\n");
+            exit(1);
+        }
+        return;
+    }
+
+    file_stamp_t stamp;
+    for (int file_id = 0; file_id < num_files; ++file_id) {
+        if (get_file_stamp(file_id, &stamp) == 0) {
+            setFileState(get_file_name(file_id), FILE_INDEXED);
+        }
+    }
+    finishedindexing();
+    buildTermDictionary(sysconf(_SC_NPROCESSORS_ONLN));
+}
+
 // ----------------------------------------------------------------------------
 // Search related -------------------------------------------------------------
 // ----------------------------------------------------------------------------
-void doBasicSearch(char * word) {
+void doBasicSearch(char * word, FILE *out) {
 #ifdef DEBUG
 	printf("input: '%s'\n", word); 
 #endif
 
-    // Search for word in index and report results
-	index_search_results_t *results = find_in_index(word);
-	if (results) {
-        // Print found for each result
-		for (int i = 0; i < results->num_results; ++i) {
-			index_search_elem_t *result = &results->results[i];
-			printf("FOUND: %s %d\n", result->file_name, result->line_number);
-		}
+    // Stream results straight out of the index postings
+    index_cursor_t cursor;
+    int count = 0;
+    if (open_index_cursor(&cursor, word) == 0) {
+        int file_id, line_number, last_file_id = -1;
+        const char *filename = NULL;
+
+        // Print found for each result, resolving each file name once
+        while (index_cursor_next(&cursor, &file_id, &line_number)) {
+            if (file_id != last_file_id) {
+                filename = get_file_name(file_id);
+                last_file_id = file_id;
+            }
+            fprintf(out, "FOUND: %s %d\n", filename, line_number);
+            ++count;
+        }
+    }
+    close_index_cursor(&cursor);
 
-#ifdef DEBUG
-		printf("%d results found...\n", results->num_results);
-#endif
-	} else {
+    if (count == 0) {
         // No results found for word
-		printf("Word not found\n");
+		fprintf(out, "Word not found\n");
 	}
+#ifdef DEBUG
+    printf("%d results found...\n", count);
+#endif
 }
 
 // ----------------------------------------------------------------------------
-void doAdvancedSearch(char * filename, char * word) {
+void doAdvancedSearch(char * filename, char * word, FILE *out) {
     // If file hasn't been indexed yet, wait to complete search until it is
     if (-1 == waitUntilFileIsIndexed(filename)) {
         // Indexing complete, specified file not found
-        printf("ERROR: File <%s> not found\n", filename);
+        fprintf(out, "ERROR: File <%s> not found\n", filename);
         return;
     }
 
 #ifdef DEBUG
     printf("input: '%s' '%s'\n", filename, word); 
 #endif
+    int file_id = find_file(filename);
+
+    // Stream results for the word in the specified file only
+    index_cursor_t cursor;
+    int count = 0;
+    if (open_index_file_cursor(&cursor, word, file_id) == 0) {
+        int result_file_id, line_number;
+        while (index_cursor_next(&cursor, &result_file_id, &line_number)) {
+            fprintf(out, "FOUND: %s %d\n", filename, line_number);
+            ++count;
+        }
+    }
+    close_index_cursor(&cursor);
+
+    // Not found in specified file
+    if (count == 0) {
+        fprintf(out, "Word not found\n");
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Where the matches of a query go, and whether they are files or lines
+typedef struct tag_query_output {
+    FILE *out;
+    query_granularity_t granularity;
+} QueryOutput;
+
+// Prints one match of a boolean query
+static void printQueryHit(void *arg, int file_id, int line_number) {
+    QueryOutput *output = (QueryOutput *) arg;
+    if (output->granularity == QUERY_FILES) {
+        fprintf(output->out, "FOUND: %s\n", get_file_name(file_id));
+    } else {
+        fprintf(output->out, "FOUND: %s %d\n", get_file_name(file_id), line_number);
+    }
+}
 
-    // Search for word in index and report results
-    index_search_results_t *results = find_in_index(word);
-    if (results) {
-        int count = 0;
-        // Check through all results for specified filename
-        for (int i = 0; i < results->num_results; ++i) {
-            index_search_elem_t *result = &results->results[i];
-
-            // Report results only for specified filename
-            if(!strcmp(filename, result->file_name)){
-                printf("FOUND: %s %d\n", result->file_name, result->line_number);
-                ++count;
+// ----------------------------------------------------------------------------
+// Boolean search: "[FILES | <file>] term (AND|OR|NOT term)*". FILES reports
+// matching files instead of lines, a file name restricts it to that file.
+void doBooleanSearch(char **words, int num_words, FILE *out) {
+    QueryOutput output = { out, QUERY_LINES };
+    int file_id = -1;
+    query_t query;
+
+    // Terms and operators alternate, so an even count has a scope in front
+    if (num_words % 2 == 0) {
+        if (!strcmp(words[0], "FILES")) {
+            output.granularity = QUERY_FILES;
+        } else {
+            if (-1 == waitUntilFileIsIndexed(words[0])) {
+                fprintf(out, "ERROR: File <%s> not found\n", words[0]);
+                return;
             }
+            file_id = find_file(words[0]);
+        }
+        ++words;
+        --num_words;
+    }
+
+    if (parse_query(&query, words, num_words, output.granularity)) {
+        fprintf(out, "ERROR: Bad input\n");
+        return;
+    }
+    if (run_query(&query, file_id, printQueryHit, &output) <= 0) {
+        fprintf(out, "Word not found\n");
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Phrase search: '[<file>] "w1 w2 ..."' finds lines holding the words next to
+// each other and in order, in any file or only in the given one.
+void doPhraseSearch(char *line, char *open_quote, FILE *out) {
+    QueryOutput output = { out, QUERY_PHRASE };
+    char *close_quote = strchr(open_quote + 1, '"');
+    char *scope, *rest;
+    int file_id = -1;
+    query_t query;
+
+    // Nothing may follow the phrase, at most a file name may precede it
+    *open_quote = '\0';
+    scope = strtok_r(line, " \t", &rest);
+    if (close_quote == NULL || strspn(close_quote + 1, " \t") != strlen(close_quote + 1) ||
+        (scope != NULL && strtok_r(NULL, " \t", &rest) != NULL)) {
+        fprintf(out, "ERROR: Bad input\n");
+        return;
+    }
+    *close_quote = '\0';
+    if (parse_phrase(&query, open_quote + 1)) {
+        fprintf(out, "ERROR: Bad input\n");
+        return;
+    }
+    if (!index_has_positions()) {
+        fprintf(out, "ERROR: Phrase search needs an index built with --positions\n");
+        return;
+    }
+
+    if (scope != NULL) {
+        if (-1 == waitUntilFileIsIndexed(scope)) {
+            fprintf(out, "ERROR: File <%s> not found\n", scope);
+            return;
+        }
+        file_id = find_file(scope);
+    }
+    if (run_query(&query, file_id, printQueryHit, &output) <= 0) {
+        fprintf(out, "Word not found\n");
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Prefix, pattern and range searches expand to the words in the term
+// dictionary: "foo*" and "f?o*" are shell-style patterns, "apple..banana" is
+// every word between the two (either side may be left open). None of these
+// characters can appear in an indexed word. "~word" and "word~N" are fuzzy,
+// matching words within N edits (by default 1, or 2 for words over 5 bytes).
+#define MAX_FUZZY_DISTANCE 3
+
+// Edit distance of a fuzzy query, or -1 if word is not one
+int fuzzyDistance(const char *word) {
+    size_t length = strlen(word);
+
+    if (length > 2 && word[length - 2] == '~' &&
+        word[length - 1] >= '1' && word[length - 1] <= '0' + MAX_FUZZY_DISTANCE) {
+        return word[length - 1] - '0';
+    }
+    if (length > 1 && word[0] == '~') {
+        return (length - 1 > 5) ? 2 : 1;
+    }
+    return -1;
+}
+
+int isTermPattern(const char *word) {
+    return strpbrk(word, "*?[") != NULL || strstr(word, "..") != NULL ||
+           fuzzyDistance(word) > 0;
+}
+
+typedef struct tag_term_list {
+    char **words;
+    int num_words;
+    int max_words;
+} TermList;
+
+static int collectTerm(void *arg, const char *word) {
+    TermList *list = (TermList *) arg;
+    if (list->num_words == list->max_words) {
+        list->max_words = list->max_words ? 2 * list->max_words : 64;
+        list->words = (char **) realloc(list->words, list->max_words * sizeof(char *));
+        if (list->words == NULL) {
+            fprintf(stderr, "Failed to allocate memory for matching words.\n");
+            exit(1);
         }
+    }
+    list->words[list->num_words++] = strdup(word);
+    return 0;
+}
+
+// Lines holding any word that matches the pattern, optionally in one file
+void doTermSearch(char *filename, char *pattern, FILE *out) {
+    QueryOutput output = { out, QUERY_LINES };
+    TermList list;
+    char *range = strstr(pattern, "..");
+    int distance = fuzzyDistance(pattern);
+    int file_id = -1, found;
+
+    if (filename != NULL) {
+        if (-1 == waitUntilFileIsIndexed(filename)) {
+            fprintf(out, "ERROR: File <%s> not found\n", filename);
+            return;
+        }
+        file_id = find_file(filename);
+    }
 
-        // Not found in specified file
-        if (count == 0) {
-            printf("Word not found\n");
+    // The dictionary only exists once all files are in
+    waitUntilDictionaryIsBuilt();
+    memset(&list, 0, sizeof(TermList));
+    if (distance > 0) {
+        // Cut the '~' off whichever end it is on
+        size_t length = strlen(pattern);
+        if (length > 2 && pattern[length - 2] == '~' && pattern[length - 1] - '0' == distance) {
+            pattern[length - 2] = '\0';
+        } else {
+            ++pattern;
         }
+        found = find_terms_near(pattern, distance, collectTerm, &list);
+    } else if (range != NULL) {
+        *range = '\0';
+        found = find_terms_in_range(*pattern ? pattern : NULL,
+                                    *(range + 2) ? range + 2 : NULL, collectTerm, &list);
+    } else {
+        found = find_terms_matching(pattern, collectTerm, &list);
+    }
+    if (found < 0) {
+        fprintf(out, "ERROR: Term dictionary not available\n");
+    } else if (found == 0 ||
+               run_union(list.words, list.num_words, file_id, printQueryHit, &output) <= 0) {
+        fprintf(out, "Word not found\n");
+    }
+
+    for (int i = 0; i < list.num_words; ++i) {
+        free(list.words[i]);
+    }
+    free(list.words);
+}
+
+// ----------------------------------------------------------------------------
+// Prints one file of a ranked search
+static void printRankedHit(void *out, int file_id, double score) {
+    fprintf((FILE *) out, "FOUND: %s %.4f\n", get_file_name(file_id), score);
+}
+
+// Ranked search: "TOP <k> w1 w2 ..." lists the k files that best match the
+// words by BM25, best first.
+#define MAX_TOP_K 1000
+
+void doRankedSearch(char **words, int num_words, FILE *out) {
+    char *end;
+    long k = strtol(words[1], &end, 10);
+
+    if (*end != '\0' || k < 1 || k > MAX_TOP_K) {
+        fprintf(out, "ERROR: Bad input\n");
+        return;
+    }
+    for (int i = 2; i < num_words; ++i) {
+        if (is_query_operator(words[i])) {
+            fprintf(out, "ERROR: Bad input\n");
+            return;
+        }
+    }
+    if (run_ranked(words + 2, num_words - 2, (int) k, printRankedHit, out) <= 0) {
+        fprintf(out, "Word not found\n");
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Runs one (normalized) query line, writing its results to out
+void runQuery(char *line, FILE *out) {
+    // Words of the current query, enough for the longest boolean query
+    int MAX_WORDS = 2 * QUERY_MAX_TERMS + 1;
+    char* words[MAX_WORDS + 1];
+    int num_words;
+    char *rest;
+
+    // Quotes make it a phrase, which is split up by the query parser
+    char *quote = strchr(line, '"');
+    if (quote != NULL) {
+        doPhraseSearch(line, quote, out);
+        return;
+    }
+
+    // Split the query into words, one more than allowed flags it as too long
+    num_words = 0;
+    for (char *word = strtok_r(line, " \t\n", &rest); word != NULL && num_words <= MAX_WORDS;
+         word = strtok_r(NULL, " \t\n", &rest)) {
 #ifdef DEBUG
-        printf("%d results found before filtering by filename...\n", results->num_results);
+        printf("word%d = '%s'\n", num_words + 1, word);
 #endif
-    } else {
-        printf("Word not found\n");
-    }	
+        words[num_words++] = word;
+    }
+
+    // Do the proper search (basic/adv./boolean) depending on how many search terms
+    if (num_words == 1 && isTermPattern(words[0])) {
+        doTermSearch(NULL, words[0], out);
+    } else if (num_words == 1) {
+        doBasicSearch(words[0], out);
+    } else if (num_words == 2 && isTermPattern(words[1])) {
+        doTermSearch(words[0], words[1], out);
+    } else if (num_words == 2) {
+        doAdvancedSearch(words[0], words[1], out);
+    } else if (num_words > 2 && num_words <= MAX_WORDS && !strcmp(words[0], "TOP")) {
+        doRankedSearch(words, num_words, out);
+    } else if (num_words > 2 && num_words <= MAX_WORDS &&
+               is_query_operator(words[num_words - 2])) {
+        doBooleanSearch(words, num_words, out);
+    } else if (num_words > 2) {
+        fprintf(out, "ERROR: Bad input\n");
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Query with blanks squeezed to single spaces and trimmed, as the cache key
+void normalizeQuery(const char *line, char *key) {
+    char *end = key;
+    for (; *line; ++line) {
+        if (*line == ' ' || *line == '\t' || *line == '\n') {
+            if (end != key && end[-1] != ' ') {
+                *end++ = ' ';
+            }
+        } else {
+            *end++ = *line;
+        }
+    }
+    if (end != key && end[-1] == ' ') {
+        --end;
+    }
+    *end = '\0';
+}
+
+// Generation of the index a query's result depends on. Plain words only
+// depend on their own postings (and on files being replaced or removed);
+// phrases, patterns and rankings depend on everything.
+uint64_t queryGeneration(const char *key) {
+    char words[strlen(key) + 1];
+    uint64_t generation = 0;
+    char *rest;
+
+    if (strchr(key, '"') != NULL || !strncmp(key, "TOP ", 4)) {
+        return get_index_generation();
+    }
+    strcpy(words, key);
+    for (char *word = strtok_r(words, " ", &rest); word != NULL;
+         word = strtok_r(NULL, " ", &rest)) {
+        if (isTermPattern(word)) {
+            return get_index_generation();
+        }
+        generation += get_term_generation(word);
+    }
+    return generation;
+}
+
+// ----------------------------------------------------------------------------
+// Answers one query line on out, from the cache when it has a current result.
+// The generation is taken before the query runs, so a result that raced with
+// indexing is cached as already stale.
+void answerQuery(const char *line, FILE *out) {
+    char key[strlen(line) + 1], query[strlen(line) + 1];
+    uint64_t generation = 0;
+    char *result;
+    size_t length;
+
+    normalizeQuery(line, key);
+    if (info.query_cache != NULL) {
+        generation = queryGeneration(key);
+        if (query_cache_get(info.query_cache, key, generation, &result, &length) == 0) {
+            fwrite(result, 1, length, out);
+            free(result);
+            return;
+        }
+    }
+
+    strcpy(query, key);
+    FILE *buffer = (info.query_cache != NULL) ? open_memstream(&result, &length) : NULL;
+    if (buffer == NULL) {
+        runQuery(query, out);
+        return;
+    }
+    runQuery(query, buffer);
+    fclose(buffer);
+    fwrite(result, 1, length, out);
+    query_cache_put(info.query_cache, key, generation, result, length);
+    free(result);
+}
+
+// ----------------------------------------------------------------------------
+// Concurrent queries ---------------------------------------------------------
+// Queries are read into a window of slots and answered by a pool of threads
+// in whatever order they finish. Whichever thread finishes the oldest query
+// still unwritten writes it out, along with every later one that is ready,
+// so results come out in input order. Reading stops while the window is full.
+// ----------------------------------------------------------------------------
+typedef struct tag_query_slot {
+    char *line;
+    char *result;
+    size_t length;
+    int answered;
+} QuerySlot;
+
+typedef struct tag_query_executor {
+    pthread_mutex_t lock;
+    pthread_cond_t pending;
+    pthread_cond_t room;
+    QuerySlot slots[QUERY_WINDOW];
+    long num_read;
+    long num_taken;
+    long num_written;
+    int done;
+} QueryExecutor;
+
+// Answers queries until the input is exhausted and none are left
+void* queryWorker(void *data) {
+    QueryExecutor *executor = (QueryExecutor *) data;
+
+    pthread_mutex_lock(&executor->lock);
+    for (;;) {
+        while (executor->num_taken == executor->num_read && !executor->done) {
+            pthread_cond_wait(&executor->pending, &executor->lock);
+        }
+        if (executor->num_taken == executor->num_read) {
+            break;
+        }
+        QuerySlot *slot = &executor->slots[executor->num_taken++ % QUERY_WINDOW];
+        pthread_mutex_unlock(&executor->lock);
+
+        // The index is only read, so this runs alongside the other workers
+        char *result = NULL;
+        size_t length = 0;
+        FILE *out = open_memstream(&result, &length);
+        if (out == NULL) {
+            perror("open_memstream");
+            exit(1);
+        }
+        answerQuery(slot->line, out);
+        fclose(out);
+
+        pthread_mutex_lock(&executor->lock);
+        slot->result = result;
+        slot->length = length;
+        slot->answered = 1;
+        while (executor->num_written < executor->num_taken) {
+            slot = &executor->slots[executor->num_written % QUERY_WINDOW];
+            if (!slot->answered) {
+                break;
+            }
+            fwrite(slot->result, 1, slot->length, stdout);
+            free(slot->result);
+            free(slot->line);
+            memset(slot, 0, sizeof(QuerySlot));
+            executor->num_written++;
+            pthread_cond_signal(&executor->room);
+        }
+        // Caught up with the input, so someone may be waiting on the answers
+        if (executor->num_written == executor->num_read) {
+            fflush(stdout);
+        }
+    }
+    pthread_mutex_unlock(&executor->lock);
+    return NULL;
 }
 
 // ----------------------------------------------------------------------------
@@ -572,46 +1586,88 @@ void startSearch() {
     int BUFFER_SIZE = 1024;
     char line[BUFFER_SIZE];
     memset(line, 0, sizeof(char) * BUFFER_SIZE);
+    QueryExecutor *executor = NULL;
+    pthread_t *query_threads = NULL;
+
+    // A single query thread is just this one
+    if (args.num_query_threads > 1) {
+        executor = (QueryExecutor *) calloc(1, sizeof(QueryExecutor));
+        query_threads = (pthread_t *) calloc(args.num_query_threads, sizeof(pthread_t));
+        if (executor == NULL || query_threads == NULL) {
+            fprintf(stderr, "Failed to allocate memory for query threads.\n");
+            exit(1);
+        }
+        if (pthread_mutex_init(&executor->lock, NULL) ||
+            pthread_cond_init(&executor->pending, NULL) ||
+            pthread_cond_init(&executor->room, NULL)) {
+            fprintf(stderr, "Failed to initialize query executor.\n");
+            exit(1);
+        }
+        for (int i = 0; i < args.num_query_threads; ++i) {
+            if (pthread_create(&query_threads[i], NULL, queryWorker, executor)) {
+                fprintf(stderr, "Failed to create query thread.\n");
+                exit(1);
+            }
+        }
+    }
 
-    // Setup two words for splitting search input (for adv. search)
-	char* word1 = NULL;
-	char* word2 = NULL;
-
-    // Get a line from stdin to use for search query
-    while (fgets(line, BUFFER_SIZE, stdin)) {
+    // Get a line from the query input to use for search query
+    while (fgets(line, BUFFER_SIZE, info.query_file)) {
         // Chomp newline
 		if(line[strlen(line) - 1] == '\n') {
 			line[strlen(line) - 1] = 0; 
         }
 
-        // Get first word
-		word1 = strtok(line, " \t\n");
-#ifdef DEBUG
-		printf("word1 = '%s'\n", word1);
-#endif
-
-		if (word1 != NULL) {
-            // Get second word
-			word2 = strtok(NULL, " \t\n");	
-#ifdef DEBUG
-			printf("word2 = '%s'\n", word2);
-#endif
-            // Do the proper search (basic/adv.) depending on how many search terms
-            if (word2 == NULL) {
-                doBasicSearch(word1);
-            } else {
-                // Chomp ending whitespace before searching
-                if(strtok(NULL," \t\n") == NULL) {
-                    doAdvancedSearch(word1, word2);
-                } else {
-                    printf("ERROR: Bad input\n");
-                }
+        if (executor == NULL) {
+            answerQuery(line, stdout);
+        } else {
+            char *query = strdup(line);
+            if (query == NULL) {
+                fprintf(stderr, "Failed to allocate memory for query.\n");
+                exit(1);
             }
-		}
+            pthread_mutex_lock(&executor->lock);
+            while (executor->num_read - executor->num_written == QUERY_WINDOW) {
+                pthread_cond_wait(&executor->room, &executor->lock);
+            }
+            executor->slots[executor->num_read++ % QUERY_WINDOW].line = query;
+            pthread_cond_signal(&executor->pending);
+            pthread_mutex_unlock(&executor->lock);
+        }
 
         // Clear input buffer for next search
         memset(line, 0, sizeof(char) * BUFFER_SIZE);
     }
+
+    // Let the workers drain what is left, then join them
+    if (executor != NULL) {
+        pthread_mutex_lock(&executor->lock);
+        executor->done = 1;
+        pthread_cond_broadcast(&executor->pending);
+        pthread_mutex_unlock(&executor->lock);
+        for (int i = 0; i < args.num_query_threads; ++i) {
+            pthread_join(query_threads[i], NULL);
+        }
+        pthread_cond_destroy(&executor->room);
+        pthread_cond_destroy(&executor->pending);
+        pthread_mutex_destroy(&executor->lock);
+        free(query_threads);
+        free(executor);
+    }
+    if (info.query_file != stdin) {
+        fclose(info.query_file);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Answer queries from clients of a local socket until told to stop
+void startServer() {
+    int error = run_query_server(args.socket_name, args.num_query_threads, answerQuery);
+    if (error < 0) {
+        fprintf(stderr, "Failed to serve queries on '%s': %s\n", args.socket_name,
+                strerror(-error));
+        exit(1);
+    }
 }
 
 // ----------------------------------------------------------------------------
@@ -620,118 +1676,104 @@ void cleanup() {
     printf("\n\n---------------------CLEANUP---------------------------\n\n");
 #endif
 
-    // Join the scanner thread
-    pthread_join(info.scanner_thread, NULL);
+    // Nothing was started if a loaded index is searched as is
+    if (args.scanning) {
+        // Join the scanner thread
+        pthread_join(info.scanner_thread, NULL);
 #ifdef DEBUG
-    printf("Scanner thread completed.\n");
+        printf("Scanner thread completed.\n");
 #endif
 
-    // Join collector thread (cleanly exits remaining indexer threads)
-	pthread_join(info.collector_thread, NULL);
+        // Join collector thread (cleanly exits remaining indexer threads)
+        pthread_join(info.collector_thread, NULL);
 #ifdef DEBUG
-    printf("Collector thread completed.\n");
+        printf("Collector thread completed.\n");
 #endif
+    }
 
     // Cleanup memory for indexer threads
     free(info.indexer_threads);
+    free(info.loaded_file_listed);
+    free(args.crawl_roots);
+    free(args.crawl_options.include);
+    free(args.crawl_options.exclude);
+    if (info.query_cache != NULL) {
+        destroy_query_cache(info.query_cache);
+    }
 #ifdef DEBUG
     printf("\n\nTotal files indexed: %d\n", info.files_indexed);
 #endif
 
-    // Cleanup bounded buffer memory
-    for (int i = 0; i < BOUNDED_BUFFER_SIZE; ++i) {
-        free(info.bbp->buffer[i]);
-    }
-    free(info.bbp->buffer);
-    free(info.bbp);
-
-    // Cleanup filename list memory
-	struct stringnode* temp = indexedfilelist;
-	struct stringnode* temp2;
-	while (temp != NULL){
-		free(temp->string);
-		temp2 = temp;
-		temp = temp->next;
-		free(temp2);
-	}
-    free(searchfor);
+    // Cleanup work queue memory
+    if (info.work_queue != NULL) {
+        destroy_work_queue(info.work_queue);
+    }
+    pthread_cond_destroy(&info.chunks_posted);
+    pthread_mutex_destroy(&info.chunks_lock);
 
-    // Cleanup filename list condition variable
-	if (pthread_cond_destroy(&searchcomplete)){
-		perror("pthread_cond_destroy");
-	}	
+    // Cleanup file states, nobody is waiting on them anymore
+    destroy_file_states(info.file_states);
 
     // TODO : cleanup other condition variables and mutexes?
 }
 
 
 // ----------------------------------------------------------------------------
-// Filenames  list related ----------------------------------------------------
-// TODO: comment and stuff
+// File states related -------------------------------------------------------
 // ----------------------------------------------------------------------------
-void addToFileList(char* filename){
-	struct stringnode* newnode = (struct stringnode*)malloc(sizeof(struct stringnode ));
-	if ((newnode->string = strdup(filename)) == NULL){
-		//mem allocation for string failed
-	}
-	newnode->next = NULL;
-	pthread_mutex_lock(&filelistlock);
-	if(indexedfilelist == NULL){
-		indexedfilelist = newnode;
-	}
-	else{
-		endofindexedfilelist->next = newnode;
-	}
-	endofindexedfilelist = newnode;
-	if(searchfor != NULL){
-		if(!strcmp(filename, searchfor)){
-			free(searchfor);
-			searchfor = NULL;
-			pthread_cond_signal(&searchcomplete);
-			pthread_mutex_unlock(&filelistlock);
-		}
-		else{
-			pthread_mutex_unlock(&filelistlock);
-		}
-	}
-	else{
-		pthread_mutex_unlock(&filelistlock);
-	}
+void setFileState(const char *filename, file_state_t state) {
+    if (set_file_state(info.file_states, filename, state)) {
+        fprintf(stderr, "Failed to record state of file '%s'.\n", filename);
+    }
 }
 
-void finishedindexing(){
-	pthread_mutex_lock(&filelistlock);
-	indexcomplete = 1;
-	pthread_cond_signal(&searchcomplete);
-	pthread_mutex_unlock(&filelistlock);
+// A search is waiting on a file that is still waiting its turn, so the next
+// free indexer takes it instead. If the urgent lane is full it just waits.
+void promoteFile(const char *filename) {
+    int file_id = find_file((char *) filename);
+    if (file_id >= 0 && work_queue_push_urgent(info.work_queue, file_id) == 0) {
+#ifdef DEBUG
+        printf("promoted file %d '%s'\n", file_id, filename);
+#endif
+    }
 }
-	
-int waitUntilFileIsIndexed(char* filename){
-	pthread_mutex_lock(&filelistlock);
-	struct stringnode* temp = indexedfilelist;
-	while(temp != NULL){
-		if(!strcmp(filename, temp->string)){
-			pthread_mutex_unlock(&filelistlock);
-			//it has already been indexed
-			return 0;
-		}
-		temp = temp->next;
-	}
 
-	if(indexcomplete){
-		pthread_mutex_unlock(&filelistlock);
-		return -1;
-	}
-	searchfor = strdup(filename);
-	pthread_cond_wait(&searchcomplete, &filelistlock);
-	
-	if (searchfor != NULL){
-		free(searchfor);
-		searchfor = NULL;
-		pthread_mutex_unlock(&filelistlock);
-		return -1;
-	}
-	pthread_mutex_unlock(&filelistlock);
-	return 0;
+// Every file the scanner will ever queue has been queued
+void finishedlisting() {
+    close_file_listing(info.file_states);
 }
 
+void finishedindexing() {
+    finish_file_states(info.file_states);
+}
+
+// Builds the sorted term dictionary and lets waiting searches go ahead,
+// even if it failed (they report it)
+void buildTermDictionary(int num_threads) {
+    int num_terms = build_term_dictionary(num_threads);
+    if (num_terms < 0) {
+        fprintf(stderr, "Failed to build term dictionary: %s\n", strerror(-num_terms));
+    }
+#ifdef DEBUG
+    printf("Term dictionary: %d words.\n", num_terms);
+#endif
+
+    pthread_mutex_lock(&dictionarylock);
+    dictionarybuilt = 1;
+    pthread_cond_broadcast(&dictionaryready);
+    pthread_mutex_unlock(&dictionarylock);
+}
+
+void waitUntilDictionaryIsBuilt() {
+    pthread_mutex_lock(&dictionarylock);
+    while (!dictionarybuilt) {
+        pthread_cond_wait(&dictionaryready, &dictionarylock);
+    }
+    pthread_mutex_unlock(&dictionarylock);
+}
+	
+// Returns 0 once the file is indexed, or -1 if it never will be (failed,
+// or not among the files scanned)
+int waitUntilFileIsIndexed(char* filename) {
+    return wait_for_file(info.file_states, filename);
+}
@@ -0,0 +1,615 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "server.h"
+
+//
+// Only the epoll thread touches a connection, except for the answers to
+// its queries: workers take jobs off the shared queue, fill in the result
+// under the server lock, put the connection on the ready list and kick the
+// eventfd. The epoll thread then moves answers, oldest first, from the
+// connection's job list to its output buffer.
+//
+// Backpressure: a connection stops being read while it has
+// SERVER_MAX_IN_FLIGHT queries unanswered or unwritten, or
+// SERVER_MAX_PENDING bytes of output its client has not read. How often
+// that happened is reported when the connection closes.
+//
+// Same line limit as stdin, longer lines are split like fgets does
+#define SERVER_MAX_LINE 1024
+#define SERVER_MAX_IN_FLIGHT 64
+#define SERVER_MAX_PENDING (1 << 20)
+#define SERVER_MAX_EVENTS 64
+
+typedef struct server_job_s {
+  struct server_job_s * next;         // in the shared queue
+  struct server_job_s * next_answer;  // in its connection, in input order
+  struct server_conn_s * conn;
+  char * result;
+  size_t length;
+  int answered;
+  char line[1];
+} server_job_t;
+
+typedef struct server_conn_s {
+  struct server_conn_s * prev, * next;  // all connections
+  struct server_conn_s * next_ready;
+  struct server_conn_s * next_finished;
+  int fd;
+  int id;
+  int ready;
+  int finished;
+  int read_closed;
+  int throttled;
+  uint32_t events;
+  char input[SERVER_MAX_LINE];
+  size_t input_length;
+  server_job_t * first, * last;
+  int in_flight;
+  char * output;
+  size_t output_length, output_sent, output_size;
+  long num_queries;
+  long num_throttled;
+  size_t peak_pending;
+} server_conn_t;
+
+typedef struct query_server_s {
+  pthread_mutex_t lock;
+  pthread_cond_t pending;
+  server_job_t * queue_head, * queue_tail;
+  server_conn_t * ready;
+  int stopping;
+  int epoll_fd;
+  int listen_fd;
+  int wake_fd;
+  server_conn_t * conns;
+  server_conn_t * finished;
+  int num_conns;
+  query_answer_t answer;
+} query_server_t;
+
+// Written to by the signal handler to stop the server
+static int stop_pipe[2] = { -1, -1 };
+
+// Tags telling the epoll thread's own descriptors from connections
+static char listen_tag, wake_tag, stop_tag;
+
+static void stop_server(int sig)
+{
+  int saved = errno;
+  char c = 0;
+
+  if (write(stop_pipe[1], &c, 1) < 0) {
+    // Nothing to be done about it in a handler
+  }
+  errno = saved;
+}
+
+static void * server_worker(void * data)
+{
+  query_server_t * server = (query_server_t *) data;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&server->lock);
+  for (;;) {
+    while (server->queue_head == NULL && !server->stopping) {
+      pthread_cond_wait(&server->pending, &server->lock);
+    }
+    if (server->stopping) {
+      break;
+    }
+    server_job_t * job = server->queue_head;
+    server->queue_head = job->next;
+    if (server->queue_head == NULL) {
+      server->queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    char * result = NULL;
+    size_t length = 0;
+    FILE * out = open_memstream(&result, &length);
+    if (out != NULL) {
+      server->answer(job->line, out);
+      fclose(out);
+    } else {
+      perror("open_memstream");
+    }
+
+    pthread_mutex_lock(&server->lock);
+    job->result = result;
+    job->length = length;
+    job->answered = 1;
+    if (!job->conn->ready) {
+      job->conn->ready = 1;
+      job->conn->next_ready = server->ready;
+      server->ready = job->conn;
+    }
+    pthread_mutex_unlock(&server->lock);
+    if (write(server->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      perror("write(eventfd)");
+    }
+    pthread_mutex_lock(&server->lock);
+  }
+  pthread_mutex_unlock(&server->lock);
+  return(NULL);
+}
+
+static int create_listener(const char * path)
+{
+  struct sockaddr_un address;
+  int fd;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return(-ENAMETOOLONG);
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return(-errno);
+  }
+  // A socket left behind by an earlier run is in the way
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &address, sizeof(address)) || listen(fd, SOMAXCONN)) {
+    int error = -errno;
+    close(fd);
+    return(error);
+  }
+  return(fd);
+}
+
+static int watch(query_server_t * server, int fd, uint32_t events, void * ptr)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.ptr = ptr;
+  return(epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event));
+}
+
+static void accept_connections(query_server_t * server)
+{
+  static int next_id = 0;
+  int fd;
+
+  while ((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    server_conn_t * conn = (server_conn_t *) calloc(1, sizeof(server_conn_t));
+    if (conn == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->id = next_id++;
+    conn->events = EPOLLIN;
+    if (watch(server, fd, conn->events, conn)) {
+      perror("epoll_ctl");
+      close(fd);
+      free(conn);
+      continue;
+    }
+    conn->next = server->conns;
+    if (server->conns != NULL) {
+      server->conns->prev = conn;
+    }
+    server->conns = conn;
+    server->num_conns++;
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    perror("accept");
+  }
+}
+
+// Drops the descriptor of a connection whose client is gone. The
+// connection itself lives on until its last query is answered.
+static void close_connection(query_server_t * server, server_conn_t * conn)
+{
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+    conn->read_closed = 1;
+  }
+}
+
+static void free_connection(query_server_t * server, server_conn_t * conn)
+{
+  if (conn->num_throttled > 0) {
+    fprintf(stderr, "Connection %d: %ld queries, throttled %ld times, "
+            "at most %zu bytes waiting to be read\n",
+            conn->id, conn->num_queries, conn->num_throttled, conn->peak_pending);
+  }
+  close_connection(server, conn);
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    server->conns = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+  server->num_conns--;
+  // A worker may have put it on the ready list again after collect_ready
+  // took it off, for an answer collect_answers has already moved
+  pthread_mutex_lock(&server->lock);
+  if (conn->ready) {
+    server_conn_t ** link = &server->ready;
+
+    while (*link != conn) {
+      link = &(*link)->next_ready;
+    }
+    *link = conn->next_ready;
+  }
+  pthread_mutex_unlock(&server->lock);
+  while (conn->first != NULL) {
+    server_job_t * job = conn->first;
+    conn->first = job->next_answer;
+    free(job->result);
+    free(job);
+  }
+  free(conn->output);
+  free(conn);
+}
+
+static void submit_query(query_server_t * server, server_conn_t * conn,
+                         const char * line, size_t length)
+{
+  server_job_t * job = (server_job_t *) calloc(1, sizeof(server_job_t) + length);
+
+  if (job == NULL) {
+    perror("calloc");
+    return;
+  }
+  memcpy(job->line, line, length);
+  job->line[length] = '\0';
+  job->conn = conn;
+  if (conn->last != NULL) {
+    conn->last->next_answer = job;
+  } else {
+    conn->first = job;
+  }
+  conn->last = job;
+  conn->in_flight++;
+  conn->num_queries++;
+
+  pthread_mutex_lock(&server->lock);
+  if (server->queue_tail != NULL) {
+    server->queue_tail->next = job;
+  } else {
+    server->queue_head = job;
+  }
+  server->queue_tail = job;
+  pthread_cond_signal(&server->pending);
+  pthread_mutex_unlock(&server->lock);
+}
+
+static inline size_t pending_output(const server_conn_t * conn)
+{
+  return conn->output_length - conn->output_sent;
+}
+
+static inline int is_throttled(const server_conn_t * conn)
+{
+  return conn->in_flight >= SERVER_MAX_IN_FLIGHT || pending_output(conn) >= SERVER_MAX_PENDING;
+}
+
+// Submits the complete lines in the input buffer, as long as the
+// connection is not throttled
+static void split_queries(query_server_t * server, server_conn_t * conn)
+{
+  size_t start = 0;
+
+  while (!is_throttled(conn)) {
+    char * newline = memchr(conn->input + start, '\n', conn->input_length - start);
+    size_t length;
+
+    if (newline != NULL) {
+      length = newline - (conn->input + start);
+      submit_query(server, conn, conn->input + start, length);
+      start += length + 1;
+    } else if (conn->input_length - start == SERVER_MAX_LINE - 1 ||
+               (conn->read_closed && conn->input_length > start)) {
+      length = conn->input_length - start;
+      submit_query(server, conn, conn->input + start, length);
+      start += length;
+    } else {
+      break;
+    }
+  }
+  memmove(conn->input, conn->input + start, conn->input_length - start);
+  conn->input_length -= start;
+}
+
+static void read_queries(query_server_t * server, server_conn_t * conn)
+{
+  for (;;) {
+    split_queries(server, conn);
+    if (conn->read_closed || is_throttled(conn)) {
+      return;
+    }
+
+    // Room for a line and the NUL fgets would have put after it
+    ssize_t n = read(conn->fd, conn->input + conn->input_length,
+                     SERVER_MAX_LINE - 1 - conn->input_length);
+    if (n > 0) {
+      conn->input_length += n;
+    } else if (n == 0) {
+      conn->read_closed = 1;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else if (errno != EINTR) {
+      close_connection(server, conn);
+      return;
+    }
+  }
+}
+
+static void write_output(query_server_t * server, server_conn_t * conn)
+{
+  while (conn->fd >= 0 && pending_output(conn) > 0) {
+    ssize_t n = send(conn->fd, conn->output + conn->output_sent, pending_output(conn),
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n >= 0) {
+      conn->output_sent += n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else if (errno != EINTR) {
+      close_connection(server, conn);
+    }
+  }
+  conn->output_length = conn->output_sent = 0;
+}
+
+static int append_output(server_conn_t * conn, const char * data, size_t length)
+{
+  if (conn->output_length + length > conn->output_size) {
+    size_t size = conn->output_size ? conn->output_size : 4096;
+    char * output;
+
+    while (size < conn->output_length + length) {
+      size *= 2;
+    }
+    output = (char *) realloc(conn->output, size);
+    if (output == NULL) {
+      return(-1);
+    }
+    conn->output = output;
+    conn->output_size = size;
+  }
+  memcpy(conn->output + conn->output_length, data, length);
+  conn->output_length += length;
+  return(0);
+}
+
+// Moves answers, in input order, to the output buffer
+static void collect_answers(query_server_t * server, server_conn_t * conn)
+{
+  pthread_mutex_lock(&server->lock);
+  while (conn->first != NULL && conn->first->answered) {
+    server_job_t * job = conn->first;
+
+    conn->first = job->next_answer;
+    if (conn->first == NULL) {
+      conn->last = NULL;
+    }
+    conn->in_flight--;
+    if (conn->fd >= 0 && (append_output(conn, job->result, job->length) ||
+                          append_output(conn, "\n", 1))) {
+      perror("realloc");
+      close_connection(server, conn);
+    }
+    free(job->result);
+    free(job);
+  }
+  pthread_mutex_unlock(&server->lock);
+  if (pending_output(conn) > conn->peak_pending) {
+    conn->peak_pending = pending_output(conn);
+  }
+}
+
+// Brings a connection up to date after anything happened to it: reads
+// while it may and writes what it can. Once it is done for it is only
+// marked finished, as later events of the same epoll_wait may refer to it.
+static void service_connection(query_server_t * server, server_conn_t * conn)
+{
+  int throttled;
+  uint32_t events;
+
+  if (conn->finished) {
+    return;
+  }
+  if (conn->fd >= 0) {
+    read_queries(server, conn);
+    write_output(server, conn);
+  }
+  if (conn->read_closed && conn->in_flight == 0 &&
+      (conn->fd < 0 || pending_output(conn) == 0)) {
+    conn->finished = 1;
+    conn->next_finished = server->finished;
+    server->finished = conn;
+    return;
+  }
+  // Without a client the queries still being answered are only waited for
+  if (conn->fd < 0) {
+    return;
+  }
+
+  throttled = is_throttled(conn);
+  if (throttled && !conn->throttled) {
+    conn->num_throttled++;
+  }
+  conn->throttled = throttled;
+  events = (throttled || conn->read_closed ? 0 : EPOLLIN) |
+           (pending_output(conn) > 0 ? EPOLLOUT : 0);
+  if (events != conn->events) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = conn;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event)) {
+      perror("epoll_ctl");
+    }
+    conn->events = events;
+  }
+}
+
+static void collect_ready(query_server_t * server)
+{
+  server_conn_t * ready;
+  uint64_t count;
+
+  if (read(server->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror("read(eventfd)");
+  }
+  pthread_mutex_lock(&server->lock);
+  ready = server->ready;
+  server->ready = NULL;
+  for (server_conn_t * conn = ready; conn != NULL; conn = conn->next_ready) {
+    conn->ready = 0;
+  }
+  pthread_mutex_unlock(&server->lock);
+
+  while (ready != NULL) {
+    server_conn_t * conn = ready;
+
+    ready = conn->next_ready;
+    collect_answers(server, conn);
+    service_connection(server, conn);
+  }
+}
+
+static void serve(query_server_t * server)
+{
+  struct epoll_event events[SERVER_MAX_EVENTS];
+
+  for (;;) {
+    int n = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, -1);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      void * ptr = events[i].data.ptr;
+
+      if (ptr == &stop_tag) {
+        return;
+      } else if (ptr == &listen_tag) {
+        accept_connections(server);
+      } else if (ptr == &wake_tag) {
+        collect_ready(server);
+      } else {
+        server_conn_t * conn = (server_conn_t *) ptr;
+
+        // A client that hung up will not read any answers
+        if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+          close_connection(server, conn);
+        }
+        service_connection(server, conn);
+      }
+    }
+    while (server->finished != NULL) {
+      server_conn_t * conn = server->finished;
+
+      server->finished = conn->next_finished;
+      free_connection(server, conn);
+    }
+  }
+}
+
+int run_query_server(const char * path, int num_threads, query_answer_t answer)
+{
+  query_server_t server;
+  struct sigaction action, old_int, old_term;
+  pthread_t * threads;
+  int error = 0;
+
+  memset(&server, 0, sizeof(server));
+  server.answer = answer;
+  server.epoll_fd = server.wake_fd = -1;
+  threads = (pthread_t *) calloc(num_threads, sizeof(pthread_t));
+  if (threads == NULL) {
+    return(-ENOMEM);
+  }
+  server.listen_fd = create_listener(path);
+  if (server.listen_fd < 0) {
+    free(threads);
+    return(server.listen_fd);
+  }
+  if (pipe2(stop_pipe, O_NONBLOCK | O_CLOEXEC) ||
+      (server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+      (server.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+      watch(&server, server.listen_fd, EPOLLIN, &listen_tag) ||
+      watch(&server, server.wake_fd, EPOLLIN, &wake_tag) ||
+      watch(&server, stop_pipe[0], EPOLLIN, &stop_tag)) {
+    error = -errno;
+    goto out;
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_server;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, &old_int);
+  sigaction(SIGTERM, &action, &old_term);
+
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.pending, NULL);
+  for (int i = 0; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, server_worker, &server)) {
+      fprintf(stderr, "Failed to create query server thread.\n");
+      exit(1);
+    }
+  }
+
+  serve(&server);
+
+  // Queries still queued are dropped, those being answered are waited for
+  pthread_mutex_lock(&server.lock);
+  server.stopping = 1;
+  pthread_cond_broadcast(&server.pending);
+  pthread_mutex_unlock(&server.lock);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  while (server.conns != NULL) {
+    free_connection(&server, server.conns);
+  }
+  pthread_cond_destroy(&server.pending);
+  pthread_mutex_destroy(&server.lock);
+  sigaction(SIGINT, &old_int, NULL);
+  sigaction(SIGTERM, &old_term, NULL);
+
+out:
+  if (server.epoll_fd >= 0) {
+    close(server.epoll_fd);
+  }
+  if (server.wake_fd >= 0) {
+    close(server.wake_fd);
+  }
+  if (stop_pipe[0] >= 0) {
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    stop_pipe[0] = stop_pipe[1] = -1;
+  }
+  close(server.listen_fd);
+  unlink(path);
+  free(threads);
+  return(error);
+}
@@ -0,0 +1,24 @@
+#ifndef __SERVER_H_537__
+#define __SERVER_H_537__
+
+#include <stdio.h>
+
+//
+// Query server on a Unix-domain socket. Clients write query lines just as
+// they would on stdin and read back each answer, in the order the queries
+// were sent, followed by an empty line. Any number of clients are served at
+// once: one thread multiplexes the connections with epoll and a pool of
+// worker threads answers the queries. A connection with too many queries
+// in flight or too much output its client has not read yet is not read
+// from until it drains.
+//
+// answer writes the results for one query line to out, and is called from
+// many worker threads at once.
+//
+typedef void (*query_answer_t)(const char * line, FILE * out);
+
+// Serves until SIGINT or SIGTERM. Returns 0, or -errno if the socket could
+// not be set up.
+int run_query_server(const char * path, int num_threads, query_answer_t answer);
+
+#endif // __SERVER_H_537__
@@ -1,27 +1,2177 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <ftw.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "index.h"
+#include "query.h"
+#include "tokenizer.h"
+#include "cache.h"
+#include "server.h"
+#include "workqueue.h"
+#include "crawler.h"
+#include "filestate.h"
 
-int main(int argc, char * argv[])
+//
+// Behavior tests, one group per feature. Every group runs in a process of
+// its own on a freshly initialized index, so groups cannot see each other's
+// files and words, and a crash fails only its group. Run them all with
+// ./test, or some of them by name (./test snapshot boolean). The groups that
+// drive the whole program (they say so below) run ./search-engine, which
+// has to be built first.
+//
+typedef void (*test_group_fn_t)(void);
+
+static int failures;
+static const char * group_name;
+static char scratch[64];
+
+static void check(int ok, const char * what, const char * file, int line)
+{
+  if (!ok) {
+    fprintf(stderr, "%s:%d: %s: check failed: %s\n", file, line, group_name, what);
+    failures++;
+  }
+}
+
+#define CHECK(cond) check((cond) != 0, #cond, __FILE__, __LINE__)
+
+// Runs fn(arg) in a child process, which starts out with whatever index the
+// caller has (a fresh one if it has not touched it yet), and returns
+// whether all its checks passed
+static int in_child(void (*fn)(void *), void * arg)
+{
+  int status;
+  pid_t pid;
+
+  fflush(NULL);
+  pid = fork();
+  if (pid == 0) {
+    failures = 0;
+    fn(arg);
+    fflush(NULL);
+    _exit(failures ? 1 : 0);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+    return(0);
+  }
+  return(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void run_group_fn(void * arg)
+{
+  if (init_index()) {
+    fprintf(stderr, "%s: failed to initialize the index\n", group_name);
+    failures++;
+    return;
+  }
+  ((test_group_fn_t) arg)();
+}
+
+static int run_group(const char * name, test_group_fn_t fn)
+{
+  int ok;
+
+  group_name = name;
+  ok = in_child(run_group_fn, (void *) fn);
+  printf("%-12s %s\n", name, ok ? "ok" : "FAILED");
+  return(ok);
+}
+
+// ----------------------------------------------------------------------------
+// Helpers
+
+// Path of name in this run's scratch directory, in one of a few rotating
+// buffers so that several can be used in one call
+static const char * scratch_path(const char * name)
+{
+  static char paths[8][128];
+  static int next;
+  char * path = paths[next++ % 8];
+
+  snprintf(path, sizeof(paths[0]), "%s/%s", scratch, name);
+  return(path);
+}
+
+static void write_file(const char * path, const char * contents)
+{
+  FILE * file = fopen(path, "w");
+
+  CHECK(file != NULL);
+  if (file != NULL) {
+    fputs(contents, file);
+    fclose(file);
+  }
+}
+
+// Reads a whole file into a NUL-terminated buffer, or returns NULL
+static char * read_file(const char * path, size_t * size)
 {
-  index_search_results_t * results;
-  init_index();
-  insert_into_index("hello", "test.c", 10);
-  insert_into_index("hello", "test.c", 20);
-  insert_into_index("hello", "foo.c", 30);
-  insert_into_index("goodbye", "test.c", 10);
+  FILE * file = fopen(path, "r");
+  char * contents = NULL;
+  size_t length = 0;
+  long end;
 
+  if (file == NULL) {
+    return(NULL);
+  }
+  if (fseek(file, 0, SEEK_END) == 0 && (end = ftell(file)) >= 0 &&
+      fseek(file, 0, SEEK_SET) == 0 && (contents = (char *) malloc(end + 1)) != NULL) {
+    length = fread(contents, 1, end, file);
+    contents[length] = '\0';
+  }
+  fclose(file);
+  if (size != NULL) {
+    *size = length;
+  }
+  return(contents);
+}
+
+// Hits as "file:line" pairs separated by blanks, in the order they came
+typedef struct hits_s {
+  char text[1 << 17];
+  size_t length;
+  int count;
+} hits_t;
+
+static void add_hit(hits_t * hits, const char * format, ...)
+{
+  va_list args;
+
+  if (hits->length > 0 && hits->length < sizeof(hits->text) - 1) {
+    hits->text[hits->length++] = ' ';
+  }
+  va_start(args, format);
+  if (hits->length < sizeof(hits->text)) {
+    int n = vsnprintf(hits->text + hits->length, sizeof(hits->text) - hits->length,
+                      format, args);
+    hits->length += (n > 0) ? n : 0;
+    if (hits->length > sizeof(hits->text)) {
+      hits->length = sizeof(hits->text);
+    }
+  }
+  va_end(args);
+  hits->count++;
+}
 
-  results = find_in_index("hello");
-  if (results) {
-    int i;
+// Every line of word in the index, by file name
+static const char * find_lines(hits_t * hits, char * word)
+{
+  index_search_results_t * results = find_in_index(word);
+  int i;
+
+  memset(hits, 0, sizeof(hits_t));
+  if (results != NULL) {
     for (i = 0; i < results->num_results; i++) {
-      printf("%s: %d\n",
-	     results->results[i].file_name,
-	     results->results[i].line_number);
+      add_hit(hits, "%s:%d", get_file_name(results->results[i].file_id),
+              results->results[i].line_number);
     }
     free(results);
   }
-  find_in_index("goodbye");
+  return(hits->text);
+}
+
+// Writes the scratch paths of the blank-separated names to the file list
+// name and returns its path
+static const char * list_files(const char * name, const char * names)
+{
+  char copy[1024];
+  char * file, * rest;
+  const char * path = scratch_path(name);
+  FILE * list = fopen(path, "w");
+
+  CHECK(list != NULL);
+  if (list == NULL) {
+    return(path);
+  }
+  snprintf(copy, sizeof(copy), "%s", names);
+  for (file = strtok_r(copy, " ", &rest); file != NULL; file = strtok_r(NULL, " ", &rest)) {
+    fprintf(list, "%s\n", scratch_path(file));
+  }
+  fclose(list);
+  return(path);
+}
+
+// Runs ./search-engine with the arguments and returns what it wrote to
+// stdout, or NULL if it could not be run or failed
+static char * run_engine(const char * format, ...)
+{
+  char command[2048], * output = NULL;
+  size_t length = 0, size = 0, n;
+  va_list args;
+  FILE * pipe;
+
+  if (access("./search-engine", X_OK)) {
+    fprintf(stderr, "%s: ./search-engine has to be built first\n", group_name);
+    return(NULL);
+  }
+  n = snprintf(command, sizeof(command), "./search-engine ");
+  va_start(args, format);
+  vsnprintf(command + n, sizeof(command) - n, format, args);
+  va_end(args);
+  strncat(command, " 2> /dev/null", sizeof(command) - strlen(command) - 1);
+
+  if ((pipe = popen(command, "r")) == NULL) {
+    return(NULL);
+  }
+  do {
+    if (length + 4096 + 1 > size) {
+      size = size ? 2 * size : 8192;
+      output = (char *) realloc(output, size);
+      if (output == NULL) {
+        pclose(pipe);
+        return(NULL);
+      }
+    }
+    n = fread(output + length, 1, 4096, pipe);
+    length += n;
+  } while (n > 0);
+  output[length] = '\0';
+  if (pclose(pipe) != 0) {
+    fprintf(stderr, "%s: failed: %s\n", group_name, command);
+    free(output);
+    return(NULL);
+  }
+  return(output);
+}
+
+// ----------------------------------------------------------------------------
+// File registry and the basic word lookup
+
+static void test_registry(void)
+{
+  hits_t hits;
+  int test_c, foo_c;
+
+  test_c = register_file("test.c");
+  foo_c = register_file("foo.c");
+  CHECK(test_c >= 0 && foo_c >= 0 && test_c != foo_c);
+  CHECK(register_file("test.c") == test_c);
+  CHECK(find_file("foo.c") == foo_c);
+  CHECK(find_file("bar.c") == -1);
+  CHECK(!strcmp(get_file_name(test_c), "test.c"));
+
+  insert_into_index("hello", test_c, 10);
+  insert_into_index("hello", test_c, 20);
+  insert_into_index("hello", foo_c, 30);
+  insert_into_index("goodbye", test_c, 10);
+
+  CHECK(!strcmp(find_lines(&hits, "hello"), "test.c:10 test.c:20 foo.c:30"));
+  CHECK(!strcmp(find_lines(&hits, "goodbye"), "test.c:10"));
+  CHECK(find_in_index("missing") == NULL);
+}
+
+// ----------------------------------------------------------------------------
+// Snapshots: save_index and load_index
+
+static void stage_line(index_staging_t * staging, int line_number, const char * text)
+{
+  char copy[256];
+  char * word, * rest;
+  int position = 0;
+
+  snprintf(copy, sizeof(copy), "%s", text);
+  for (word = strtok_r(copy, " ", &rest); word != NULL; word = strtok_r(NULL, " ", &rest)) {
+    CHECK(insert_into_staging(staging, word, strlen(word), line_number, position++) == 0);
+  }
+}
+
+// Indexes a file given as its lines, the way the indexers do
+static int index_lines(const char * name, const char ** lines, int num_lines)
+{
+  index_staging_t * staging = create_staging_index();
+  int file_id = register_file((char *) name);
+  int i;
+
+  CHECK(staging != NULL && file_id >= 0);
+  if (staging == NULL || file_id < 0) {
+    return(-1);
+  }
+  for (i = 0; i < num_lines; i++) {
+    stage_line(staging, i + 1, lines[i]);
+  }
+  CHECK(merge_into_index(staging, file_id) == 0);
+  destroy_staging_index(staging);
+  return(file_id);
+}
+
+static const char * snapshot_a[] = { "alpha beta", "gamma", "alpha alpha" };
+static const char * snapshot_b[] = { "beta", "", "delta alpha" };
+
+static void save_snapshot(void * arg)
+{
+  file_stamp_t stamp = { 100, 12345, 42, 0xfeedface };
+  int a = index_lines("a.txt", snapshot_a, 3);
+  int b = index_lines("b.txt", snapshot_b, 3);
+
+  CHECK(a == 0 && b == 1);
+  CHECK(set_file_stamp(a, &stamp) == 0);
+  CHECK(save_index((const char *) arg) == 0);
+}
+
+static void load_snapshot(void * arg)
+{
+  file_stamp_t stamp;
+  hits_t hits;
+  int c;
+
+  CHECK(load_index((const char *) arg) == 2);
+  CHECK(find_file("a.txt") == 0 && find_file("b.txt") == 1);
+  CHECK(!strcmp(find_lines(&hits, "alpha"), "a.txt:1 a.txt:3 a.txt:3 b.txt:3"));
+  CHECK(!strcmp(find_lines(&hits, "beta"), "a.txt:1 b.txt:1"));
+  CHECK(!strcmp(find_lines(&hits, "delta"), "b.txt:3"));
+  CHECK(find_in_index("missing") == NULL);
+  CHECK(get_file_stamp(0, &stamp) == 0 && stamp.size == 100 && stamp.mtime == 12345 &&
+        stamp.inode == 42 && stamp.hash == 0xfeedface);
+  CHECK(get_file_stamp(1, &stamp) != 0);
+  CHECK(get_file_length(0) == 5 && get_file_length(1) == 3);
+
+  // New files go on top of the mapped ones
+  c = index_lines("c.txt", (const char *[]) { "alpha" }, 1);
+  CHECK(c == 2);
+  CHECK(!strcmp(find_lines(&hits, "alpha"), "a.txt:1 a.txt:3 a.txt:3 b.txt:3 c.txt:1"));
+
+  // A replaced file hides what the snapshot has for it
+  CHECK(replace_file(1) == 3);
+  CHECK(!strcmp(find_lines(&hits, "alpha"), "a.txt:1 a.txt:3 a.txt:3 c.txt:1"));
+  CHECK(find_lines(&hits, "delta")[0] == '\0');
+
+  // Saving again keeps what is still there
+  CHECK(save_index((const char *) arg) == 0);
+}
+
+static void reload_snapshot(void * arg)
+{
+  hits_t hits;
+
+  CHECK(load_index((const char *) arg) == 3);
+  CHECK(!strcmp(find_lines(&hits, "alpha"), "a.txt:1 a.txt:3 a.txt:3 c.txt:1"));
+  CHECK(find_in_index("gamma") != NULL);
+}
+
+static void expect_invalid(void * arg)
+{
+  CHECK(load_index((const char *) arg) == -EINVAL);
+  CHECK(find_file("a.txt") == -1);
+}
+
+// Writes a copy of the snapshot cut to length, with the byte at flip (if
+// not negative) inverted
+static void damage_snapshot(const char * from, const char * to, size_t length, long flip)
+{
+  size_t size;
+  char * contents = read_file(from, &size);
+  FILE * file = fopen(to, "w");
+
+  CHECK(contents != NULL && file != NULL && length <= size);
+  if (contents != NULL && file != NULL) {
+    if (flip >= 0 && (size_t) flip < size) {
+      contents[flip] = ~contents[flip];
+    }
+    fwrite(contents, 1, length, file);
+  }
+  if (file != NULL) {
+    fclose(file);
+  }
+  free(contents);
+}
+
+static void test_snapshot(void)
+{
+  const char * path = scratch_path("snapshot");
+  const char * copy = scratch_path("snapshot.bad");
+  size_t size;
+  char * contents;
+
+  CHECK(in_child(save_snapshot, (void *) path));
+  contents = read_file(path, &size);
+  CHECK(contents != NULL && size > 200);
+  free(contents);
+
+  // Anything wrong with the header or the dictionary is caught on load
+  damage_snapshot(path, copy, size, 0);
+  CHECK(in_child(expect_invalid, (void *) copy));
+  damage_snapshot(path, copy, size, 8);
+  CHECK(in_child(expect_invalid, (void *) copy));
+  damage_snapshot(path, copy, size, 100);
+  CHECK(in_child(expect_invalid, (void *) copy));
+  damage_snapshot(path, copy, size - 1, -1);
+  CHECK(in_child(expect_invalid, (void *) copy));
+  damage_snapshot(path, copy, 16, -1);
+  CHECK(in_child(expect_invalid, (void *) copy));
+  write_file(copy, "");
+  CHECK(in_child(expect_invalid, (void *) copy));
+
+  CHECK(in_child(load_snapshot, (void *) path));
+  CHECK(in_child(reload_snapshot, (void *) path));
+}
+
+// ----------------------------------------------------------------------------
+// Re-indexing only what changed since a loaded snapshot (whole program)
+
+static const char * incremental_queries = "old\nnew\nkept\ngone\ndropped\ncherry\n";
+static const char * incremental_answers =
+  "Word not found\n"
+  "FOUND: %1$s/b.txt 2\n"
+  "FOUND: %1$s/a.txt 1\n"
+  "Word not found\n"
+  "Word not found\n"
+  "FOUND: %1$s/a.txt 2\n";
+
+static void test_incremental(void)
+{
+  char expected[1024];
+  char * output;
+
+  write_file(scratch_path("a.txt"), "kept banana\ncherry\n");
+  write_file(scratch_path("b.txt"), "banana\nold words\n");
+  write_file(scratch_path("c.txt"), "gone\n");
+  write_file(scratch_path("d.txt"), "dropped\n");
+  output = run_engine("--save-index %s 2 %s < /dev/null", scratch_path("snapshot"),
+                      list_files("list", "a.txt b.txt c.txt d.txt"));
+  CHECK(output != NULL);
+  free(output);
+
+  // a.txt is touched but not changed, b.txt changes, c.txt is deleted but
+  // still listed and d.txt is no longer listed
+  sleep(1);
+  write_file(scratch_path("a.txt"), "kept banana\ncherry\n");
+  write_file(scratch_path("b.txt"), "banana\nnew words\n");
+  unlink(scratch_path("c.txt"));
+  output = run_engine("--load-index %s --save-index %s 2 %s < /dev/null",
+                      scratch_path("snapshot"), scratch_path("snapshot2"),
+                      list_files("list", "a.txt b.txt c.txt"));
+  CHECK(output != NULL);
+  free(output);
+
+  write_file(scratch_path("queries"), incremental_queries);
+  output = run_engine("--load-index %s --queries %s", scratch_path("snapshot2"),
+                      scratch_path("queries"));
+  snprintf(expected, sizeof(expected), incremental_answers, scratch);
+  CHECK(output != NULL && !strcmp(output, expected));
+  free(output);
+}
+
+// ----------------------------------------------------------------------------
+// Boolean queries (AND, OR, NOT) over lines and files
+
+#define BOOLEAN_FILES 5
+#define BOOLEAN_LINES 300
+#define BOOLEAN_WORDS 5
+
+// Which of the words a..e are on each line; e never is
+static unsigned char corpus[BOOLEAN_FILES][BOOLEAN_LINES + 1];
+static char * boolean_words[BOOLEAN_WORDS] = { "a", "b", "c", "d", "e" };
+
+static void build_corpus(void)
+{
+  int file, line, word;
+
+  srand(537);
+  for (file = 0; file < BOOLEAN_FILES; file++) {
+    char name[16];
+    snprintf(name, sizeof(name), "f%d", file);
+    CHECK(register_file(name) == file);
+    for (line = 1; line <= BOOLEAN_LINES; line++) {
+      // a is on most lines, d on few, so the joins have to skip
+      int odds[BOOLEAN_WORDS] = { 70, 40, 20, 3, 0 };
+      for (word = 0; word < BOOLEAN_WORDS; word++) {
+        if (rand() % 100 < odds[word]) {
+          corpus[file][line] |= 1 << word;
+          insert_into_index(boolean_words[word], file, line);
+        }
+      }
+    }
+  }
+}
+
+static void collect_hit(void * arg, int file_id, int line_number)
+{
+  add_hit((hits_t *) arg, "%d:%d", file_id, line_number);
+}
+
+static int parse_words(query_t * query, char * text, char ** words,
+                       query_granularity_t granularity)
+{
+  char * word, * rest;
+  int num_words = 0;
+
+  for (word = strtok_r(text, " ", &rest); word != NULL && num_words < 64;
+       word = strtok_r(NULL, " ", &rest)) {
+    words[num_words++] = word;
+  }
+  return(parse_query(query, words, num_words, granularity));
+}
+
+// Runs the query, over one file if file_id is not negative
+static const char * boolean_hits(hits_t * hits, const char * text,
+                                 query_granularity_t granularity, int file_id)
+{
+  char copy[256], * words[64];
+  query_t query;
+
+  memset(hits, 0, sizeof(hits_t));
+  snprintf(copy, sizeof(copy), "%s", text);
+  if (parse_words(&query, copy, words, granularity)) {
+    return("invalid");
+  }
+  CHECK(run_query(&query, file_id, collect_hit, hits) == hits->count);
+  return(hits->text);
+}
+
+// The same by brute force: words is what is there, a line or a whole file
+static int matches(query_t * query, unsigned int words)
+{
+  int clause, i;
+
+  for (clause = 0; clause < query->num_clauses; clause++) {
+    int match = 1;
+    for (i = 0; i < query->num_terms; i++) {
+      int present = (words >> (query->terms[i].word[0] - 'a')) & 1;
+      if (query->terms[i].clause == clause && present == query->terms[i].negated) {
+        match = 0;
+      }
+    }
+    if (match) {
+      return(1);
+    }
+  }
+  return(0);
+}
+
+static const char * expected_hits(hits_t * hits, const char * text,
+                                  query_granularity_t granularity, int file_id)
+{
+  char copy[256], * words[64];
+  query_t query;
+  int file, line;
+
+  memset(hits, 0, sizeof(hits_t));
+  snprintf(copy, sizeof(copy), "%s", text);
+  if (parse_words(&query, copy, words, granularity)) {
+    return("invalid");
+  }
+  for (file = 0; file < BOOLEAN_FILES; file++) {
+    unsigned int in_file = 0;
+    if (file_id >= 0 && file != file_id) {
+      continue;
+    }
+    for (line = 1; line <= BOOLEAN_LINES; line++) {
+      in_file |= corpus[file][line];
+      if (granularity == QUERY_LINES && matches(&query, corpus[file][line])) {
+        add_hit(hits, "%d:%d", file, line);
+      }
+    }
+    if (granularity == QUERY_FILES && matches(&query, in_file)) {
+      add_hit(hits, "%d:0", file);
+    }
+  }
+  return(hits->text);
+}
+
+static void test_boolean(void)
+{
+  static const char * invalid[] = {
+    "", "a AND", "a AND b OR", "AND a b", "a b c", "a AND AND", "NOT a", "a NOT",
+    "a OR NOT b", "a AND b c OR d"
+  };
+  static const char * operators[] = { "AND", "OR", "NOT" };
+  hits_t hits, expected;
+  query_t query;
+  char * none[1];
+  int i, n;
+
+  build_corpus();
+
+  // Malformed queries, including every even number of words
+  for (i = 0; i < (int) (sizeof(invalid) / sizeof(invalid[0])); i++) {
+    CHECK(!strcmp(boolean_hits(&hits, invalid[i], QUERY_LINES, -1), "invalid"));
+  }
+  CHECK(parse_query(&query, none, 0, QUERY_LINES) == -1);
+
+  // Exclusions only apply to their own clause: these two are different
+  CHECK(strcmp(boolean_hits(&hits, "b NOT a OR a", QUERY_LINES, -1),
+               boolean_hits(&expected, "b NOT a", QUERY_LINES, -1)));
+  CHECK(!strcmp(boolean_hits(&hits, "b NOT a OR a", QUERY_LINES, -1),
+                expected_hits(&expected, "a OR b", QUERY_LINES, -1)));
+  CHECK(!strcmp(boolean_hits(&hits, "a OR b NOT a", QUERY_LINES, -1),
+                expected_hits(&expected, "a OR b", QUERY_LINES, -1)));
+
+  // A word that is nowhere
+  CHECK(!strcmp(boolean_hits(&hits, "e", QUERY_LINES, -1), ""));
+  CHECK(!strcmp(boolean_hits(&hits, "a AND e", QUERY_FILES, -1), ""));
+  CHECK(!strcmp(boolean_hits(&hits, "e OR d", QUERY_LINES, -1),
+                expected_hits(&expected, "d", QUERY_LINES, -1)));
+  CHECK(!strcmp(boolean_hits(&hits, "a NOT e", QUERY_FILES, -1), "0:0 1:0 2:0 3:0 4:0"));
+
+  // Random queries of up to 7 terms against brute force, at both
+  // granularities and over single files
+  for (n = 0; n < 2000; n++) {
+    char text[256];
+    int num_terms = 1 + rand() % 7, length = 0;
+    query_granularity_t granularity = (n % 2) ? QUERY_FILES : QUERY_LINES;
+    int file_id = (n % 5 == 0) ? rand() % BOOLEAN_FILES : -1;
+
+    for (i = 0; i < num_terms; i++) {
+      if (i > 0) {
+        length += sprintf(text + length, " %s ", operators[rand() % 3]);
+      }
+      length += sprintf(text + length, "%s", boolean_words[rand() % BOOLEAN_WORDS]);
+    }
+    boolean_hits(&hits, text, granularity, file_id);
+    expected_hits(&expected, text, granularity, file_id);
+    if (strcmp(hits.text, expected.text)) {
+      fprintf(stderr, "%s: '%s' (%s, file %d) gave %d hits, expected %d\n", group_name,
+              text, granularity == QUERY_FILES ? "files" : "lines", file_id, hits.count,
+              expected.count);
+      CHECK(!"query matches brute force");
+      break;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Phrase queries over a positional index
+
+#define PHRASE_FILES 3
+#define PHRASE_LINES 200
+#define PHRASE_WORDS 12
+
+// Each line as word numbers into phrase_words, -1 terminated
+static signed char phrases[PHRASE_FILES][PHRASE_LINES + 1][PHRASE_WORDS + 1];
+static signed char long_line[1001];
+static const char * phrase_words[] = { "x", "y", "z", "w" };
+
+static void build_phrase_corpus(void)
+{
+  index_staging_t * staging = create_staging_index();
+  int file, line, i;
+
+  CHECK(staging != NULL);
+  srand(13);
+  for (file = 0; file < PHRASE_FILES; file++) {
+    char name[16];
+    snprintf(name, sizeof(name), "p%d", file);
+    CHECK(register_file(name) == file);
+    for (line = 1; line <= PHRASE_LINES; line++) {
+      int length = rand() % (PHRASE_WORDS + 1);
+      for (i = 0; i < length; i++) {
+        // Mostly x and y, so that phrases repeat within a line
+        int word = (rand() % 10 < 8) ? rand() % 2 : 2 + rand() % 2;
+        phrases[file][line][i] = word;
+        insert_into_staging(staging, phrase_words[word], 1, line, i);
+      }
+      phrases[file][line][length] = -1;
+    }
+    CHECK(merge_into_index(staging, file) == 0);
+  }
+
+  // One long line, so a phrase runs across the blocks the cursors decode
+  CHECK(register_file("long") == PHRASE_FILES);
+  for (i = 0; i < 1000; i++) {
+    long_line[i] = (i % 3 == 2);
+    insert_into_staging(staging, phrase_words[long_line[i]], 1, 1, i);
+  }
+  long_line[1000] = -1;
+  CHECK(merge_into_index(staging, PHRASE_FILES) == 0);
+  destroy_staging_index(staging);
+}
+
+// Phrase given as word numbers, -1 terminated
+static int phrase_on_line(const signed char * line, const int * phrase)
+{
+  int i, j;
+
+  for (i = 0; line[i] >= 0; i++) {
+    for (j = 0; phrase[j] >= 0 && line[i + j] == phrase[j]; j++) {
+    }
+    if (phrase[j] < 0) {
+      return(1);
+    }
+  }
+  return(0);
+}
+
+static const char * phrase_hits(hits_t * hits, const char * text, int file_id)
+{
+  char copy[256];
+  query_t query;
+
+  memset(hits, 0, sizeof(hits_t));
+  snprintf(copy, sizeof(copy), "%s", text);
+  if (parse_phrase(&query, copy)) {
+    return("invalid");
+  }
+  CHECK(query.granularity == QUERY_PHRASE);
+  CHECK(run_query(&query, file_id, collect_hit, hits) == hits->count);
+  return(hits->text);
+}
+
+static void test_phrase(void)
+{
+  hits_t hits, expected;
+  query_t query;
+  char blank[] = " , ";
+  int n, i;
+
+  CHECK(enable_index_positions() == 0);
+  build_phrase_corpus();
+  CHECK(index_has_positions());
+  CHECK(parse_phrase(&query, blank) == -1);
+
+  // On the long line "x x y x x y ...", once per line however often it is there
+  CHECK(!strcmp(phrase_hits(&hits, "y x x y", 3), "3:1"));
+  CHECK(!strcmp(phrase_hits(&hits, "x,  x y", 3), "3:1"));
+  CHECK(!strcmp(phrase_hits(&hits, "y y", 3), ""));
+  CHECK(!strcmp(phrase_hits(&hits, "x x x", 3), ""));
+  CHECK(!strcmp(phrase_hits(&hits, "x missing", -1), ""));
+
+  // Random phrases of up to 4 words against brute force
+  for (n = 0; n < 1000; n++) {
+    int phrase[5], length = 1 + rand() % 4, file_id = (n % 4 == 0) ? rand() % 4 : -1;
+    int file, line;
+    char text[64] = "";
+
+    for (i = 0; i < length; i++) {
+      phrase[i] = (rand() % 10 < 8) ? rand() % 2 : 2 + rand() % 2;
+      strcat(text, phrase_words[phrase[i]]);
+      strcat(text, " ");
+    }
+    phrase[length] = -1;
+
+    memset(&expected, 0, sizeof(expected));
+    for (file = 0; file < PHRASE_FILES; file++) {
+      for (line = 1; line <= PHRASE_LINES; line++) {
+        if ((file_id < 0 || file == file_id) && phrase_on_line(phrases[file][line], phrase)) {
+          add_hit(&expected, "%d:%d", file, line);
+        }
+      }
+    }
+    if ((file_id < 0 || file_id == PHRASE_FILES) && phrase_on_line(long_line, phrase)) {
+      add_hit(&expected, "%d:1", PHRASE_FILES);
+    }
+    if (strcmp(phrase_hits(&hits, text, file_id), expected.text)) {
+      fprintf(stderr, "%s: '%s' (file %d) gave %d hits, expected %d\n", group_name, text,
+              file_id, hits.count, expected.count);
+      CHECK(!"phrase matches brute force");
+      break;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Term dictionary: prefix, range and wildcard lookups
+
+#define DICTIONARY_WORDS 6000
+
+// The words, sorted and without duplicates
+static char dictionary[DICTIONARY_WORDS][12];
+static int num_dictionary;
+
+static int compare_words(const void * a, const void * b)
+{
+  return(strcmp((const char *) a, (const char *) b));
+}
+
+static void random_word(char * word, int max_length, const char * letters)
+{
+  int length = 1 + rand() % max_length, i;
+
+  for (i = 0; i < length; i++) {
+    word[i] = letters[rand() % strlen(letters)];
+  }
+  word[length] = '\0';
+}
+
+static void save_dictionary_words(void * arg)
+{
+  int i;
+
+  CHECK(register_file("old") == 0);
+  for (i = 0; i < num_dictionary; i++) {
+    if (i % 3 != 2) {
+      insert_into_index(dictionary[i], 0, i + 1);
+    }
+  }
+  CHECK(save_index((const char *) arg) == 0);
+}
+
+//
+// Random words, some of them only in a snapshot, some only in memory and
+// some in both, and the dictionary built over all of them
+//
+static void build_dictionary(void)
+{
+  const char * path = scratch_path("dictionary");
+  int i, n;
+
+  srand(14);
+  for (i = 0; i < DICTIONARY_WORDS; i++) {
+    random_word(dictionary[i], 8, "abcdef");
+  }
+  qsort(dictionary, DICTIONARY_WORDS, sizeof(dictionary[0]), compare_words);
+  for (i = 0, n = 0; i < DICTIONARY_WORDS; i++) {
+    if (n == 0 || strcmp(dictionary[i], dictionary[n - 1])) {
+      memmove(dictionary[n++], dictionary[i], sizeof(dictionary[0]));
+    }
+  }
+  num_dictionary = n;
+
+  CHECK(in_child(save_dictionary_words, (void *) path));
+  CHECK(load_index(path) == 1);
+  CHECK(register_file("new") == 1);
+  for (i = 0; i < num_dictionary; i++) {
+    if (i % 3 != 0) {
+      insert_into_index(dictionary[i], 1, i + 1);
+    }
+  }
+  CHECK(build_term_dictionary(4) == num_dictionary);
+}
+
+static int collect_term(void * arg, const char * word)
+{
+  add_hit((hits_t *) arg, "%s", word);
   return(0);
 }
+
+static int stop_after_three(void * arg, const char * word)
+{
+  add_hit((hits_t *) arg, "%s", word);
+  return(((hits_t *) arg)->count == 3);
+}
+
+typedef enum lookup_e { PREFIX, RANGE, PATTERN } lookup_t;
+
+static void check_lookup(lookup_t lookup, const char * first, const char * last)
+{
+  hits_t hits, expected;
+  int i, count = -1, match;
+
+  memset(&hits, 0, sizeof(hits));
+  memset(&expected, 0, sizeof(expected));
+  if (lookup == PREFIX) {
+    count = find_terms_by_prefix(first, collect_term, &hits);
+  } else if (lookup == RANGE) {
+    count = find_terms_in_range(first, last, collect_term, &hits);
+  } else {
+    count = find_terms_matching(first, collect_term, &hits);
+  }
+  for (i = 0; i < num_dictionary; i++) {
+    const char * word = dictionary[i];
+    if (lookup == PREFIX) {
+      match = !strncmp(word, first, strlen(first));
+    } else if (lookup == RANGE) {
+      match = (first == NULL || strcmp(word, first) >= 0) &&
+              (last == NULL || strcmp(word, last) <= 0);
+    } else {
+      match = !fnmatch(first, word, FNM_NOESCAPE);
+    }
+    if (match) {
+      add_hit(&expected, "%s", word);
+    }
+  }
+  if (count != expected.count || strcmp(hits.text, expected.text)) {
+    fprintf(stderr, "%s: lookup %d of '%s'..'%s' found %d words, expected %d\n", group_name,
+            lookup, first ? first : "", last ? last : "", count, expected.count);
+    CHECK(!"lookup matches brute force");
+  }
+}
+
+static void test_dictionary(void)
+{
+  hits_t hits;
+  int n;
+
+  CHECK(find_terms_by_prefix("a", collect_term, &hits) == -EAGAIN);
+  build_dictionary();
+
+  check_lookup(PREFIX, "", NULL);
+  check_lookup(PREFIX, "zzz", NULL);
+  check_lookup(RANGE, NULL, NULL);
+  check_lookup(RANGE, NULL, "b");
+  check_lookup(RANGE, "eee", NULL);
+  check_lookup(RANGE, "c", "b");
+  check_lookup(RANGE, dictionary[10], dictionary[10]);
+  check_lookup(PATTERN, "*", NULL);
+  check_lookup(PATTERN, dictionary[100], NULL);
+  check_lookup(PATTERN, "abc", NULL);
+  check_lookup(PATTERN, "[", NULL);
+  check_lookup(PATTERN, "a\\*", NULL);
+
+  // The visitor can stop the walk
+  memset(&hits, 0, sizeof(hits));
+  CHECK(find_terms_by_prefix("a", stop_after_three, &hits) == 3 && hits.count == 3);
+
+  for (n = 0; n < 300; n++) {
+    char first[12], last[12], pattern[16];
+    int i, length = rand() % 6;
+
+    random_word(first, 4, "abcdefg");
+    random_word(last, 4, "abcdefg");
+    check_lookup(PREFIX, first + (n % 5 == 0 ? strlen(first) : 0), NULL);
+    check_lookup(RANGE, n % 7 == 0 ? NULL : first, n % 11 == 0 ? NULL : last);
+
+    // Literal letters mixed with * ? and a class
+    for (i = 0; i < length; i++) {
+      int kind = rand() % 8;
+      pattern[i] = kind == 0 ? '*' : kind == 1 ? '?' : "abcdef"[rand() % 6];
+    }
+    pattern[length] = '\0';
+    if (n % 3 == 0) {
+      strcat(pattern, "[b-d]");
+    }
+    if (n % 4 == 0) {
+      strcat(pattern, "*");
+    }
+    check_lookup(PATTERN, pattern, NULL);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Fuzzy lookups through the trigram index
+
+static int edit_distance(const char * a, const char * b)
+{
+  int length_b = strlen(b), row[16], i, j;
+
+  for (j = 0; j <= length_b; j++) {
+    row[j] = j;
+  }
+  for (i = 1; a[i - 1] != '\0'; i++) {
+    int diagonal = row[0];
+    row[0] = i;
+    for (j = 1; j <= length_b; j++) {
+      int cost = diagonal + (a[i - 1] != b[j - 1]);
+      diagonal = row[j];
+      if (row[j] + 1 < cost) {
+        cost = row[j] + 1;
+      }
+      if (row[j - 1] + 1 < cost) {
+        cost = row[j - 1] + 1;
+      }
+      row[j] = cost;
+    }
+  }
+  return(row[length_b]);
+}
+
+static void check_near(const char * word, int max_distance)
+{
+  hits_t hits, expected;
+  int i, count;
+
+  memset(&hits, 0, sizeof(hits));
+  memset(&expected, 0, sizeof(expected));
+  count = find_terms_near(word, max_distance, collect_term, &hits);
+  for (i = 0; i < num_dictionary; i++) {
+    if (edit_distance(dictionary[i], word) <= max_distance) {
+      add_hit(&expected, "%s", dictionary[i]);
+    }
+  }
+  if (count != expected.count || strcmp(hits.text, expected.text)) {
+    fprintf(stderr, "%s: '%s' within %d found %d words, expected %d\n", group_name, word,
+            max_distance, count, expected.count);
+    CHECK(!"fuzzy lookup matches brute force");
+  }
+}
+
+static void test_fuzzy(void)
+{
+  hits_t hits;
+  int n;
+
+  CHECK(find_terms_near("abc", 1, collect_term, &hits) == -EAGAIN);
+  build_dictionary();
+
+  // Words in the dictionary and not, short ones that share no trigram with
+  // what they should find, and distances past the length of the word
+  check_near(dictionary[0], 1);
+  check_near(dictionary[num_dictionary / 2], 2);
+  check_near("a", 1);
+  check_near("zz", 2);
+  check_near("abcdefab", 3);
+  check_near("ggggggggg", 1);
+
+  for (n = 0; n < 300; n++) {
+    char word[12];
+
+    random_word(word, 10, "abcdefg");
+    check_near(word, 1 + n % 3);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Ranked top-k by BM25 with WAND
+
+#define RANKED_FILES 300
+#define RANKED_VOCABULARY 40
+
+// How often each word is in each file
+static int term_counts[RANKED_FILES][RANKED_VOCABULARY];
+static char ranked_words[RANKED_VOCABULARY][8];
+
+typedef struct ranked_hits_s {
+  int file_ids[RANKED_FILES];
+  double scores[RANKED_FILES];
+  int count;
+} ranked_hits_t;
+
+static void collect_ranked(void * arg, int file_id, double score)
+{
+  ranked_hits_t * hits = (ranked_hits_t *) arg;
+
+  if (hits->count < RANKED_FILES) {
+    hits->file_ids[hits->count] = file_id;
+    hits->scores[hits->count] = score;
+  }
+  hits->count++;
+}
+
+// Files of random length whose words follow a skewed distribution, so
+// the common words are in most files and the rare ones in a few
+static void build_ranked_corpus(void)
+{
+  index_staging_t * staging = create_staging_index();
+  int file, word, i;
+
+  srand(16);
+  for (word = 0; word < RANKED_VOCABULARY; word++) {
+    snprintf(ranked_words[word], sizeof(ranked_words[0]), "r%d", word);
+  }
+  for (file = 0; file < RANKED_FILES; file++) {
+    char name[16];
+    int length = 5 + rand() % 300;
+
+    snprintf(name, sizeof(name), "r%d", file);
+    CHECK(register_file(name) == file);
+    for (i = 0; i < length; i++) {
+      word = (rand() % RANKED_VOCABULARY) * (rand() % RANKED_VOCABULARY) / RANKED_VOCABULARY;
+      term_counts[file][word]++;
+      insert_into_staging(staging, ranked_words[word], strlen(ranked_words[word]),
+                          1 + i / 10, i % 10);
+    }
+    CHECK(merge_into_index(staging, file) == 0);
+  }
+  destroy_staging_index(staging);
+}
+
+// Scores every file the long way
+static void exhaustive_bm25(int * words, int num_words, double * scores)
+{
+  index_stats_t stats;
+  int file, i;
+
+  get_index_stats(&stats);
+  for (file = 0; file < RANKED_FILES; file++) {
+    scores[file] = 0;
+  }
+  for (i = 0; i < num_words; i++) {
+    int df = 0;
+    double idf;
+
+    for (file = 0; file < RANKED_FILES; file++) {
+      df += term_counts[file][words[i]] > 0;
+    }
+    idf = log(1 + (stats.num_documents - df + 0.5) / (df + 0.5));
+    for (file = 0; file < RANKED_FILES; file++) {
+      int count = term_counts[file][words[i]];
+      double norm = BM25_K1 * (1 - BM25_B + BM25_B * get_file_length(file) /
+                               stats.average_length);
+      if (count > 0) {
+        scores[file] += idf * count * (BM25_K1 + 1) / (count + norm);
+      }
+    }
+  }
+}
+
+static int close_to(double a, double b)
+{
+  return(fabs(a - b) <= 1e-9 * (fabs(a) + fabs(b) + 1));
+}
+
+static void check_ranked(int * words, int num_words, int k)
+{
+  char * text[8];
+  double scores[RANKED_FILES], sorted[RANKED_FILES];
+  ranked_hits_t hits;
+  int num_scored = 0, i, j, ok;
+
+  for (i = 0; i < num_words; i++) {
+    text[i] = ranked_words[words[i]];
+  }
+  exhaustive_bm25(words, num_words, scores);
+  for (i = 0; i < RANKED_FILES; i++) {
+    if (scores[i] > 0) {
+      // Insertion sort, best first
+      for (j = num_scored++; j > 0 && sorted[j - 1] < scores[i]; j--) {
+        sorted[j] = sorted[j - 1];
+      }
+      sorted[j] = scores[i];
+    }
+  }
+
+  memset(&hits, 0, sizeof(hits));
+  ok = (run_ranked(text, num_words, k, collect_ranked, &hits) == hits.count) &&
+       hits.count == (k < num_scored ? k : num_scored);
+
+  // The same scores in the same order, and each one right for its file.
+  // Files whose scores are equal can only come in file order.
+  for (i = 0; ok && i < hits.count; i++) {
+    ok = close_to(hits.scores[i], sorted[i]) &&
+         close_to(hits.scores[i], scores[hits.file_ids[i]]);
+    for (j = 0; ok && j < i; j++) {
+      ok = hits.file_ids[j] != hits.file_ids[i] &&
+           (hits.scores[j] != hits.scores[i] || hits.file_ids[j] < hits.file_ids[i]);
+    }
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: top %d of %d words differs from exhaustive BM25\n", group_name, k,
+            num_words);
+    CHECK(!"ranking matches exhaustive BM25");
+  }
+}
+
+static void test_ranked(void)
+{
+  static const char * same[] = { "tie tie other", "tie" };
+  char * tie[] = { "tie" }, * missing[] = { "missing" }, * mixed[] = { "missing", "r0" };
+  ranked_hits_t hits;
+  int n, first, second;
+
+  build_ranked_corpus();
+
+  // Files with the same counts and length tie, and the lower id goes first
+  first = index_lines("tie1", same, 2);
+  index_lines("between", (const char *[]) { "tie other" }, 1);
+  second = index_lines("tie2", same, 2);
+  memset(&hits, 0, sizeof(hits));
+  CHECK(run_ranked(tie, 1, 1, collect_ranked, &hits) == 1 && hits.file_ids[0] == first);
+  memset(&hits, 0, sizeof(hits));
+  CHECK(run_ranked(tie, 1, 3, collect_ranked, &hits) == 3 && hits.file_ids[0] == first &&
+        hits.file_ids[1] == second && hits.scores[0] == hits.scores[1] &&
+        hits.scores[1] > hits.scores[2]);
+
+  memset(&hits, 0, sizeof(hits));
+  CHECK(run_ranked(missing, 1, 5, collect_ranked, &hits) == 0 && hits.count == 0);
+  memset(&hits, 0, sizeof(hits));
+  CHECK(run_ranked(mixed, 2, 5, collect_ranked, &hits) == 5);
+
+  // Random queries of 1 to 6 words (repeats allowed), with k from 1 (the
+  // most pruning) to every file (none) against scoring every file
+  for (n = 0; n < 400; n++) {
+    int words[8], num_words = 1 + rand() % 6, ks[] = { 1, 3, 10, 50, RANKED_FILES }, i;
+
+    for (i = 0; i < num_words; i++) {
+      words[i] = rand() % RANKED_VOCABULARY;
+    }
+    check_ranked(words, num_words, ks[n % 5]);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Query result cache
+
+static int cached(query_cache_t * cache, const char * key, uint64_t generation,
+                  const char * expected)
+{
+  char * result;
+  size_t length;
+  int ok;
+
+  if (query_cache_get(cache, key, generation, &result, &length)) {
+    return(0);
+  }
+  ok = length == strlen(expected) && !strcmp(result, expected);
+  free(result);
+  return(ok);
+}
+
+static void * hammer_cache(void * arg)
+{
+  query_cache_t * cache = (query_cache_t *) arg;
+  unsigned int seed = (unsigned int) pthread_self();
+  char key[16], value[32], * result;
+  size_t length;
+  int i, bad = 0;
+
+  for (i = 0; i < 20000; i++) {
+    uint64_t generation = rand_r(&seed) % 4;
+
+    snprintf(key, sizeof(key), "k%d", rand_r(&seed) % 500);
+    snprintf(value, sizeof(value), "%s at %d", key, (int) generation);
+    if (rand_r(&seed) % 2) {
+      query_cache_put(cache, key, generation, value, strlen(value));
+    } else if (query_cache_get(cache, key, generation, &result, &length) == 0) {
+      bad += length != strlen(value) || strcmp(result, value);
+      free(result);
+    }
+  }
+  return((void *) (long) bad);
+}
+
+static void test_cache(void)
+{
+  static const char * lines[] = { "cached words here" };
+  query_cache_t * cache = create_query_cache(16 * 4096);
+  char key[16], big[2048];
+  pthread_t threads[4];
+  uint64_t before, index_before;
+  int i, file_id, hits = 0;
+  void * bad;
+
+  CHECK(cache != NULL);
+  if (cache == NULL) {
+    return;
+  }
+
+  // Only served at the generation it was computed at, and a newer
+  // generation replaces an older one but never the other way round
+  query_cache_put(cache, "word", 3, "three", 5);
+  CHECK(cached(cache, "word", 3, "three"));
+  CHECK(!cached(cache, "word", 2, "three") && !cached(cache, "word", 4, "three"));
+  CHECK(!cached(cache, "other", 3, "three"));
+  query_cache_put(cache, "word", 2, "two", 3);
+  CHECK(cached(cache, "word", 3, "three") && !cached(cache, "word", 2, "two"));
+  query_cache_put(cache, "word", 5, "five", 4);
+  CHECK(cached(cache, "word", 5, "five") && !cached(cache, "word", 3, "three"));
+  query_cache_put(cache, "empty", 1, "", 0);
+  CHECK(cached(cache, "empty", 1, ""));
+
+  // A shard gets a sixteenth of the budget, and a result of more than a
+  // quarter of that is not worth keeping
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  query_cache_put(cache, "big", 1, big, strlen(big));
+  CHECK(!cached(cache, "big", 1, big));
+  big[200] = '\0';
+  query_cache_put(cache, "big", 1, big, strlen(big));
+  CHECK(cached(cache, "big", 1, big));
+
+  // Filling it well past its budget keeps it within it, and keeps what
+  // was put last
+  for (i = 0; i < 2000; i++) {
+    snprintf(key, sizeof(key), "fill%d", i);
+    query_cache_put(cache, key, 1, big, strlen(big));
+  }
+  for (i = 0; i < 2000; i++) {
+    snprintf(key, sizeof(key), "fill%d", i);
+    hits += cached(cache, key, 1, big);
+  }
+  CHECK(hits > 0 && hits * 200 <= 16 * 4096);
+  CHECK(cached(cache, "fill1999", 1, big));
+
+  // Threads putting and getting the same keys only ever see what was put
+  // for the key at the generation they asked for
+  for (i = 0; i < 4; i++) {
+    CHECK(pthread_create(&threads[i], NULL, hammer_cache, cache) == 0);
+  }
+  for (i = 0; i < 4; i++) {
+    pthread_join(threads[i], &bad);
+    CHECK(bad == NULL);
+  }
+  destroy_query_cache(cache);
+
+  // The generations a cached result is keyed on move on with any change
+  // to what it was computed from, and stand still otherwise
+  before = get_term_generation("words");
+  index_before = get_index_generation();
+  CHECK(get_term_generation("words") == before && get_index_generation() == index_before);
+  file_id = index_lines("cached.txt", lines, 1);
+  CHECK(get_term_generation("words") != before && get_index_generation() != index_before);
+
+  before = get_term_generation("words");
+  index_before = get_index_generation();
+  file_id = replace_file(file_id);
+  CHECK(file_id >= 0 && get_term_generation("words") != before &&
+        get_index_generation() != index_before);
+
+  before = get_term_generation("unrelated");
+  index_before = get_index_generation();
+  remove_file(file_id);
+  CHECK(get_term_generation("unrelated") != before && get_index_generation() != index_before);
+}
+
+// ----------------------------------------------------------------------------
+// Query server
+
+#define SERVER_CLIENTS 8
+#define SERVER_QUERIES 15
+
+// Takes a little while, so answers keep coming in while the server is
+// busy with the ones before
+static void echo_answer(const char * line, FILE * out)
+{
+  usleep(strlen(line) * 7 % 50);
+  fprintf(out, "echo %s\n", line);
+}
+
+// Sends its queries all at once, half-closes and reads to the end. Returns
+// whether it got every answer, in order.
+static void * server_client(void * arg)
+{
+  struct sockaddr_un address;
+  char expected[SERVER_QUERIES * 32], query[32], answers[sizeof(expected) + 1];
+  size_t length = 0, expected_length = 0;
+  ssize_t n;
+  int fd, i;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, scratch_path("socket"));
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address))) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return(NULL);
+  }
+  for (i = 0; i < SERVER_QUERIES; i++) {
+    snprintf(query, sizeof(query), "client %ld query %d\n", (long) arg, i);
+    if (write(fd, query, strlen(query)) != (ssize_t) strlen(query)) {
+      close(fd);
+      return(NULL);
+    }
+    expected_length += sprintf(expected + expected_length, "echo %.*s\n\n",
+                               (int) strlen(query) - 1, query);
+  }
+  shutdown(fd, SHUT_WR);
+  while (length < sizeof(answers) &&
+         (n = read(fd, answers + length, sizeof(answers) - length)) > 0) {
+    length += n;
+  }
+  close(fd);
+  return((void *) (long) (length == expected_length &&
+                          !memcmp(answers, expected, length)));
+}
+
+static void test_server(void)
+{
+  pthread_t clients[SERVER_CLIENTS];
+  struct stat st;
+  int round, i, status, answered = 1;
+  pid_t pid;
+
+  fflush(NULL);
+  pid = fork();
+  if (pid == 0) {
+    _exit(run_query_server(scratch_path("socket"), 4, echo_answer) ? 1 : 0);
+  }
+  CHECK(pid > 0);
+  if (pid < 0) {
+    return;
+  }
+  for (i = 0; i < 500 && stat(scratch_path("socket"), &st); i++) {
+    usleep(10000);
+  }
+
+  // Clients that are done sending while their answers are still coming
+  // in, the connection going away as soon as the last one is written
+  for (round = 0; round < 200 && answered; round++) {
+    for (i = 0; i < SERVER_CLIENTS; i++) {
+      CHECK(pthread_create(&clients[i], NULL, server_client, (void *) (long) i) == 0);
+    }
+    for (i = 0; i < SERVER_CLIENTS; i++) {
+      void * ok;
+
+      pthread_join(clients[i], &ok);
+      answered = answered && ok != NULL;
+    }
+  }
+  CHECK(answered);
+
+  kill(pid, SIGTERM);
+  CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// ----------------------------------------------------------------------------
+// Big files indexed in chunks
+
+typedef struct token_log_s {
+  FILE * out;
+  int line_offset;
+} token_log_t;
+
+static int stage_token(void * arg, const char * word, int length, int line_number,
+                       int position)
+{
+  return insert_into_staging((index_staging_t *) arg, word, length, line_number, position);
+}
+
+static int log_token(void * arg, const char * word, int length, int line_number,
+                     int position)
+{
+  token_log_t * log = (token_log_t *) arg;
+
+  fprintf(log->out, "%.*s %d %d\n", length, word, log->line_offset + line_number, position);
+  return(0);
+}
+
+// Random lines, some empty and some longer than the smaller chunks, and
+// no newline at the end
+static void write_chunked_file(const char * path)
+{
+  FILE * file = fopen(path, "w");
+  char word[12];
+  int line, i;
+
+  CHECK(file != NULL);
+  if (file == NULL) {
+    return;
+  }
+  srand(20);
+  for (line = 0; line < 20000; line++) {
+    int num_words = (line % 50 == 0) ? 300 : rand() % 8;
+
+    for (i = 0; i < num_words; i++) {
+      random_word(word, 6, "abcdefgh");
+      fprintf(file, "%s%s", i ? " " : "", word);
+    }
+    fputc(line < 19999 ? '\n' : '.', file);
+  }
+  fclose(file);
+}
+
+// Lines of the word in one file only
+static const char * word_lines(hits_t * hits, char * word, int file_id)
+{
+  index_search_results_t * results = find_in_index(word);
+  int i;
+
+  memset(hits, 0, sizeof(hits_t));
+  if (results != NULL) {
+    for (i = 0; i < results->num_results; i++) {
+      if (results->results[i].file_id == file_id) {
+        add_hit(hits, "%d", results->results[i].line_number);
+      }
+    }
+    free(results);
+  }
+  return(hits->text);
+}
+
+// The same through the whole program: a file big enough for it to split
+// between indexers, with words to find on either side of where it does
+static void check_chunked_engine(void)
+{
+  const char * path = scratch_path("big.txt");
+  const char * filler = "filler words on every line of the big file\n";
+  char * queries = NULL, * expected = NULL, * output;
+  size_t queries_length, expected_length;
+  FILE * file = fopen(path, "w"), * q, * e;
+  int line, num_lines = 800000, line_length = strlen(filler);
+
+  CHECK(file != NULL);
+  if (file == NULL) {
+    return;
+  }
+  q = open_memstream(&queries, &queries_length);
+  e = open_memstream(&expected, &expected_length);
+  for (line = 1; line <= num_lines; line++) {
+    // Every so often, and right around every 16MB
+    int boundary = (line * (long) line_length) >> 24 != ((line - 1) * (long) line_length) >> 24;
+    if (line == 1 || line == num_lines || line % 99991 == 0 || boundary ||
+        (line > 2 && ((line - 2) * (long) line_length) >> 24 !=
+                     ((line - 3) * (long) line_length) >> 24)) {
+      fprintf(file, "marker%d on its line\n", line);
+      fprintf(q, "%s marker%d\n", path, line);
+      fprintf(e, "FOUND: %s %d\n", path, line);
+    } else {
+      fputs(filler, file);
+    }
+  }
+  fclose(file);
+  fclose(q);
+  fclose(e);
+  write_file(scratch_path("big-queries"), queries);
+  write_file(scratch_path("big-list"), path);
+
+  output = run_engine("--save-index %s 4 %s < /dev/null", scratch_path("big-snapshot"),
+                      scratch_path("big-list"));
+  CHECK(output != NULL);
+  free(output);
+  output = run_engine("--load-index %s --queries %s", scratch_path("big-snapshot"),
+                      scratch_path("big-queries"));
+  CHECK(output != NULL && !strcmp(output, expected));
+  free(output);
+  free(queries);
+  free(expected);
+}
+
+static void test_chunked(void)
+{
+  static const size_t chunk_sizes[] = { 1, 97, 4096, 100000, 1 << 30 };
+  const char * path = scratch_path("chunked.txt");
+  char * whole_tokens = NULL, * chunk_tokens = NULL, word[12];
+  size_t whole_length, chunk_length, bounds[20001];
+  static hits_t whole_hits, chunk_hits;
+  file_stamp_t whole_stamp, chunk_stamp;
+  token_log_t log;
+  int c, i, whole_id, chunked_id;
+
+  write_chunked_file(path);
+  log.out = open_memstream(&whole_tokens, &whole_length);
+  log.line_offset = 0;
+  CHECK(tokenize_file(path, log_token, &log, &whole_stamp) == 0);
+  fclose(log.out);
+
+  // Ranges tokenized on their own, their line numbers offset by the lines
+  // of the ranges before, come out the same as the whole file, and hash
+  // the same
+  for (c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++) {
+    mapped_file_t file;
+    int num_chunks, num_lines, ok = 1;
+
+    CHECK(map_file(path, &file) == 0);
+    num_chunks = split_mapped_file(&file, chunk_sizes[c], bounds, 20000);
+    CHECK(num_chunks >= 1 && bounds[0] == 0 && bounds[num_chunks] == file.size);
+    for (i = 1; i < num_chunks; i++) {
+      ok = ok && bounds[i] > bounds[i - 1] && file.map[bounds[i] - 1] == '\n';
+    }
+    CHECK(ok);
+
+    log.out = open_memstream(&chunk_tokens, &chunk_length);
+    log.line_offset = 0;
+    for (i = 0; i < num_chunks; i++) {
+      CHECK(tokenize_mapped_range(&file, bounds[i], bounds[i + 1], log_token, &log,
+                                  &num_lines) == 0);
+      hash_mapped_range(&file, bounds[i], bounds[i + 1]);
+      log.line_offset += num_lines;
+    }
+    fclose(log.out);
+    unmap_file(&file, &chunk_stamp);
+    CHECK(chunk_length == whole_length && !memcmp(chunk_tokens, whole_tokens, whole_length));
+    CHECK(chunk_stamp.size == whole_stamp.size && chunk_stamp.hash == whole_stamp.hash);
+    free(chunk_tokens);
+  }
+  free(whole_tokens);
+
+  // Merged a chunk at a time, the file is indexed at the same lines as when
+  // merged whole
+  whole_id = register_file("whole");
+  chunked_id = register_file("chunked");
+  {
+    index_staging_t * staging = create_staging_index();
+    mapped_file_t file;
+    int num_chunks, num_lines, line_offset = 0;
+
+    CHECK(tokenize_file(path, stage_token, staging, NULL) == 0);
+    CHECK(merge_into_index(staging, whole_id) == 0);
+
+    CHECK(map_file(path, &file) == 0);
+    num_chunks = split_mapped_file(&file, 4096, bounds, 20000);
+    for (i = 0; i < num_chunks; i++) {
+      CHECK(tokenize_mapped_range(&file, bounds[i], bounds[i + 1], stage_token, staging,
+                                  &num_lines) == 0);
+      CHECK(merge_chunk_into_index(staging, chunked_id, line_offset,
+                                   i == num_chunks - 1) == 0);
+      line_offset += num_lines;
+    }
+    unmap_file(&file, NULL);
+    destroy_staging_index(staging);
+  }
+  srand(21);
+  for (i = 0; i < 300; i++) {
+    random_word(word, 3, "abcdefgh");
+    word_lines(&whole_hits, word, whole_id);
+    word_lines(&chunk_hits, word, chunked_id);
+    CHECK(!strcmp(whole_hits.text, chunk_hits.text));
+  }
+  CHECK(get_file_length(whole_id) == get_file_length(chunked_id));
+
+  check_chunked_engine();
+}
+
+// ----------------------------------------------------------------------------
+// Work queue between the scanner and the indexers
+
+#define QUEUE_PRODUCERS 4
+#define QUEUE_CONSUMERS 4
+#define QUEUE_ITEMS 100000
+#define QUEUE_BUDGET 20
+
+static int delivered[QUEUE_PRODUCERS * QUEUE_ITEMS];
+
+// Items say which producer they are from and where in its sequence, and
+// their weights follow from them so consumers can check their budgets
+static unsigned int item_weight(int item)
+{
+  return(item % 13);
+}
+
+typedef struct queue_worker_s {
+  work_queue_t * queue;
+  int id;
+  int ok;
+} queue_worker_t;
+
+static void * produce_items(void * arg)
+{
+  queue_worker_t * worker = (queue_worker_t *) arg;
+  int items[32], i = 0, n, j;
+  unsigned int weights[32], seed = worker->id;
+
+  while (i < QUEUE_ITEMS) {
+    n = 1 + rand_r(&seed) % 32;
+    if (n > QUEUE_ITEMS - i) {
+      n = QUEUE_ITEMS - i;
+    }
+    for (j = 0; j < n; j++) {
+      items[j] = worker->id * QUEUE_ITEMS + i + j;
+      weights[j] = item_weight(items[j]);
+    }
+    work_queue_push(worker->queue, items, weights, n);
+    i += n;
+  }
+  return(NULL);
+}
+
+// Every item goes to one consumer only, each consumer sees the items of a
+// producer in the order they were pushed, and takes no more than its
+// budget after the first
+static void * consume_items(void * arg)
+{
+  queue_worker_t * worker = (queue_worker_t *) arg;
+  int last[QUEUE_PRODUCERS], items[16], n, i;
+  unsigned int seed = worker->id;
+
+  for (i = 0; i < QUEUE_PRODUCERS; i++) {
+    last[i] = -1;
+  }
+  worker->ok = 1;
+  while ((n = work_queue_pop(worker->queue, items, 1 + rand_r(&seed) % 16, QUEUE_BUDGET)) > 0) {
+    unsigned int weight = 0;
+
+    for (i = 0; i < n; i++) {
+      int producer = items[i] / QUEUE_ITEMS;
+
+      if (i > 0) {
+        weight += item_weight(items[i]);
+      }
+      worker->ok = worker->ok && items[i] > last[producer];
+      last[producer] = items[i];
+      __sync_fetch_and_add(&delivered[items[i]], 1);
+    }
+    worker->ok = worker->ok && weight <= QUEUE_BUDGET;
+  }
+  return(NULL);
+}
+
+static void * pop_until_closed(void * arg)
+{
+  int item;
+
+  return((void *) (long) work_queue_pop((work_queue_t *) arg, &item, 1, 0));
+}
+
+static int pop_all(work_queue_t * queue, hits_t * hits, int max_items, uint64_t budget)
+{
+  int items[64], n, i;
+
+  memset(hits, 0, sizeof(hits_t));
+  n = work_queue_pop(queue, items, max_items, budget);
+  for (i = 0; i < n; i++) {
+    add_hit(hits, "%d", items[i]);
+  }
+  return(n);
+}
+
+static void test_workqueue(void)
+{
+  static const int items[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+  static const unsigned int weights[] = { 5, 5, 5, 20, 1, 1 };
+  queue_worker_t producers[QUEUE_PRODUCERS], consumers[QUEUE_CONSUMERS];
+  pthread_t producer_threads[QUEUE_PRODUCERS], consumer_threads[QUEUE_CONSUMERS], waiter;
+  static hits_t hits;
+  work_queue_t * queue = create_work_queue(5);
+  void * result;
+  int i, ok;
+
+  CHECK(queue != NULL);
+  if (queue == NULL) {
+    return;
+  }
+
+  // The depth is rounded up to 8, and what does not fit is left out
+  CHECK(work_queue_try_push(queue, items, NULL, 10) == 8);
+  CHECK(work_queue_try_push(queue, items, NULL, 1) == 0);
+  CHECK(pop_all(queue, &hits, 3, 0) == 3 && !strcmp(hits.text, "1 2 3"));
+  CHECK(work_queue_try_push(queue, items + 8, NULL, 2) == 2);
+  CHECK(pop_all(queue, &hits, 64, 0) == 7 && !strcmp(hits.text, "4 5 6 7 8 9 10"));
+
+  // After the first item, no more than the budget is taken, and the first
+  // is taken however heavy it is
+  work_queue_push(queue, items, weights, 6);
+  CHECK(pop_all(queue, &hits, 64, 10) == 2 && !strcmp(hits.text, "1 2"));
+  CHECK(pop_all(queue, &hits, 64, 10) == 1 && !strcmp(hits.text, "3"));
+  CHECK(pop_all(queue, &hits, 64, 10) == 1 && !strcmp(hits.text, "4"));
+  CHECK(pop_all(queue, &hits, 64, 10) == 2 && !strcmp(hits.text, "5 6"));
+
+  // Urgent items go ahead of everything, one at a time, oldest first, and
+  // there is only so much room for them
+  work_queue_push(queue, items, NULL, 3);
+  CHECK(work_queue_push_urgent(queue, 100) == 0 && work_queue_push_urgent(queue, 101) == 0);
+  CHECK(pop_all(queue, &hits, 64, 0) == 1 && !strcmp(hits.text, "100"));
+  CHECK(pop_all(queue, &hits, 64, 0) == 1 && !strcmp(hits.text, "101"));
+  CHECK(pop_all(queue, &hits, 64, 0) == 3 && !strcmp(hits.text, "1 2 3"));
+  for (i = 0, ok = 1; i < 64; i++) {
+    ok = ok && work_queue_push_urgent(queue, i) == 0;
+  }
+  CHECK(ok && work_queue_push_urgent(queue, 64) == -1);
+  for (i = 0, ok = 1; i < 64; i++) {
+    ok = ok && pop_all(queue, &hits, 64, 0) == 1 && atoi(hits.text) == i;
+  }
+  CHECK(ok);
+
+  // Closing wakes a consumer waiting on an empty queue, and whatever was
+  // pushed before is still handed out before pop says it is over
+  CHECK(pthread_create(&waiter, NULL, pop_until_closed, queue) == 0);
+  usleep(50000);
+  work_queue_close(queue);
+  pthread_join(waiter, &result);
+  CHECK(result == NULL);
+  destroy_work_queue(queue);
+
+  queue = create_work_queue(4);
+  work_queue_push(queue, items, NULL, 3);
+  work_queue_close(queue);
+  CHECK(pop_all(queue, &hits, 64, 0) == 3 && !strcmp(hits.text, "1 2 3"));
+  CHECK(pop_all(queue, &hits, 64, 0) == 0 && pop_all(queue, &hits, 64, 0) == 0);
+  destroy_work_queue(queue);
+
+  // Many producers and consumers on a short queue, so both sides keep
+  // running into it being full or empty
+  queue = create_work_queue(64);
+  for (i = 0; i < QUEUE_CONSUMERS; i++) {
+    consumers[i].queue = queue;
+    consumers[i].id = i;
+    CHECK(pthread_create(&consumer_threads[i], NULL, consume_items, &consumers[i]) == 0);
+  }
+  for (i = 0; i < QUEUE_PRODUCERS; i++) {
+    producers[i].queue = queue;
+    producers[i].id = i;
+    CHECK(pthread_create(&producer_threads[i], NULL, produce_items, &producers[i]) == 0);
+  }
+  for (i = 0; i < QUEUE_PRODUCERS; i++) {
+    pthread_join(producer_threads[i], NULL);
+  }
+  work_queue_close(queue);
+  for (i = 0, ok = 1; i < QUEUE_CONSUMERS; i++) {
+    pthread_join(consumer_threads[i], NULL);
+    ok = ok && consumers[i].ok;
+  }
+  CHECK(ok);
+  for (i = 0, ok = 1; i < QUEUE_PRODUCERS * QUEUE_ITEMS; i++) {
+    ok = ok && delivered[i] == 1;
+  }
+  CHECK(ok);
+  destroy_work_queue(queue);
+}
+
+// ----------------------------------------------------------------------------
+// Directory crawler
+
+#define CRAWL_THREADS 4
+#define CRAWL_GENERATED 40
+
+static char * crawled[4096];
+static int num_crawled, crawl_ends[CRAWL_THREADS], crawl_stop_after, crawl_fail_end;
+static pthread_mutex_t crawled_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int collect_path(void * arg, int worker, const char * path)
+{
+  int error = 0;
+
+  if (path == NULL) {
+    __sync_fetch_and_add(&crawl_ends[worker], 1);
+    if (crawl_fail_end > 0 && worker == crawl_fail_end) {
+      // Well after the calling thread is done with its own part
+      usleep(50000);
+      return(-EPIPE);
+    }
+    return(0);
+  }
+  pthread_mutex_lock(&crawled_lock);
+  if (num_crawled < sizeof(crawled) / sizeof(crawled[0])) {
+    crawled[num_crawled++] = strdup(path + strlen(scratch) + 1);
+  }
+  if (crawl_stop_after > 0 && num_crawled >= crawl_stop_after) {
+    error = -EIO;
+  }
+  pthread_mutex_unlock(&crawled_lock);
+  return(error);
+}
+
+static int compare_paths(const void * a, const void * b)
+{
+  return(strcmp(*(char * const *) a, *(char * const *) b));
+}
+
+// Sorted paths found under the roots (relative to the scratch directory),
+// blank-separated
+static const char * crawl_paths(hits_t * hits, const char * roots, int num_threads,
+                                const char * include, const char * exclude, int * error)
+{
+  const char * root_paths[4], * include_globs[4], * exclude_globs[4];
+  char copies[3][256], * word, * rest;
+  crawl_options_t options = { include_globs, 0, exclude_globs, 0 };
+  int num_roots = 0, i;
+
+  snprintf(copies[0], sizeof(copies[0]), "%s", roots);
+  snprintf(copies[1], sizeof(copies[1]), "%s", include ? include : "");
+  snprintf(copies[2], sizeof(copies[2]), "%s", exclude ? exclude : "");
+  for (word = strtok_r(copies[0], " ", &rest); word != NULL; word = strtok_r(NULL, " ", &rest)) {
+    root_paths[num_roots++] = strdup(scratch_path(word));
+  }
+  for (word = strtok_r(copies[1], " ", &rest); word != NULL; word = strtok_r(NULL, " ", &rest)) {
+    include_globs[options.num_include++] = word;
+  }
+  for (word = strtok_r(copies[2], " ", &rest); word != NULL; word = strtok_r(NULL, " ", &rest)) {
+    exclude_globs[options.num_exclude++] = word;
+  }
+
+  memset(crawl_ends, 0, sizeof(crawl_ends));
+  *error = crawl_directories(root_paths, num_roots, num_threads, &options, collect_path, NULL);
+  qsort(crawled, num_crawled, sizeof(char *), compare_paths);
+  memset(hits, 0, sizeof(hits_t));
+  for (i = 0; i < num_crawled; i++) {
+    add_hit(hits, "%s", crawled[i]);
+    free(crawled[i]);
+  }
+  num_crawled = 0;
+  for (i = 0; i < num_roots; i++) {
+    free((char *) root_paths[i]);
+  }
+  // Every worker says it is done, once
+  for (i = 0; i < CRAWL_THREADS; i++) {
+    CHECK(*error != 0 || crawl_ends[i] == (i < num_threads));
+  }
+  return(hits->text);
+}
+
+// The paths under tree that are always there, plus the generated ones when
+// asked for, sorted like crawl_paths
+static const char * crawl_expected(hits_t * hits, const char * paths, int generated)
+{
+  char copy[1024], * word, * rest;
+  char name[64];
+  int i;
+
+  snprintf(copy, sizeof(copy), "%s", paths);
+  for (word = strtok_r(copy, " ", &rest); word != NULL; word = strtok_r(NULL, " ", &rest)) {
+    crawled[num_crawled++] = strdup(word);
+  }
+  for (i = 0; generated && i < CRAWL_GENERATED; i++) {
+    snprintf(name, sizeof(name), "tree/gen/d%d/f%d.c", i % 7, i);
+    crawled[num_crawled++] = strdup(name);
+  }
+  qsort(crawled, num_crawled, sizeof(char *), compare_paths);
+  memset(hits, 0, sizeof(hits_t));
+  for (i = 0; i < num_crawled; i++) {
+    add_hit(hits, "%s", crawled[i]);
+    free(crawled[i]);
+  }
+  num_crawled = 0;
+  return(hits->text);
+}
+
+static void test_crawler(void)
+{
+  static const char * dirs[] = {
+    "tree", "tree/sub", "tree/sub/deep", "tree/sub/build", "tree/build", "tree/.git",
+    "tree/sub/.svn", "tree/CVS", "tree/.hg", "tree/.bzr", "tree/gen", "other"
+  };
+  static const char * files[] = {
+    "tree/a.c", "tree/a.txt", "tree/sub/b.c", "tree/sub/b.txt", "tree/sub/deep/c.c",
+    "tree/sub/build/d.c", "tree/build/e.c", "tree/build/e.txt", "tree/.git/config.c",
+    "tree/sub/.svn/entries.c", "tree/CVS/Root.c", "tree/.hg/x.c", "tree/.bzr/y.c",
+    "other/o.c"
+  };
+  static const char * everything =
+    "tree/a.c tree/a.txt tree/sub/b.c tree/sub/b.txt tree/sub/deep/c.c tree/sub/build/d.c "
+    "tree/build/e.c tree/build/e.txt";
+  static hits_t found, expected;
+  char name[64];
+  int i, threads, error;
+
+  for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+    mkdir(scratch_path(dirs[i]), 0755);
+  }
+  for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+    write_file(scratch_path(files[i]), "x\n");
+  }
+  for (i = 0; i < CRAWL_GENERATED; i++) {
+    snprintf(name, sizeof(name), "tree/gen/d%d", i % 7);
+    mkdir(scratch_path(name), 0755);
+    snprintf(name, sizeof(name), "tree/gen/d%d/f%d.c", i % 7, i);
+    write_file(scratch_path(name), "x\n");
+  }
+  // Links are not followed, to files or to directories
+  CHECK(symlink(scratch_path("tree/a.c"), scratch_path("tree/link.c")) == 0);
+  CHECK(symlink(scratch_path("other"), scratch_path("tree/linked")) == 0);
+
+  // VCS directories are left out, whatever the number of threads
+  for (threads = 1; threads <= CRAWL_THREADS; threads++) {
+    crawl_paths(&found, "tree", threads, NULL, NULL, &error);
+    CHECK(error == 0 && !strcmp(found.text, crawl_expected(&expected, everything, 1)));
+  }
+
+  // Globs without a '/' match names, at any depth; an excluded directory
+  // is not entered at all
+  crawl_paths(&found, "tree", CRAWL_THREADS, "*.txt", NULL, &error);
+  CHECK(error == 0 && !strcmp(found.text, "tree/a.txt tree/build/e.txt tree/sub/b.txt"));
+  crawl_paths(&found, "tree", CRAWL_THREADS, "*.c", "build gen", &error);
+  CHECK(error == 0 && !strcmp(found.text, "tree/a.c tree/sub/b.c tree/sub/deep/c.c"));
+  crawl_paths(&found, "tree", CRAWL_THREADS, "a.* c.*", "*.txt", &error);
+  CHECK(error == 0 && !strcmp(found.text, "tree/a.c tree/sub/deep/c.c"));
+
+  // Globs with one match whole paths
+  crawl_paths(&found, "tree", CRAWL_THREADS, NULL, "*/tree/build", &error);
+  CHECK(error == 0 && !strcmp(found.text, crawl_expected(&expected,
+        "tree/a.c tree/a.txt tree/sub/b.c tree/sub/b.txt tree/sub/deep/c.c "
+        "tree/sub/build/d.c", 1)));
+  crawl_paths(&found, "tree", CRAWL_THREADS, "*/sub/*", "*/deep/*", &error);
+  CHECK(error == 0 && !strcmp(found.text, "tree/sub/b.c tree/sub/b.txt tree/sub/build/d.c"));
+
+  // Several roots, with or without a trailing slash
+  crawl_paths(&found, "tree/sub/ other", 2, NULL, "build", &error);
+  CHECK(error == 0 &&
+        !strcmp(found.text, "other/o.c tree/sub/b.c tree/sub/b.txt tree/sub/deep/c.c"));
+
+  // A root that is not a directory, or not there, is an error up front
+  crawl_paths(&found, "tree missing", 2, NULL, NULL, &error);
+  CHECK(error == -ENOENT && found.count == 0);
+  crawl_paths(&found, "tree/a.c", 2, NULL, NULL, &error);
+  CHECK(error == -ENOTDIR && found.count == 0);
+
+  // And so is a sink that gives up, which stops the crawl
+  crawl_stop_after = 5;
+  crawl_paths(&found, "tree", CRAWL_THREADS, NULL, NULL, &error);
+  CHECK(error == -EIO && found.count >= 5 && found.count < 48);
+  crawl_stop_after = 0;
+
+  // Even when it only gives up as one of the other workers finishes
+  crawl_fail_end = CRAWL_THREADS - 1;
+  crawl_paths(&found, "tree", CRAWL_THREADS, NULL, NULL, &error);
+  CHECK(error == -EPIPE);
+  crawl_fail_end = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Registry of file states
+
+static file_states_t * file_states;
+static char promoted[1024];
+static pthread_mutex_t promoted_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void note_promoted(const char * name)
+{
+  pthread_mutex_lock(&promoted_lock);
+  strncat(promoted, name, sizeof(promoted) - strlen(promoted) - 2);
+  strcat(promoted, " ");
+  pthread_mutex_unlock(&promoted_lock);
+}
+
+static const char * promoted_names(void)
+{
+  static char copy[1024];
+
+  pthread_mutex_lock(&promoted_lock);
+  strcpy(copy, promoted);
+  pthread_mutex_unlock(&promoted_lock);
+  return(copy);
+}
+
+typedef struct state_waiter_s {
+  pthread_t thread;
+  const char * name;
+  int result;
+} state_waiter_t;
+
+static void * wait_on_file(void * arg)
+{
+  state_waiter_t * waiter = (state_waiter_t *) arg;
+
+  waiter->result = wait_for_file(file_states, waiter->name);
+  return(NULL);
+}
+
+static void start_waiting(state_waiter_t * waiter, const char * name)
+{
+  waiter->name = name;
+  waiter->result = 1;
+  CHECK(pthread_create(&waiter->thread, NULL, wait_on_file, waiter) == 0);
+}
+
+// Whether the waiter is still waiting a little while later
+static int still_waiting(state_waiter_t * waiter)
+{
+  usleep(20000);
+  return(__sync_add_and_fetch(&waiter->result, 0) == 1);
+}
+
+static int finish_waiting(state_waiter_t * waiter)
+{
+  pthread_join(waiter->thread, NULL);
+  return(waiter->result);
+}
+
+// Promotions are made on the waiters' threads, which may not have got to it
+static void wait_for_promotion(const char * expected)
+{
+  int i;
+
+  for (i = 0; i < 500 && strcmp(promoted_names(), expected); i++) {
+    usleep(2000);
+  }
+}
+
+static void test_filestate(void)
+{
+  state_waiter_t waiters[4];
+  char name[32];
+  int i, ok, num_listed;
+
+  file_states = create_file_states(note_promoted);
+  CHECK(file_states != NULL);
+  if (file_states == NULL) {
+    return;
+  }
+
+  // States stick, and only a queued file can be claimed, once
+  CHECK(get_file_state(file_states, "unknown") == FILE_UNLISTED);
+  CHECK(set_file_state(file_states, "a", FILE_QUEUED) == 0);
+  CHECK(get_file_state(file_states, "a") == FILE_QUEUED);
+  CHECK(claim_file(file_states, "a") == 0 && get_file_state(file_states, "a") == FILE_INDEXING);
+  CHECK(claim_file(file_states, "a") == -1 && claim_file(file_states, "unknown") == -1);
+  CHECK(set_file_state(file_states, "a", FILE_INDEXED) == 0);
+  CHECK(set_file_state(file_states, "f", FILE_FAILED) == 0);
+
+  // Done one way or the other, there is nothing to wait for
+  CHECK(wait_for_file(file_states, "a") == 0 && wait_for_file(file_states, "f") == -1);
+
+  // A waiter on a queued file promotes it, once however many wait, and is
+  // woken when it is indexed
+  CHECK(set_file_state(file_states, "q", FILE_QUEUED) == 0);
+  start_waiting(&waiters[0], "q");
+  start_waiting(&waiters[1], "q");
+  wait_for_promotion("q ");
+  CHECK(!strcmp(promoted_names(), "q "));
+  CHECK(still_waiting(&waiters[0]) && still_waiting(&waiters[1]));
+  CHECK(claim_file(file_states, "q") == 0 && set_file_state(file_states, "q", FILE_INDEXED) == 0);
+  CHECK(finish_waiting(&waiters[0]) == 0 && finish_waiting(&waiters[1]) == 0);
+
+  // A file waited on before it is listed is promoted when it is queued, and
+  // its waiter told when it fails
+  start_waiting(&waiters[0], "later");
+  CHECK(still_waiting(&waiters[0]));
+  CHECK(set_file_state(file_states, "later", FILE_QUEUED) == 0);
+  CHECK(!strcmp(promoted_names(), "q later "));
+  CHECK(still_waiting(&waiters[0]));
+  CHECK(set_file_state(file_states, "later", FILE_FAILED) == 0);
+  CHECK(finish_waiting(&waiters[0]) == -1);
+
+  // A waiter only wakes for its own file
+  CHECK(set_file_state(file_states, "mine", FILE_INDEXING) == 0);
+  start_waiting(&waiters[0], "mine");
+  CHECK(set_file_state(file_states, "other", FILE_INDEXED) == 0);
+  CHECK(still_waiting(&waiters[0]));
+  CHECK(set_file_state(file_states, "mine", FILE_INDEXED) == 0);
+  CHECK(finish_waiting(&waiters[0]) == 0);
+
+  // Once the listing is closed, waiting on files nobody listed is over,
+  // but not on the ones being indexed, until indexing is over too. Paths
+  // nobody listed are only kept while somebody waits on them.
+  CHECK(set_file_state(file_states, "slow", FILE_INDEXING) == 0);
+  num_listed = count_file_states(file_states);
+  start_waiting(&waiters[0], "never");
+  start_waiting(&waiters[1], "slow");
+  start_waiting(&waiters[2], "never");
+  start_waiting(&waiters[3], "nowhere");
+  CHECK(still_waiting(&waiters[0]) && still_waiting(&waiters[1]) &&
+        still_waiting(&waiters[2]) && still_waiting(&waiters[3]));
+  CHECK(count_file_states(file_states) == num_listed + 2);
+  close_file_listing(file_states);
+  CHECK(finish_waiting(&waiters[0]) == -1 && finish_waiting(&waiters[2]) == -1 &&
+        finish_waiting(&waiters[3]) == -1);
+  CHECK(count_file_states(file_states) == num_listed);
+  CHECK(get_file_state(file_states, "never") == FILE_UNLISTED);
+  CHECK(wait_for_file(file_states, "never") == -1);
+  CHECK(count_file_states(file_states) == num_listed);
+  CHECK(still_waiting(&waiters[1]));
+  finish_file_states(file_states);
+  CHECK(finish_waiting(&waiters[1]) == -1);
+  CHECK(wait_for_file(file_states, "a") == 0 && wait_for_file(file_states, "slow") == -1);
+  destroy_file_states(file_states);
+
+  // Lots of files, enough for the shards to grow, keep their states
+  file_states = create_file_states(NULL);
+  for (i = 0; i < 5000; i++) {
+    snprintf(name, sizeof(name), "file%d", i);
+    CHECK(set_file_state(file_states, name, i % 2 ? FILE_QUEUED : FILE_INDEXED) == 0);
+  }
+  for (i = 0, ok = 1; i < 5000; i++) {
+    snprintf(name, sizeof(name), "file%d", i);
+    ok = ok && get_file_state(file_states, name) == (i % 2 ? FILE_QUEUED : FILE_INDEXED);
+  }
+  CHECK(ok);
+  destroy_file_states(file_states);
+}
+
+// ----------------------------------------------------------------------------
+
+static const struct {
+  const char * name;
+  test_group_fn_t fn;
+} groups[] = {
+  { "registry", test_registry },
+  { "snapshot", test_snapshot },
+  { "incremental", test_incremental },
+  { "boolean", test_boolean },
+  { "phrase", test_phrase },
+  { "dictionary", test_dictionary },
+  { "fuzzy", test_fuzzy },
+  { "ranked", test_ranked },
+  { "cache", test_cache },
+  { "server", test_server },
+  { "chunked", test_chunked },
+  { "workqueue", test_workqueue },
+  { "crawler", test_crawler },
+  { "filestate", test_filestate },
+};
+
+static int remove_entry(const char * path, const struct stat * st, int flag, struct FTW * ftw)
+{
+  return(remove(path));
+}
+
+int main(int argc, char * argv[])
+{
+  int num_groups = sizeof(groups) / sizeof(groups[0]);
+  int i, j, failed = 0;
+
+  snprintf(scratch, sizeof(scratch), "/tmp/search-test-XXXXXX");
+  if (mkdtemp(scratch) == NULL) {
+    perror("mkdtemp");
+    return(1);
+  }
+  for (i = 0; i < num_groups; i++) {
+    for (j = 1; j < argc && strcmp(argv[j], groups[i].name); j++) {
+    }
+    if (argc == 1 || j < argc) {
+      failed += !run_group(groups[i].name, groups[i].fn);
+    }
+  }
+  nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  return(failed ? 1 : 0);
+}
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tokenizer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_PATH
+#endif
+
+// Same set strtok_r was called with, NUL added so binary files split sanely
+static const char delimiters[] = " \n\t-_!@#$%^&*()[]{}:;_+=,./<>?";
+
+// is_delim[c] is 1 for delimiter bytes, used by the scalar path
+static unsigned char is_delim[256];
+
+// Nibble lookup tables for the vector path: byte c is a delimiter when
+// (delim_lo[c & 0xf] & delim_hi[c >> 4]) != 0. All delimiters are ASCII, so
+// delim_hi only has bits for the low eight high-nibbles.
+static unsigned char delim_lo[16];
+static unsigned char delim_hi[16];
+
+static pthread_once_t tokenizer_once = PTHREAD_ONCE_INIT;
+
+//
+// Classifies 64 bytes at p: bit i of the result is set when p[i] is a
+// delimiter, bit i of *newlines when p[i] is '\n'.
+//
+typedef uint64_t (*classify_fn)(const unsigned char * p, uint64_t * newlines);
+
+static uint64_t classify_scalar(const unsigned char * p, uint64_t * newlines)
+{
+  uint64_t delim = 0, nl = 0;
+  int i;
+
+  for (i = 0; i < 64; i++) {
+    delim |= (uint64_t) is_delim[p[i]] << i;
+    nl |= (uint64_t) (p[i] == '\n') << i;
+  }
+  *newlines = nl;
+  return(delim);
+}
+
+#ifdef HAVE_AVX2_PATH
+__attribute__((target("avx2")))
+static uint32_t classify_half_avx2(const unsigned char * p, uint32_t * newlines)
+{
+  const __m256i lo_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) delim_lo));
+  const __m256i hi_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) delim_hi));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i v = _mm256_loadu_si256((const __m256i *) p);
+  __m256i lo = _mm256_and_si256(v, nibble);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+  __m256i hit = _mm256_and_si256(_mm256_shuffle_epi8(lo_lut, lo),
+                                 _mm256_shuffle_epi8(hi_lut, hi));
+  uint32_t word = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, _mm256_setzero_si256()));
+
+  *newlines = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+  return(~word);
+}
+
+__attribute__((target("avx2")))
+static uint64_t classify_avx2(const unsigned char * p, uint64_t * newlines)
+{
+  uint32_t nl_lo, nl_hi;
+  uint64_t delim = classify_half_avx2(p, &nl_lo);
+  delim |= (uint64_t) classify_half_avx2(p + 32, &nl_hi) << 32;
+  *newlines = nl_lo | ((uint64_t) nl_hi << 32);
+  return(delim);
+}
+#endif
+
+static classify_fn classify = classify_scalar;
+
+static void tokenizer_setup()
+{
+  const unsigned char * c;
+  int i;
+
+  is_delim[0] = 1;
+  delim_lo[0] |= 1;
+  for (c = (const unsigned char *) delimiters; *c; c++) {
+    is_delim[*c] = 1;
+    delim_lo[*c & 0xf] |= 1 << (*c >> 4);
+  }
+  for (i = 0; i < 8; i++) {
+    delim_hi[i] = 1 << i;
+  }
+
+#ifdef HAVE_AVX2_PATH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    classify = classify_avx2;
+  }
+#endif
+}
+
+//
+// Loads the masks for the block at tokenizer->block. prev_delim is the
+// classification of the byte just before the block (1 at the very start),
+// so a token start is a non-delimiter whose predecessor is a delimiter.
+//
+static void load_block(tokenizer_t * tokenizer, uint64_t prev_delim)
+{
+  const unsigned char * p = tokenizer->buf + tokenizer->block;
+  size_t remaining = tokenizer->len - tokenizer->block;
+  unsigned char tail[64];
+
+  // Pad the last partial block with delimiters
+  if (remaining < 64) {
+    memset(tail, ' ', sizeof(tail));
+    memcpy(tail, p, remaining);
+    p = tail;
+  }
+  tokenizer->delim = classify(p, &tokenizer->newline);
+  tokenizer->starts = ~tokenizer->delim & ((tokenizer->delim << 1) | prev_delim);
+}
+
+void tokenizer_init(tokenizer_t * tokenizer, const char * buf, size_t len,
+                    int first_line)
+{
+  pthread_once(&tokenizer_once, tokenizer_setup);
+
+  memset(tokenizer, 0, sizeof(tokenizer_t));
+  tokenizer->buf = (const unsigned char *) buf;
+  tokenizer->len = len;
+  tokenizer->block_line = first_line;
+  if (len > 0) {
+    load_block(tokenizer, 1);
+  }
+}
+
+//
+// Fills tokens with up to max_tokens spans and returns how many were found,
+// 0 once the buffer is exhausted.
+//
+int tokenizer_next(tokenizer_t * tokenizer, token_t * tokens, int max_tokens)
+{
+  int n = 0;
+
+  while (n < max_tokens) {
+    uint64_t rest;
+    size_t end;
+    int i;
+
+    // Move on to the next block with at least one token start in it
+    while (tokenizer->starts == 0) {
+      if (tokenizer->block >= tokenizer->len) {
+        return(n);
+      }
+      uint64_t prev_delim = tokenizer->delim >> 63;
+      tokenizer->block_line += __builtin_popcountll(tokenizer->newline);
+      tokenizer->block += 64;
+      if (tokenizer->block >= tokenizer->len) {
+        return(n);
+      }
+      load_block(tokenizer, prev_delim);
+    }
+
+    i = __builtin_ctzll(tokenizer->starts);
+    tokenizer->starts &= tokenizer->starts - 1;
+
+    // The token ends at the next delimiter, which is usually in this block
+    rest = tokenizer->delim & (~0ULL << i);
+    if (rest) {
+      end = tokenizer->block + __builtin_ctzll(rest);
+    } else {
+      end = tokenizer->block + 64;
+      while (end < tokenizer->len && !is_delim[tokenizer->buf[end]]) {
+        end++;
+      }
+    }
+
+    tokens[n].offset = tokenizer->block + i;
+    tokens[n].length = (int) (end - tokens[n].offset);
+    tokens[n].line = tokenizer->block_line +
+      __builtin_popcountll(tokenizer->newline & ((1ULL << i) - 1));
+    n++;
+  }
+  return(n);
+}
+
+// ----------------------------------------------------------------------------
+// File ingestion
+// ----------------------------------------------------------------------------
+
+//
+// Content hash for file stamps. Bytes are folded in eight at a time; up to
+// seven left over at the end of a buffer are carried into the next one, so
+// the result only depends on the contents and not on how they were read.
+//
+static inline uint64_t content_hash_mix(uint64_t hash, uint64_t word)
+{
+  hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+  return(hash ^ (hash >> 29));
+}
+
+static void content_hash_init(content_hash_t * h)
+{
+  memset(h, 0, sizeof(content_hash_t));
+  h->hash = 0xcbf29ce484222325ULL;
+}
+
+static void content_hash_update(content_hash_t * h, const char * buf, size_t len)
+{
+  size_t i = 0;
+  uint64_t word;
+
+  h->length += len;
+  while (i < len && h->carried != 0) {
+    h->carry |= (uint64_t) (unsigned char) buf[i++] << (8 * h->carried);
+    if (++h->carried == 8) {
+      h->hash = content_hash_mix(h->hash, h->carry);
+      h->carry = 0;
+      h->carried = 0;
+    }
+  }
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&word, buf + i, 8);
+    h->hash = content_hash_mix(h->hash, word);
+  }
+  for (; i < len; i++) {
+    h->carry |= (uint64_t) (unsigned char) buf[i] << (8 * h->carried++);
+  }
+}
+
+static uint64_t content_hash_final(content_hash_t * h)
+{
+  return content_hash_mix(content_hash_mix(h->hash, h->carry), h->length);
+}
+
+//
+// Where the next token goes within its line. Kept by the caller so that a
+// line split across two chunk reads keeps counting from where it left off.
+//
+typedef struct line_position_s {
+  int line;
+  int next;
+} line_position_t;
+
+static int tokenize_buffer(const char * buf, size_t len, int first_line,
+                           token_sink_t sink, void * arg, line_position_t * lp)
+{
+  tokenizer_t tokenizer;
+  token_t tokens[TOKEN_BATCH];
+  int num_tokens, i, error;
+
+  tokenizer_init(&tokenizer, buf, len, first_line);
+  while ((num_tokens = tokenizer_next(&tokenizer, tokens, TOKEN_BATCH)) > 0) {
+    for (i = 0; i < num_tokens; i++) {
+      if (tokens[i].line != lp->line) {
+        lp->line = tokens[i].line;
+        lp->next = 0;
+      }
+      error = sink(arg, buf + tokens[i].offset, tokens[i].length, tokens[i].line,
+                   lp->next++);
+      if (error < 0) {
+        return(error);
+      }
+    }
+  }
+  return(0);
+}
+
+static int count_lines(const char * buf, size_t len)
+{
+  const char * end = buf + len;
+  int lines = 0;
+
+  while ((buf = memchr(buf, '\n', end - buf)) != NULL) {
+    lines++;
+    buf++;
+  }
+  return(lines);
+}
+
+// Returns 1 without touching the sink if the file could not be mapped
+// A NULL sink only hashes the file.
+static int tokenize_mapped(int fd, size_t size, token_sink_t sink, void * arg,
+                           content_hash_t * hash)
+{
+  line_position_t lp = { 0, 0 };
+  char * map;
+  int error = 0;
+
+  map = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    return(1);
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  if (sink != NULL) {
+    error = tokenize_buffer(map, size, 1, sink, arg, &lp);
+  }
+  if (hash != NULL) {
+    content_hash_update(hash, map, size);
+  }
+  munmap(map, size);
+  return(error);
+}
+
+//
+// Chunked fallback. A chunk is only tokenized up to its last delimiter; the
+// partial word after it is moved to the front of the buffer and completed by
+// the next read. The buffer doubles if a single word outgrows it. size_hint
+// is the file size when known, so small files get a small buffer.
+//
+static int tokenize_chunked(int fd, size_t size_hint, int seekable,
+                            token_sink_t sink, void * arg, content_hash_t * hash)
+{
+  line_position_t lp = { 0, 0 };
+  size_t size = READ_CHUNK, used = 0, done;
+  off_t offset = 0;
+  int line_number = 1;
+  int error = 0;
+  ssize_t got;
+  char * buf;
+
+  pthread_once(&tokenizer_once, tokenizer_setup);
+  if (seekable && size_hint < size) {
+    size = size_hint + 1;
+  }
+  buf = (char *) malloc(size);
+  if (buf == NULL) {
+    return(-ENOMEM);
+  }
+
+  for (;;) {
+    if (used == size) {
+      char * new_buf = (char *) realloc(buf, 2 * size);
+      if (new_buf == NULL) {
+        error = -ENOMEM;
+        break;
+      }
+      buf = new_buf;
+      size *= 2;
+    }
+
+    got = seekable ? pread(fd, buf + used, size - used, offset)
+                   : read(fd, buf + used, size - used);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = -errno;
+      break;
+    }
+    if (hash != NULL) {
+      content_hash_update(hash, buf + used, got);
+    }
+    offset += got;
+    used += got;
+
+    if (sink == NULL) {
+      used = 0;
+      if (got == 0) {
+        break;
+      }
+      continue;
+    }
+    if (got == 0) {
+      // End of file, whatever is left is the last word
+      error = tokenize_buffer(buf, used, line_number, sink, arg, &lp);
+      break;
+    }
+
+    for (done = used; done > 0 && !is_delim[(unsigned char) buf[done - 1]]; done--) {
+    }
+    if (done == 0) {
+      continue;
+    }
+    error = tokenize_buffer(buf, done, line_number, sink, arg, &lp);
+    if (error < 0) {
+      break;
+    }
+    line_number += count_lines(buf, done);
+    memmove(buf, buf + done, used - done);
+    used -= done;
+  }
+
+  free(buf);
+  return(error);
+}
+
+static void stamp_from_stat(file_stamp_t * stamp, const struct stat * st)
+{
+  stamp->size = st->st_size;
+  stamp->mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+  stamp->inode = st->st_ino;
+  stamp->hash = 0;
+}
+
+int tokenize_file(const char * file_name, token_sink_t sink, void * arg,
+                  file_stamp_t * stamp)
+{
+  content_hash_t hash;
+  struct stat st;
+  int fd, error;
+
+  fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    return(-errno);
+  }
+  if (fstat(fd, &st)) {
+    error = -errno;
+    close(fd);
+    return(error);
+  }
+
+  error = 1;
+  content_hash_init(&hash);
+  if (S_ISREG(st.st_mode) && st.st_size >= MMAP_MIN_SIZE) {
+    error = tokenize_mapped(fd, st.st_size, sink, arg, stamp ? &hash : NULL);
+  }
+  if (error == 1) {
+    error = tokenize_chunked(fd, st.st_size, S_ISREG(st.st_mode), sink, arg,
+                             stamp ? &hash : NULL);
+  }
+  close(fd);
+  if (stamp != NULL) {
+    stamp_from_stat(stamp, &st);
+    stamp->hash = content_hash_final(&hash);
+  }
+  return(error);
+}
+
+int stamp_file(const char * file_name, file_stamp_t * stamp, int hash_content)
+{
+  struct stat st;
+
+  if (hash_content) {
+    return tokenize_file(file_name, NULL, NULL, stamp);
+  }
+  if (stat(file_name, &st)) {
+    return(-errno);
+  }
+  stamp_from_stat(stamp, &st);
+  return(0);
+}
+
+//
+// Mapped files, tokenized a range at a time
+//
+int map_file(const char * file_name, mapped_file_t * file)
+{
+  struct stat st;
+  int fd, error = 0;
+
+  fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    return(-errno);
+  }
+  if (fstat(fd, &st)) {
+    error = -errno;
+  } else if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    error = -EINVAL;
+  } else {
+    file->map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file->map == MAP_FAILED) {
+      error = -errno;
+    }
+  }
+  close(fd);
+  if (error == 0) {
+    file->size = st.st_size;
+    stamp_from_stat(&file->stamp, &st);
+    content_hash_init(&file->hash);
+  }
+  return(error);
+}
+
+//
+// Cuts the file into ranges of about chunk_size bytes, each ending just
+// after a newline (or at the end of the file). bounds gets the start of
+// every range followed by the end of the file, so it needs room for
+// max_chunks + 1 offsets. Returns the number of ranges.
+//
+int split_mapped_file(const mapped_file_t * file, size_t chunk_size, size_t * bounds,
+                      int max_chunks)
+{
+  int num_chunks = 1;
+  size_t next = chunk_size;
+
+  bounds[0] = 0;
+  while (num_chunks < max_chunks && next < file->size) {
+    const char * newline = memchr(file->map + next, '\n', file->size - next);
+    if (newline == NULL || newline + 1 == file->map + file->size) {
+      break;
+    }
+    bounds[num_chunks++] = newline + 1 - file->map;
+    next = newline + 1 - file->map + chunk_size;
+  }
+  bounds[num_chunks] = file->size;
+  return(num_chunks);
+}
+
+int tokenize_mapped_range(const mapped_file_t * file, size_t begin, size_t end,
+                          token_sink_t sink, void * arg, int * num_lines)
+{
+  line_position_t lp = { 0, 0 };
+
+  *num_lines = count_lines(file->map + begin, end - begin);
+  return tokenize_buffer(file->map + begin, end - begin, 1, sink, arg, &lp);
+}
+
+void hash_mapped_range(mapped_file_t * file, size_t begin, size_t end)
+{
+  content_hash_update(&file->hash, file->map + begin, end - begin);
+}
+
+void unmap_file(mapped_file_t * file, file_stamp_t * stamp)
+{
+  if (stamp != NULL) {
+    *stamp = file->stamp;
+    stamp->hash = content_hash_final(&file->hash);
+  }
+  munmap(file->map, file->size);
+}
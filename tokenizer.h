@@ -0,0 +1,95 @@
+#ifndef __TOKENIZER_H_537__
+#define __TOKENIZER_H_537__
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Splits a buffer into words on the same delimiters the indexer has always
+// used (plus NUL). Tokens come out as spans into the caller's buffer, which
+// is never modified, so there is nothing to copy or free.
+//
+#define TOKEN_BATCH 256
+
+typedef struct token_s {
+  size_t offset;
+  int length;
+  int line;
+} token_t;
+
+typedef struct tokenizer_s {
+  const unsigned char * buf;
+  size_t len;
+  size_t block;
+  uint64_t delim;
+  uint64_t newline;
+  uint64_t starts;
+  int block_line;
+} tokenizer_t;
+
+void tokenizer_init(tokenizer_t * tokenizer, const char * buf, size_t len,
+                    int first_line);
+int tokenizer_next(tokenizer_t * tokenizer, token_t * tokens, int max_tokens);
+
+//
+// Tokenizes a whole file without going through stdio: regular files of at
+// least MMAP_MIN_SIZE bytes are mapped and scanned in place, anything else
+// (small files, pipes, failed mappings) is read in READ_CHUNK pieces. Every
+// token is passed to sink along with its 1-based line number and its 0-based
+// position among the tokens of that line; a negative return from sink stops
+// the scan and is returned.
+//
+#define MMAP_MIN_SIZE (64 * 1024)
+#define READ_CHUNK (1024 * 1024)
+
+typedef int (*token_sink_t)(void * arg, const char * word, int length,
+                            int line_number, int position);
+
+//
+// What a file looked like when it was read: size, modification time and
+// inode from fstat, plus a hash of the bytes that were actually tokenized.
+// tokenize_file fills one in when given a non-NULL stamp; stamp_file gets
+// one without tokenizing, reading the contents only if asked to hash them.
+//
+typedef struct file_stamp_s {
+  uint64_t size;
+  int64_t mtime;
+  uint64_t inode;
+  uint64_t hash;
+} file_stamp_t;
+
+int tokenize_file(const char * file_name, token_sink_t sink, void * arg,
+                  file_stamp_t * stamp);
+int stamp_file(const char * file_name, file_stamp_t * stamp, int hash_content);
+
+//
+// A big file can also be mapped once and tokenized in ranges by several
+// threads at once. Ranges start at line boundaries (split_mapped_file makes
+// sure of that): line numbers and positions count from the start of the
+// range, and the newlines in it are returned so the caller can add up the
+// line offsets of the ranges after it. The content hash is fed a range at a
+// time, in file order, and the stamp comes out of unmap_file.
+//
+typedef struct content_hash_s {
+  uint64_t hash;
+  uint64_t carry;
+  uint64_t length;
+  int carried;
+} content_hash_t;
+
+typedef struct mapped_file_s {
+  char * map;
+  size_t size;
+  file_stamp_t stamp;
+  content_hash_t hash;
+} mapped_file_t;
+
+int map_file(const char * file_name, mapped_file_t * file);
+int split_mapped_file(const mapped_file_t * file, size_t chunk_size, size_t * bounds,
+                      int max_chunks);
+int tokenize_mapped_range(const mapped_file_t * file, size_t begin, size_t end,
+                          token_sink_t sink, void * arg, int * num_lines);
+void hash_mapped_range(mapped_file_t * file, size_t begin, size_t end);
+void unmap_file(mapped_file_t * file, file_stamp_t * stamp);
+
+#endif // __TOKENIZER_H_537__
@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "workqueue.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define cpu_relax() _mm_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+//
+// Vyukov's bounded MPMC queue. Slot i of the ring starts with sequence i.
+// A producer at position pos may fill the slot when its sequence is pos,
+// and then sets it to pos + 1; a consumer at pos may empty it when its
+// sequence is pos + 1, and then sets it to pos + depth, which is when the
+// producer one lap later may have it. Claiming a run of slots is one CAS
+// on the shared position after checking that every slot in the run is
+// ready, so a batch costs about as much as a single item.
+//
+// A consumer also ends its run before a slot that would take the run's
+// total weight over its budget. Weights are written before the sequence
+// that publishes them, and a run whose slots were taken and refilled in
+// the meantime fails its compare-and-swap, so the weights seen are those
+// of the items claimed.
+//
+// Each side keeps its position on its own cache line. Waiting threads spin
+// QUEUE_SPINS times before parking, unless there is only the one CPU for
+// the thread they are waiting on to run on.
+//
+// The urgent lane is a small ring under its own lock, which consumers only
+// take after seeing a non-zero count there.
+//
+#define QUEUE_SPINS 256
+#define URGENT_SLOTS 64
+#define CACHE_LINE 64
+
+typedef struct queue_slot_s {
+  volatile uint64_t sequence;
+  int item;
+  unsigned int weight;
+} queue_slot_t;
+
+typedef struct queue_parking_s {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  volatile int parked;
+} queue_parking_t;
+
+struct work_queue_s {
+  queue_slot_t * slots;
+  uint64_t mask;
+  int spins;
+  char pad0[CACHE_LINE];
+  volatile uint64_t enqueue_pos;
+  char pad1[CACHE_LINE];
+  volatile uint64_t dequeue_pos;
+  char pad2[CACHE_LINE];
+  volatile int closed;
+  pthread_mutex_t urgent_lock;
+  int urgent[URGENT_SLOTS];
+  int urgent_head;
+  volatile int urgent_count;
+  queue_parking_t producers;
+  queue_parking_t consumers;
+};
+
+static int init_parking(queue_parking_t * parking)
+{
+  parking->parked = 0;
+  if (pthread_mutex_init(&parking->lock, NULL)) {
+    return(-1);
+  }
+  if (pthread_cond_init(&parking->wake, NULL)) {
+    pthread_mutex_destroy(&parking->lock);
+    return(-1);
+  }
+  return(0);
+}
+
+work_queue_t * create_work_queue(int depth)
+{
+  work_queue_t * queue;
+  // With a single slot, a full one would look empty to the next producer
+  uint64_t size = 2, i;
+
+  while (size < (uint64_t) depth) {
+    size *= 2;
+  }
+  queue = (work_queue_t *) calloc(1, sizeof(work_queue_t));
+  if (queue == NULL) {
+    return(NULL);
+  }
+  queue->slots = (queue_slot_t *) calloc(size, sizeof(queue_slot_t));
+  if (queue->slots == NULL || init_parking(&queue->producers)) {
+    free(queue->slots);
+    free(queue);
+    return(NULL);
+  }
+  if (init_parking(&queue->consumers)) {
+    pthread_cond_destroy(&queue->producers.wake);
+    pthread_mutex_destroy(&queue->producers.lock);
+    free(queue->slots);
+    free(queue);
+    return(NULL);
+  }
+  if (pthread_mutex_init(&queue->urgent_lock, NULL)) {
+    pthread_cond_destroy(&queue->consumers.wake);
+    pthread_mutex_destroy(&queue->consumers.lock);
+    pthread_cond_destroy(&queue->producers.wake);
+    pthread_mutex_destroy(&queue->producers.lock);
+    free(queue->slots);
+    free(queue);
+    return(NULL);
+  }
+  for (i = 0; i < size; i++) {
+    queue->slots[i].sequence = i;
+  }
+  queue->mask = size - 1;
+  queue->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPINS : 0;
+  return(queue);
+}
+
+void destroy_work_queue(work_queue_t * queue)
+{
+  pthread_cond_destroy(&queue->producers.wake);
+  pthread_mutex_destroy(&queue->producers.lock);
+  pthread_cond_destroy(&queue->consumers.wake);
+  pthread_mutex_destroy(&queue->consumers.lock);
+  pthread_mutex_destroy(&queue->urgent_lock);
+  free(queue->slots);
+  free(queue);
+}
+
+//
+// Claims up to max_items slots at the position pointed to by pos whose
+// sequence is ready + their offset from it, and weighing no more than
+// budget after the first, and returns how many, along with the first
+// claimed position.
+//
+static int claim_slots(work_queue_t * queue, volatile uint64_t * pos, uint64_t ready,
+                       int max_items, uint64_t budget, uint64_t * first)
+{
+  uint64_t start = *pos;
+
+  for (;;) {
+    uint64_t weight = 0;
+    int n = 0;
+
+    while (n < max_items) {
+      queue_slot_t * slot = &queue->slots[(start + n) & queue->mask];
+      if (slot->sequence != start + n + ready) {
+        break;
+      }
+      weight += slot->weight;
+      if (n > 0 && weight > budget) {
+        break;
+      }
+      n++;
+    }
+    if (n == 0) {
+      // Somebody moved on while we looked, or there is nothing to claim
+      uint64_t now = *pos;
+      if (now == start) {
+        return(0);
+      }
+      start = now;
+      continue;
+    }
+    uint64_t seen = __sync_val_compare_and_swap(pos, start, start + n);
+    if (seen == start) {
+      *first = start;
+      return(n);
+    }
+    start = seen;
+  }
+}
+
+// Wakes whoever is parked on the other side, if anyone
+static void unpark(queue_parking_t * parking)
+{
+  __sync_synchronize();
+  if (parking->parked) {
+    pthread_mutex_lock(&parking->lock);
+    pthread_cond_broadcast(&parking->wake);
+    pthread_mutex_unlock(&parking->lock);
+  }
+}
+
+// The other side is woken by the callers, which must not hold a parking
+// lock while doing so: producers and consumers would take both in turn.
+static int push_items(work_queue_t * queue, const int * items,
+                      const unsigned int * weights, int num_items)
+{
+  uint64_t first;
+  int n, i;
+
+  n = claim_slots(queue, &queue->enqueue_pos, 0, num_items, UINT64_MAX, &first);
+  for (i = 0; i < n; i++) {
+    queue_slot_t * slot = &queue->slots[(first + i) & queue->mask];
+    slot->item = items[i];
+    slot->weight = weights != NULL ? weights[i] : 0;
+    __sync_synchronize();
+    slot->sequence = first + i + 1;
+  }
+  return(n);
+}
+
+static int pop_items(work_queue_t * queue, int * items, int max_items, uint64_t budget)
+{
+  uint64_t first;
+  int n, i;
+
+  n = claim_slots(queue, &queue->dequeue_pos, 1, max_items, budget, &first);
+  for (i = 0; i < n; i++) {
+    queue_slot_t * slot = &queue->slots[(first + i) & queue->mask];
+    items[i] = slot->item;
+    __sync_synchronize();
+    slot->sequence = first + i + queue->mask + 1;
+  }
+  return(n);
+}
+
+// Takes the oldest urgent item, if there is one
+static int pop_urgent(work_queue_t * queue, int * items)
+{
+  int n = 0;
+
+  if (queue->urgent_count == 0) {
+    return(0);
+  }
+  pthread_mutex_lock(&queue->urgent_lock);
+  if (queue->urgent_count > 0) {
+    items[0] = queue->urgent[queue->urgent_head];
+    queue->urgent_head = (queue->urgent_head + 1) % URGENT_SLOTS;
+    queue->urgent_count--;
+    n = 1;
+  }
+  pthread_mutex_unlock(&queue->urgent_lock);
+  return(n);
+}
+
+int work_queue_push_urgent(work_queue_t * queue, int item)
+{
+  pthread_mutex_lock(&queue->urgent_lock);
+  if (queue->urgent_count == URGENT_SLOTS) {
+    pthread_mutex_unlock(&queue->urgent_lock);
+    return(-1);
+  }
+  queue->urgent[(queue->urgent_head + queue->urgent_count) % URGENT_SLOTS] = item;
+  queue->urgent_count++;
+  pthread_mutex_unlock(&queue->urgent_lock);
+  unpark(&queue->consumers);
+  return(0);
+}
+
+int work_queue_try_push(work_queue_t * queue, const int * items,
+                        const unsigned int * weights, int num_items)
+{
+  int n = push_items(queue, items, weights, num_items);
+
+  if (n > 0) {
+    unpark(&queue->consumers);
+  }
+  return(n);
+}
+
+static int try_pop(work_queue_t * queue, int * items, int max_items, uint64_t budget)
+{
+  int n = pop_urgent(queue, items);
+
+  if (n > 0) {
+    return(n);
+  }
+  n = pop_items(queue, items, max_items, budget);
+
+  if (n > 0) {
+    unpark(&queue->producers);
+  }
+  return(n);
+}
+
+void work_queue_push(work_queue_t * queue, const int * items,
+                     const unsigned int * weights, int num_items)
+{
+  int spins = 0;
+
+  while (num_items > 0) {
+    int n = work_queue_try_push(queue, items, weights, num_items);
+
+    items += n;
+    weights = weights != NULL ? weights + n : NULL;
+    num_items -= n;
+    if (num_items == 0) {
+      break;
+    }
+    if (n > 0 || spins++ < queue->spins) {
+      cpu_relax();
+      continue;
+    }
+
+    // Full for a while: park until a consumer makes room. Being counted as
+    // parked before the last look means a consumer that frees a slot after
+    // it will see us and wake us.
+    pthread_mutex_lock(&queue->producers.lock);
+    __sync_fetch_and_add(&queue->producers.parked, 1);
+    n = push_items(queue, items, weights, num_items);
+    if (n == 0) {
+      pthread_cond_wait(&queue->producers.wake, &queue->producers.lock);
+    }
+    __sync_fetch_and_sub(&queue->producers.parked, 1);
+    pthread_mutex_unlock(&queue->producers.lock);
+    if (n > 0) {
+      unpark(&queue->consumers);
+    }
+    items += n;
+    weights = weights != NULL ? weights + n : NULL;
+    num_items -= n;
+    spins = 0;
+  }
+}
+
+int work_queue_pop(work_queue_t * queue, int * items, int max_items, uint64_t budget)
+{
+  int spins = 0;
+
+  for (;;) {
+    int n = try_pop(queue, items, max_items, budget);
+    if (n > 0) {
+      return(n);
+    }
+    if (spins++ < queue->spins) {
+      cpu_relax();
+      continue;
+    }
+
+    // Empty for a while: park until a producer adds something or closes
+    pthread_mutex_lock(&queue->consumers.lock);
+    __sync_fetch_and_add(&queue->consumers.parked, 1);
+    n = pop_urgent(queue, items);
+    if (n == 0) {
+      n = pop_items(queue, items, max_items, budget);
+    }
+    if (n == 0 && !queue->closed) {
+      pthread_cond_wait(&queue->consumers.wake, &queue->consumers.lock);
+    }
+    __sync_fetch_and_sub(&queue->consumers.parked, 1);
+    pthread_mutex_unlock(&queue->consumers.lock);
+    if (n > 0) {
+      unpark(&queue->producers);
+      return(n);
+    }
+    if (queue->closed) {
+      // Whatever was pushed before closing is still handed out
+      return try_pop(queue, items, max_items, budget);
+    }
+    spins = 0;
+  }
+}
+
+void work_queue_close(work_queue_t * queue)
+{
+  pthread_mutex_lock(&queue->consumers.lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->consumers.wake);
+  pthread_mutex_unlock(&queue->consumers.lock);
+}
@@ -0,0 +1,45 @@
+#ifndef __WORKQUEUE_H_537__
+#define __WORKQUEUE_H_537__
+
+#include <stdint.h>
+
+//
+// Bounded multi-producer, multi-consumer queue of ints (file ids) between
+// the scanner and the indexers. The ring itself is lock-free: every slot
+// carries a sequence number that says whose turn it is, and producers and
+// consumers claim runs of slots with a single compare-and-swap each.
+// Items can carry a weight (the file's size), and a consumer claims a run
+// only as long as it stays within its budget, so many light items go out
+// together and a heavy one goes out on its own.
+// A thread that finds the ring full (or empty) spins for a while and then
+// parks; the other side only takes the parking lock to wake it when there
+// is somebody parked.
+//
+// Next to the ring there is a short urgent lane, for the odd item somebody
+// is waiting on. Consumers look there first, so an urgent item goes to the
+// next one to pop, ahead of everything already in the ring.
+//
+typedef struct work_queue_s work_queue_t;
+
+// Depth is rounded up to a power of two, and at least 2
+work_queue_t * create_work_queue(int depth);
+void destroy_work_queue(work_queue_t * queue);
+
+// Adds all num_items, waiting for room as needed. weights may be NULL, for
+// items that weigh nothing.
+void work_queue_push(work_queue_t * queue, const int * items,
+                     const unsigned int * weights, int num_items);
+// Adds as many of num_items as fit right now and returns how many that was
+int work_queue_try_push(work_queue_t * queue, const int * items,
+                        const unsigned int * weights, int num_items);
+// Puts an item in the urgent lane. Returns 0, or -1 if the lane is full.
+int work_queue_push_urgent(work_queue_t * queue, int item);
+// Takes between 1 and max_items (only the one, if it is urgent), waiting
+// for some if needed. Beyond the first, items are only taken while their
+// weights add up to no more than budget. Returns 0 once the queue is closed
+// and empty.
+int work_queue_pop(work_queue_t * queue, int * items, int max_items, uint64_t budget);
+// No more items will be pushed
+void work_queue_close(work_queue_t * queue);
+
+#endif // __WORKQUEUE_H_537__